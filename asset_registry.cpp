@@ -0,0 +1,146 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <asset_registry.h>
+
+using namespace std;
+
+/**
+ * Constructor for the asset registry
+ *
+ * @param mapper	Function used to map raw asset names to payload names
+ * @param maxEntries	The maximum number of asset names to retain
+ * @param ttl		Time in seconds an unused asset name is retained for
+ */
+AssetRegistry::AssetRegistry(Mapper mapper, unsigned int maxEntries, unsigned int ttl) :
+	m_mapper(mapper), m_maxEntries(maxEntries), m_ttl(ttl), m_block(0),
+	m_blockTime(0), m_lastSlot(0), m_evictions(0)
+{
+}
+
+/**
+ * Set the limits of the registry. Any excess entries are removed when the
+ * next block is completed.
+ *
+ * @param maxEntries	The maximum number of asset names to retain, 0 is unlimited
+ * @param ttl		Time in seconds an unused asset name is retained for, 0 is unlimited
+ */
+void AssetRegistry::setLimits(unsigned int maxEntries, unsigned int ttl)
+{
+	m_maxEntries = maxEntries;
+	m_ttl = ttl;
+}
+
+/**
+ * Start a new block of readings, clearing the per-block view
+ */
+void AssetRegistry::beginBlock()
+{
+	m_block++;
+	m_blockTime = time(0);
+	m_blockNames.clear();
+	m_blockSlots.clear();
+	m_lastName.clear();
+}
+
+/**
+ * Lookup a raw asset name and return the slot of the mapped asset name
+ * within the current block. The mapping is cached in the registry, so
+ * the mapper is only called the first time a name is seen.
+ *
+ * Consecutive readings in a block are frequently for the same asset, so
+ * the last name looked up is checked before the hash table.
+ *
+ * @param assetName	The raw asset name of a reading
+ * @return		The slot of the asset in the current block
+ */
+unsigned int AssetRegistry::lookup(const string& assetName)
+{
+	if (!m_lastName.empty() && assetName == m_lastName)
+	{
+		return m_lastSlot;
+	}
+
+	auto it = m_index.find(assetName);
+	if (it == m_index.end())
+	{
+		Entry entry;
+		entry.m_mapped = assetName;
+		m_mapper(entry.m_mapped);
+		entry.m_lastUsed = m_blockTime;
+		entry.m_block = 0;
+		entry.m_slot = 0;
+		it = m_index.insert(pair<string, Entry>(assetName, entry)).first;
+		m_lru.push_front(&it->first);
+		it->second.m_lru = m_lru.begin();
+	}
+	Entry& entry = it->second;
+	if (entry.m_block != m_block)
+	{
+		// First use of this asset in the block
+		entry.m_block = m_block;
+		entry.m_lastUsed = m_blockTime;
+		m_lru.splice(m_lru.begin(), m_lru, entry.m_lru);
+
+		auto slot = m_blockSlots.find(entry.m_mapped);
+		if (slot == m_blockSlots.end())
+		{
+			entry.m_slot = m_blockNames.size();
+			m_blockNames.push_back(entry.m_mapped);
+			m_blockSlots.insert(pair<string, unsigned int>(entry.m_mapped, entry.m_slot));
+		}
+		else
+		{
+			// Another raw name maps to the same asset name
+			entry.m_slot = slot->second;
+		}
+	}
+	m_lastName = assetName;
+	m_lastSlot = entry.m_slot;
+	return entry.m_slot;
+}
+
+/**
+ * Complete the current block and evict any entries that exceed the
+ * registry limits. The per-block view remains valid until the next
+ * call to beginBlock().
+ */
+void AssetRegistry::endBlock()
+{
+	evict(m_blockTime);
+}
+
+/**
+ * Evict the least recently used entries that are either beyond the
+ * maximum size of the registry or have passed their time to live.
+ * Entries used in the current block are never evicted.
+ *
+ * @param now	The time to use for the time to live check
+ */
+void AssetRegistry::evict(time_t now)
+{
+	while (!m_lru.empty())
+	{
+		auto it = m_index.find(*m_lru.back());
+		Entry& entry = it->second;
+		if (entry.m_block == m_block)
+		{
+			break;
+		}
+		bool overSize = m_maxEntries && m_index.size() > m_maxEntries;
+		bool expired = m_ttl && entry.m_lastUsed + (time_t)m_ttl < now;
+		if (!overSize && !expired)
+		{
+			break;
+		}
+		m_lru.pop_back();
+		m_index.erase(it);
+		m_evictions++;
+	}
+}
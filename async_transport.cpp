@@ -0,0 +1,521 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <async_transport.h>
+
+using namespace std;
+
+static const unsigned long kWindowTimeout = 10000;	// Longest wait for a place in the window in milliseconds
+
+/*
+ * Callback functions
+ *
+ * C Functions that are called by the MQTT library for various events
+ */
+
+/**
+ * Callback function that is called when a message for one of the topic we subscribe to arrives.
+ *
+ * @param context	The AsyncTransport object instance
+ * @param topicName	The name of the topic the message arrived on
+ * @param topicLen	The length of the topic name
+ * @param message	The MQTT message content
+ */
+static int messageArrived(void *context, char *topicName, int topicLen, MQTTAsync_message *message)
+{
+AsyncTransport *transport = (AsyncTransport *)context;
+
+	transport->msgArrived(topicName, message);
+	return 1;
+}
+
+/**
+ * Callback function that is called when the MQTT connection is lost
+ *
+ * @param context	The AsyncTransport object instance
+ * @param cause		The cause of the lost connection
+ */
+static void connectionLost(void *context, char *cause)
+{
+AsyncTransport *transport = (AsyncTransport *)context;
+
+	transport->lostConnection(cause);
+}
+
+/**
+ * Callback function that is called when the connection succeeds
+ *
+ * @param context	The AsyncTransport object instance
+ * @param response	The success data
+ */
+static void onConnect(void *context, MQTTAsync_successData *response)
+{
+AsyncTransport *transport = (AsyncTransport *)context;
+
+	transport->connectComplete(MQTTASYNC_SUCCESS);
+}
+
+/**
+ * Callback function that is called when the connection fails
+ *
+ * @param context	The AsyncTransport object instance
+ * @param response	The failure data
+ */
+static void onConnectFailure(void *context, MQTTAsync_failureData *response)
+{
+AsyncTransport *transport = (AsyncTransport *)context;
+
+	transport->connectComplete(response && response->code ? response->code : MQTTASYNC_FAILURE);
+}
+
+/**
+ * Callback function that is called when the disconnection completes
+ *
+ * @param context	The AsyncTransport object instance
+ * @param response	The success data
+ */
+static void onDisconnect(void *context, MQTTAsync_successData *response)
+{
+AsyncTransport *transport = (AsyncTransport *)context;
+
+	transport->disconnectComplete();
+}
+
+/**
+ * Callback function that is called when the disconnection fails
+ *
+ * @param context	The AsyncTransport object instance
+ * @param response	The failure data
+ */
+static void onDisconnectFailure(void *context, MQTTAsync_failureData *response)
+{
+AsyncTransport *transport = (AsyncTransport *)context;
+
+	transport->disconnectComplete();
+}
+
+/**
+ * Callback function that is called when a message has been sent
+ *
+ * @param context	The AsyncTransport object instance
+ * @param response	The success data
+ */
+static void onSend(void *context, MQTTAsync_successData *response)
+{
+AsyncTransport *transport = (AsyncTransport *)context;
+
+	transport->sendComplete(response->token, true, 0);
+}
+
+/**
+ * Callback function that is called when a message has failed to be sent
+ *
+ * @param context	The AsyncTransport object instance
+ * @param response	The failure data
+ */
+static void onSendFailure(void *context, MQTTAsync_failureData *response)
+{
+AsyncTransport *transport = (AsyncTransport *)context;
+
+	transport->sendComplete(response->token, false, response->code);
+}
+
+/**
+ * Constructor for the asynchronous transport
+ *
+ * @param listener	The listener to report events to
+ * @param window	The maximum number of messages in flight
+ */
+AsyncTransport::AsyncTransport(TransportListener *listener, unsigned int window) :
+	MQTTTransport(listener), m_created(false), m_window(window ? window : 1),
+	m_connecting(false), m_connected(false), m_disconnecting(false), m_connectRc(MQTTASYNC_SUCCESS), m_reserved(0),
+	m_earlyUnacked(0), m_maxInFlight(0), m_acks(0), m_failures(0),
+	m_ackLatencyTotal(0.0), m_ackLatencySamples(0), m_ackLatencyMax(0.0)
+{
+	m_log = Logger::getLogger();
+}
+
+/**
+ * Destructor for the asynchronous transport
+ */
+AsyncTransport::~AsyncTransport()
+{
+	disconnect();
+	if (m_created)
+	{
+		MQTTAsync_destroy(&m_client);
+	}
+}
+
+/**
+ * Make a single attempt to connect to the broker, waiting for the outcome
+ * of the connection. The MQTT client is created on the first call and
+ * reused by later calls. If the outcome is not known within the connect
+ * timeout the client is destroyed, abandoning the attempt.
+ *
+ * @param options	The connection options
+ * @return		The connect return code
+ */
+int AsyncTransport::connect(const TransportOptions& options)
+{
+MQTTAsync_connectOptions conn_opts = MQTTAsync_connectOptions_initializer;
+MQTTAsync_SSLOptions sslopts = MQTTAsync_SSLOptions_initializer;
+
+	if (!m_created)
+	{
+		int rc = MQTTAsync_create(&m_client, options.m_address.c_str(),
+				options.m_clientID.c_str(), MQTTCLIENT_PERSISTENCE_NONE, NULL);
+		if (rc != MQTTASYNC_SUCCESS)
+		{
+			return rc;
+		}
+		MQTTAsync_setCallbacks(m_client, this, connectionLost, messageArrived, NULL);
+		m_created = true;
+	}
+	conn_opts.keepAliveInterval = options.m_keepAlive;
+	conn_opts.connectTimeout = options.m_connectTimeout;
+	conn_opts.cleansession = 1;
+	conn_opts.maxInflight = m_window;
+	conn_opts.username = options.m_username;
+	conn_opts.password = options.m_password;
+	conn_opts.onSuccess = onConnect;
+	conn_opts.onFailure = onConnectFailure;
+	conn_opts.context = this;
+	if (options.m_trustStore || options.m_caPath)
+	{
+		sslopts.trustStore = options.m_trustStore;
+		sslopts.CApath = options.m_caPath;
+		sslopts.privateKey = options.m_privateKey;
+		conn_opts.ssl = &sslopts;
+	}
+
+	unique_lock<mutex> lck(m_mutex);
+	m_connecting = true;
+	int rc = MQTTAsync_connect(m_client, &conn_opts);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		m_connecting = false;
+		return rc;
+	}
+	if (!m_cv.wait_for(lck, chrono::seconds(conn_opts.connectTimeout + 1),
+				[this]{ return !m_connecting; }))
+	{
+		m_connecting = false;
+		m_log->error("Timed out waiting for the MQTT connection to complete");
+		// Abandon the attempt so that it can not complete later, the
+		// client is created again for the next attempt
+		m_created = false;
+		lck.unlock();
+		MQTTAsync_destroy(&m_client);
+		lck.lock();
+		m_connected = false;
+		return MQTTASYNC_FAILURE;
+	}
+	return m_connectRc;
+}
+
+/**
+ * Disconnect from the broker, waiting for the disconnection to complete.
+ * Any messages still in flight are abandoned. The client is kept for the
+ * next connection.
+ */
+void AsyncTransport::disconnect()
+{
+	unique_lock<mutex> lck(m_mutex);
+	if (m_created)
+	{
+		MQTTAsync_disconnectOptions opts = MQTTAsync_disconnectOptions_initializer;
+		opts.timeout = 10000;
+		opts.onSuccess = onDisconnect;
+		opts.onFailure = onDisconnectFailure;
+		opts.context = this;
+		m_disconnecting = true;
+		lck.unlock();
+		int rc = MQTTAsync_disconnect(m_client, &opts);
+		lck.lock();
+		if (rc == MQTTASYNC_SUCCESS)
+		{
+			m_cv.wait_for(lck, chrono::milliseconds(opts.timeout + 1000),
+					[this]{ return !m_disconnecting; });
+		}
+		m_disconnecting = false;
+	}
+	m_connected = false;
+	m_inFlight.clear();
+	m_early.clear();
+	m_unacked.clear();
+	m_earlyUnacked = 0;
+	m_cv.notify_all();
+}
+
+/**
+ * Subscribe to a topic
+ *
+ * @param topic	The topic to subscribe to
+ * @param qos	The quality of service of the subscription
+ * @return	The MQTTAsync return code
+ */
+int AsyncTransport::subscribe(const string& topic, int qos)
+{
+MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+
+	if (!m_created)
+	{
+		return MQTTASYNC_DISCONNECTED;
+	}
+	return MQTTAsync_subscribe(m_client, topic.c_str(), qos, &opts);
+}
+
+/**
+ * Publish a message to a topic. If the window of messages in flight is
+ * full the call waits for a message to complete before sending, failing
+ * if none completes in time.
+ *
+ * @param topic		The topic to publish to
+ * @param payload	The message payload
+ * @param length	The length of the payload
+ * @param qos		The quality of service of the message
+ * @param token		Returns the token of the message
+ * @return		The MQTTAsync return code
+ */
+int AsyncTransport::publish(const string& topic, const char *payload, int length, int qos, int *token)
+{
+MQTTAsync_message pubmsg = MQTTAsync_message_initializer;
+MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+
+	unique_lock<mutex> lck(m_mutex);
+	if (!m_created || !m_connected)
+	{
+		return MQTTASYNC_DISCONNECTED;
+	}
+	if (!m_cv.wait_for(lck, chrono::milliseconds(kWindowTimeout),
+				[this]{ return inFlight() + m_reserved < m_window || !m_connected; }))
+	{
+		m_log->error("Timed out waiting for the broker to acknowledge %u messages in flight",
+				(unsigned int)inFlight());
+		return MQTTASYNC_FAILURE;
+	}
+	if (!m_connected)
+	{
+		return MQTTASYNC_DISCONNECTED;
+	}
+	m_reserved++;
+	lck.unlock();
+
+	pubmsg.payload = (void *)payload;
+	pubmsg.payloadlen = length;
+	pubmsg.qos = qos;
+	pubmsg.retained = 0;
+	opts.onSuccess = onSend;
+	opts.onFailure = onSendFailure;
+	opts.context = this;
+	Clock::time_point sent = Clock::now();
+	int rc = MQTTAsync_sendMessage(m_client, topic.c_str(), &pubmsg, &opts);
+	*token = opts.token;
+
+	lck.lock();
+	m_reserved--;
+	if (rc == MQTTASYNC_SUCCESS)
+	{
+		// The completion may have been processed before the token was known
+		if (qos == 0)
+		{
+			if (m_earlyUnacked)
+				m_earlyUnacked--;
+			else
+				m_unacked.push_back(sent);
+		}
+		else
+		{
+			auto early = m_early.find(opts.token);
+			if (early != m_early.end())
+				m_early.erase(early);
+			else
+				m_inFlight.insert(pair<MQTTAsync_token, Clock::time_point>(opts.token, sent));
+		}
+		if (inFlight() > m_maxInFlight)
+		{
+			m_maxInFlight = inFlight();
+		}
+	}
+	m_cv.notify_all();
+	return rc;
+}
+
+/**
+ * Wait for all the messages in flight to complete
+ *
+ * @param timeout	The maximum time to wait in milliseconds
+ * @return		The MQTTAsync return code
+ */
+int AsyncTransport::waitForCompletion(unsigned long timeout)
+{
+	unique_lock<mutex> lck(m_mutex);
+	if (!m_cv.wait_for(lck, chrono::milliseconds(timeout),
+				[this]{ return inFlight() == 0 || !m_connected; }))
+	{
+		return MQTTASYNC_FAILURE;
+	}
+	return m_connected ? MQTTASYNC_SUCCESS : MQTTASYNC_DISCONNECTED;
+}
+
+/**
+ * Retrieve and reset the pipeline statistics
+ *
+ * @param stats	The statistics to populate
+ * @return	Always true
+ */
+bool AsyncTransport::getStatistics(TransportStatistics& stats)
+{
+	lock_guard<mutex> guard(m_mutex);
+	stats.m_maxInFlight = m_maxInFlight;
+	stats.m_acks = m_acks;
+	stats.m_failures = m_failures;
+	stats.m_ackLatencyAvg = m_ackLatencySamples ? m_ackLatencyTotal / m_ackLatencySamples : 0.0;
+	stats.m_ackLatencyMax = m_ackLatencyMax;
+	m_maxInFlight = inFlight();
+	m_acks = 0;
+	m_failures = 0;
+	m_ackLatencyTotal = 0.0;
+	m_ackLatencySamples = 0;
+	m_ackLatencyMax = 0.0;
+	return true;
+}
+
+/**
+ * Pass a message that has arrived to the listener and free it
+ *
+ * @param topic	The topic the message arrived on
+ * @param msg	The message
+ */
+void AsyncTransport::msgArrived(char *topic, MQTTAsync_message *msg)
+{
+	m_listener->msgArrived(topic, (const char *)msg->payload, msg->payloadlen);
+	MQTTAsync_freeMessage(&msg);
+	MQTTAsync_free(topic);
+}
+
+/**
+ * The connection has been lost, release anything waiting on the
+ * window and report it to the listener
+ *
+ * @param reason	The reason for the disconnection
+ */
+void AsyncTransport::lostConnection(const char *reason)
+{
+	{
+		lock_guard<mutex> guard(m_mutex);
+		m_connected = false;
+		m_cv.notify_all();
+	}
+	m_listener->lostConnection(reason);
+}
+
+/**
+ * The outcome of a connection attempt is known
+ *
+ * @param rc	The connection return code
+ */
+void AsyncTransport::connectComplete(int rc)
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_connectRc = rc;
+	m_connected = (rc == MQTTASYNC_SUCCESS);
+	m_connecting = false;
+	m_cv.notify_all();
+}
+
+/**
+ * The disconnection from the broker has completed
+ */
+void AsyncTransport::disconnectComplete()
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_disconnecting = false;
+	m_cv.notify_all();
+}
+
+/**
+ * Record the time taken for a message to be acknowledged. Called with
+ * the mutex held.
+ *
+ * @param sent	The time the message was sent
+ */
+void AsyncTransport::ackLatency(Clock::time_point sent)
+{
+	double latency = chrono::duration<double, milli>(Clock::now() - sent).count();
+
+	m_ackLatencyTotal += latency;
+	m_ackLatencySamples++;
+	if (latency > m_ackLatencyMax)
+		m_ackLatencyMax = latency;
+}
+
+/**
+ * A message in flight has completed, remove it from the window and
+ * record the time it took to be acknowledged.
+ *
+ * @param token		The token of the message
+ * @param success	True if the message was sent
+ * @param code		The failure code
+ */
+void AsyncTransport::sendComplete(MQTTAsync_token token, bool success, int code)
+{
+	{
+		lock_guard<mutex> guard(m_mutex);
+		if (token == 0)
+		{
+			// A QoS 0 message, these complete in the order they were sent
+			if (!m_unacked.empty())
+			{
+				if (success)
+					ackLatency(m_unacked.front());
+				m_unacked.pop_front();
+			}
+			else if (m_reserved)
+			{
+				m_earlyUnacked++;
+			}
+		}
+		else
+		{
+			auto it = m_inFlight.find(token);
+			if (it == m_inFlight.end())
+			{
+				if (m_reserved)
+				{
+					m_early.insert(token);
+				}
+			}
+			else
+			{
+				if (success)
+					ackLatency(it->second);
+				m_inFlight.erase(it);
+			}
+		}
+		if (success)
+		{
+			m_acks++;
+		}
+		else
+		{
+			m_failures++;
+		}
+		m_cv.notify_all();
+	}
+	if (success)
+	{
+		m_listener->delivered(token);
+	}
+	else
+	{
+		m_log->error("MQTT message %d failed to send, %d", token, code);
+	}
+}
@@ -0,0 +1,225 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <batcher.h>
+
+using namespace std;
+
+static const size_t kMinTarget = 4096;		// Smallest target message size
+static const double kInitialReadingSize = 128;	// Estimated size of a reading before any are sent
+static const double kStep = 1.25;		// Factor by which the target is changed
+static const double kTolerance = 0.95;		// Throughput change that is treated as a decrease
+static const size_t kMaxBatch = 16;		// Largest batch as a multiple of the maximum message size
+
+/**
+ * Constructor for the batcher
+ */
+Batcher::Batcher() : m_enabled(false), m_linger(0), m_maxBytes(0), m_target(0),
+	m_bytesPerReading(kInitialReadingSize), m_throughput(0), m_growing(true),
+	m_lastId(0), m_confirmedId(0)
+{
+	m_log = Logger::getLogger();
+}
+
+/**
+ * Destructor for the batcher, the readings in the batch are discarded
+ */
+Batcher::~Batcher()
+{
+	clear();
+}
+
+/**
+ * Configure the batching of readings. Any readings in the batch are
+ * discarded, Fledge will offer them again as they have not been reported
+ * as sent.
+ *
+ * @param enabled	True if readings are to be batched
+ * @param linger	The longest time in milliseconds a reading may wait in the batch
+ * @param maxBytes	The maximum size of a message
+ */
+void Batcher::configure(bool enabled, unsigned int linger, size_t maxBytes)
+{
+	clear();
+	m_enabled = enabled;
+	m_linger = chrono::duration_cast<Clock::duration>(chrono::milliseconds(linger));
+	m_maxBytes = maxBytes < kMinTarget ? kMinTarget : maxBytes;
+	m_target = m_maxBytes / 4 < kMinTarget ? kMinTarget : m_maxBytes / 4;
+	m_bytesPerReading = kInitialReadingSize;
+	m_throughput = 0;
+	m_growing = true;
+	if (m_enabled)
+	{
+		m_log->info("Batching readings for up to %ums in messages of %lu bytes",
+				linger, (unsigned long)m_target);
+	}
+}
+
+/**
+ * Discard the readings in the batch
+ */
+void Batcher::clear()
+{
+	for (auto it = m_readings.begin(); it != m_readings.end(); it++)
+	{
+		delete *it;
+	}
+	m_readings.clear();
+	m_lastId = m_confirmedId;
+}
+
+/**
+ * Add copies of the readings in a block that are not already in the batch.
+ * Once the batch holds as many readings as may be sent at once, which only
+ * happens when sending fails, the remaining readings are left for Fledge
+ * to offer again.
+ *
+ * @param readings	The block of readings
+ */
+void Batcher::add(const vector<Reading *>& readings)
+{
+size_t	limit = m_maxBytes * kMaxBatch;
+
+	for (auto it = readings.cbegin(); it != readings.cend(); it++)
+	{
+		if ((*it)->getId() <= m_lastId)
+		{
+			continue;
+		}
+		if (estimate() >= limit)
+		{
+			break;
+		}
+		if (m_readings.empty())
+		{
+			m_oldest = Clock::now();
+		}
+		m_readings.push_back(new Reading(**it));
+		m_lastId = (*it)->getId();
+	}
+}
+
+/**
+ * Return true if the batch should be sent, because it has reached the
+ * target size or the oldest reading in it has waited for the linger time
+ *
+ * @return	True if the batch should be sent
+ */
+bool Batcher::ready() const
+{
+	if (m_readings.empty())
+	{
+		return false;
+	}
+	return full() || Clock::now() - m_oldest >= m_linger;
+}
+
+/**
+ * Record the result of sending the batch. The readings that were sent are
+ * removed from the batch and the size of a serialized reading is estimated
+ * from the batch. If the batch was full and sent entirely the target
+ * message size is tuned.
+ *
+ * @param n		The number of readings sent
+ * @param bytes		The serialized size of the readings of the batch
+ * @param elapsed	The time taken to send the batch
+ * @param full		True if the batch was sent because it was full
+ */
+void Batcher::sent(size_t n, size_t bytes, Clock::duration elapsed, bool full)
+{
+	if (n == 0)
+	{
+		return;
+	}
+	size_t count = m_readings.size();
+	m_bytesPerReading = (double)bytes / count;
+	m_confirmedId = m_readings[n - 1]->getId();
+	for (size_t i = 0; i < n; i++)
+	{
+		delete m_readings[i];
+	}
+	m_readings.erase(m_readings.begin(), m_readings.begin() + n);
+	if (full && n == count)
+	{
+		tune(bytes, elapsed);
+	}
+}
+
+/**
+ * Tune the target message size. The target keeps moving in the same
+ * direction while the throughput increases and reverses when it falls,
+ * but is always reduced if sending took longer than the linger time.
+ *
+ * @param bytes		The serialized size of the readings sent
+ * @param elapsed	The time taken to send them
+ */
+void Batcher::tune(size_t bytes, Clock::duration elapsed)
+{
+	double seconds = chrono::duration<double>(elapsed).count();
+	double throughput = seconds > 0.0 ? bytes / seconds : 0.0;
+
+	if (elapsed > m_linger)
+	{
+		m_growing = false;
+	}
+	else if (throughput < m_throughput * kTolerance)
+	{
+		m_growing = !m_growing;
+	}
+	m_throughput = throughput;
+
+	size_t target = m_growing ? m_target * kStep : m_target / kStep;
+	if (target > m_maxBytes)
+		target = m_maxBytes;
+	if (target < kMinTarget)
+		target = kMinTarget;
+	if (target != m_target)
+	{
+		m_log->debug("Batch throughput %.0f bytes per second in %.1fms, target message size now %lu bytes",
+				throughput, seconds * 1000.0, (unsigned long)target);
+		m_target = target;
+	}
+}
+
+/**
+ * Increase the target message size, because the rate at which messages
+ * may be published is limited
+ */
+void Batcher::grow()
+{
+	size_t target = m_target * kStep;
+
+	if (target > m_maxBytes)
+		target = m_maxBytes;
+	if (target != m_target)
+	{
+		m_log->debug("Message rate is limited, target message size now %lu bytes",
+				(unsigned long)target);
+		m_target = target;
+	}
+	m_growing = true;
+}
+
+/**
+ * Return the number of readings at the start of a block that have been
+ * sent as part of a batch
+ *
+ * @param readings	The block of readings
+ * @return		The number of readings sent
+ */
+uint32_t Batcher::confirmed(const vector<Reading *>& readings) const
+{
+uint32_t n = 0;
+
+	while (n < readings.size() && readings[n]->getId() <= m_confirmedId)
+	{
+		n++;
+	}
+	return n;
+}
@@ -0,0 +1,247 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Benchmark of the plugin against a local MQTT broker.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <gcp.h>
+#include <synthetic.h>
+#include <config_category.h>
+#include <reading.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * The configuration the benchmark uses, any item may be overridden on the
+ * command line as name=value
+ */
+static map<string, string> config = {
+	{ "project_id", "benchmark" },
+	{ "region", "local" },
+	{ "registry_id", "benchmark" },
+	{ "device_id", "benchmark" },
+	{ "key", "device" },
+	{ "algorithm", "RS256" },
+	{ "broker_host", "localhost" },
+	{ "broker_port", "8883" },
+	{ "tls", "true" },
+	{ "root_certificate", "ca" }
+};
+
+/**
+ * Create the configuration category for the plugin
+ *
+ * @return	The configuration category
+ */
+static ConfigCategory *createConfig()
+{
+string json = "{";
+
+	for (auto it = config.begin(); it != config.end(); it++)
+	{
+		if (it != config.begin())
+			json += ",";
+		json += "\"" + it->first + "\" : { \"description\" : \"\", \"type\" : \"string\", ";
+		json += "\"default\" : \"" + it->second + "\", ";
+		json += "\"value\" : \"" + it->second + "\" }";
+	}
+	json += "}";
+	return new ConfigCategory("GCP", json);
+}
+
+static const int kMaxStalls = 1000;	// Calls that send nothing before a block fails
+static const int kRetryDelay = 10;	// Milliseconds between calls that send nothing
+
+/**
+ * Send a block of readings in the way the north service does, offering
+ * the readings that were not sent again until all of them have been sent.
+ * When nothing is sent the readings are offered again after a short
+ * delay, as they are when the plugin is batching readings.
+ *
+ * @param gcp		The plugin instance
+ * @param readings	The block of readings
+ * @return		True if the block was sent
+ */
+static bool sendAll(GCP *gcp, const vector<Reading *>& readings)
+{
+size_t	sent = 0;
+int	stalled = 0;
+
+	while (sent < readings.size())
+	{
+		vector<Reading *> remaining(readings.begin() + sent, readings.end());
+		uint32_t n = gcp->send(remaining);
+		if (n == 0)
+		{
+			if (++stalled > kMaxStalls)
+				return false;
+			this_thread::sleep_for(chrono::milliseconds(kRetryDelay));
+			continue;
+		}
+		stalled = 0;
+		sent += n;
+	}
+	return true;
+}
+
+/**
+ * Return a percentile of a set of sorted latencies
+ */
+static double percentile(const vector<double>& sorted, double p)
+{
+	if (sorted.empty())
+		return 0.0;
+	size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+	return sorted[index];
+}
+
+/**
+ * Run a scenario and report the results
+ *
+ * @param gcp		The plugin instance
+ * @param scenario	The shape of the readings
+ * @param blocks	The number of blocks to send
+ * @param id		The ID of the next reading
+ * @return		True if all the blocks were sent
+ */
+static bool run(GCP *gcp, const Scenario& scenario, unsigned int blocks, unsigned long& id)
+{
+vector<double>	latencies;
+double		total = 0.0;
+unsigned long	allocs = 0;
+unsigned long	bytes = gcp->bytesPublished();
+bool		ok = true;
+
+	for (unsigned int b = 0; b < blocks && ok; b++)
+	{
+		vector<Reading *> readings;
+		generateReadings(scenario, id, readings);
+
+		unsigned long before = allocations.load();
+		auto start = chrono::steady_clock::now();
+		ok = sendAll(gcp, readings);
+		double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		allocs += allocations.load() - before;
+
+		latencies.push_back(elapsed * 1000.0);
+		total += elapsed;
+		freeReadings(readings);
+	}
+	bytes = gcp->bytesPublished() - bytes;
+	sort(latencies.begin(), latencies.end());
+
+	unsigned long count = latencies.size() * scenario.m_blockSize;
+	printf("%6u %4u %-6s %6u %12.0f %14.0f %10.3f %10.3f %10.2f%s\n",
+			scenario.m_assets, scenario.m_datapoints,
+			Scenario::typeName(scenario.m_type), scenario.m_blockSize,
+			total > 0.0 ? count / total : 0.0,
+			total > 0.0 ? bytes / total : 0.0,
+			percentile(latencies, 0.50), percentile(latencies, 0.99),
+			count ? (double)allocs / count : 0.0,
+			ok ? "" : "  FAILED");
+	fflush(stdout);
+	return ok;
+}
+
+/**
+ * Benchmark the plugin against a broker. Arguments of the form name=value
+ * override the plugin configuration, with the exception of blocks, which
+ * sets the number of blocks sent for each scenario.
+ */
+int main(int argc, char **argv)
+{
+unsigned int	blocks = 20;
+unsigned long	id = 1;
+unsigned int	failures = 0;
+unsigned int	assets[] = { 1, 10, 100 };
+unsigned int	datapoints[] = { 1, 5, 20 };
+unsigned int	blockSizes[] = { 100, 1000, 5000 };
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char *eq = strchr(argv[i], '=');
+		if (!eq)
+		{
+			fprintf(stderr, "Usage: %s [blocks=<n>] [<config item>=<value> ...]\n", argv[0]);
+			return 1;
+		}
+		string name(argv[i], eq - argv[i]);
+		if (name.compare("blocks") == 0)
+			blocks = strtoul(eq + 1, NULL, 10);
+		else
+			config[name] = eq + 1;
+	}
+
+	/*
+	 * Start the plugin as plugin_init does and measure the time until
+	 * the call returns and until the first reading has been published.
+	 */
+	ConfigCategory *conf = createConfig();
+	auto begin = chrono::steady_clock::now();
+	GCP *gcp = new GCP();
+	gcp->configure(conf);
+	gcp->start();
+	double init = chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+	Scenario first;
+	first.m_assets = 1;
+	first.m_datapoints = 1;
+	first.m_type = Scenario::Integer;
+	first.m_blockSize = 1;
+	vector<Reading *> readings;
+	generateReadings(first, id, readings);
+	bool published = sendAll(gcp, readings);
+	double ready = chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+	freeReadings(readings);
+	if (published)
+	{
+		printf("Startup took %.1fms, the first reading was published after %.1fms\n",
+				init, ready);
+	}
+	else
+	{
+		fprintf(stderr, "Unable to publish to the broker at %s:%s\n",
+				config["broker_host"].c_str(), config["broker_port"].c_str());
+		failures++;
+	}
+
+	printf("%6s %4s %-6s %6s %12s %14s %10s %10s %10s\n",
+			"assets", "dps", "type", "block", "readings/s", "bytes/s",
+			"p50 ms", "p99 ms", "allocs/rdg");
+	for (unsigned int a = 0; a < sizeof(assets) / sizeof(assets[0]); a++)
+	{
+		for (unsigned int d = 0; d < sizeof(datapoints) / sizeof(datapoints[0]); d++)
+		{
+			for (int t = Scenario::Integer; t <= Scenario::Mixed; t++)
+			{
+				for (unsigned int s = 0; s < sizeof(blockSizes) / sizeof(blockSizes[0]); s++)
+				{
+					Scenario scenario;
+					scenario.m_assets = assets[a];
+					scenario.m_datapoints = datapoints[d];
+					scenario.m_type = (Scenario::Type)t;
+					scenario.m_blockSize = blockSizes[s];
+					if (!run(gcp, scenario, blocks, id))
+						failures++;
+				}
+			}
+		}
+	}
+
+	delete gcp;
+	delete conf;
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Run the plugin benchmark against a local mosquitto broker.
+#
+# A self signed certificate authority, a certificate for the broker and a
+# key for the device are created in a temporary Fledge data directory, the
+# broker is started with a TLS listener and the benchmark is run against it.
+# Any arguments are passed to the benchmark, e.g.
+#
+#	run_benchmark.sh blocks=50 transport=Asynchronous qos=1
+#
+BENCHMARK=${BENCHMARK:-./gcp_benchmark}
+PORT=${PORT:-8883}
+
+command -v mosquitto >/dev/null || { echo "mosquitto is required to run the benchmark" >&2; exit 1; }
+command -v openssl >/dev/null || { echo "openssl is required to run the benchmark" >&2; exit 1; }
+
+WORK=$(mktemp -d)
+PEM=$WORK/etc/certs/pem
+mkdir -p $PEM
+trap 'kill $BROKER 2>/dev/null; rm -rf $WORK' EXIT
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=Benchmark CA" \
+	-keyout $WORK/ca.key -out $PEM/ca.pem 2>/dev/null
+openssl req -newkey rsa:2048 -nodes -subj "/CN=localhost" \
+	-keyout $WORK/server.key -out $WORK/server.csr 2>/dev/null
+openssl x509 -req -in $WORK/server.csr -CA $PEM/ca.pem -CAkey $WORK/ca.key \
+	-CAcreateserial -days 1 -out $WORK/server.pem 2>/dev/null
+openssl genpkey -algorithm RSA -pkeyopt rsa_keygen_bits:2048 -out $PEM/device.pem 2>/dev/null
+
+cat > $WORK/mosquitto.conf <<CONF
+listener $PORT
+cafile $PEM/ca.pem
+certfile $WORK/server.pem
+keyfile $WORK/server.key
+allow_anonymous true
+max_inflight_messages 0
+message_size_limit 0
+CONF
+
+mosquitto -c $WORK/mosquitto.conf >$WORK/mosquitto.log 2>&1 &
+BROKER=$!
+sleep 1
+
+FLEDGE_DATA=$WORK $BENCHMARK broker_port=$PORT "$@"
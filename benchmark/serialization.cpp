@@ -0,0 +1,569 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Microbenchmark of the serialization of readings.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <synthetic.h>
+#include <message_builder.h>
+#include <payload_writer.h>
+#include <timestamp_encoder.h>
+#include <sys/time.h>
+#include <math.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <functional>
+#include <thread>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * The options of the benchmark run
+ */
+static double	minTime = 0.5;
+static string	filter;
+static string	output;
+static int	failures = 0;
+
+/**
+ * The result of a benchmark
+ */
+class Result {
+	public:
+		string		m_name;
+		unsigned long	m_iterations;
+		double		m_realTime;
+		double		m_cpuTime;
+		double		m_itemsPerSecond;
+		double		m_bytesPerSecond;
+		double		m_allocs;
+};
+
+static vector<Result> results;
+
+/**
+ * Return the CPU time used by the process in seconds
+ */
+static double cpuTime()
+{
+struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+/**
+ * Return the elapsed time in seconds
+ */
+static double realTime()
+{
+struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+/**
+ * Run a benchmark repeatedly until it has run for the minimum time. The
+ * operation returns the number of bytes it produced.
+ *
+ * @param name		The name of the benchmark
+ * @param items		The number of readings processed by each operation
+ * @param op		The operation to measure
+ */
+static void measure(const string& name, size_t items, function<size_t()> op)
+{
+Result		result;
+unsigned long	iterations = 0;
+unsigned long	bytes = 0;
+
+	if (!filter.empty() && name.find(filter) == string::npos)
+		return;
+
+	op();		// Warm the buffers and caches of the plugin
+
+	unsigned long allocs = allocations.load();
+	double cpu = cpuTime();
+	double start = realTime();
+	double elapsed;
+	do {
+		bytes += op();
+		iterations++;
+		elapsed = realTime() - start;
+	} while (elapsed < minTime);
+	cpu = cpuTime() - cpu;
+	allocs = allocations.load() - allocs;
+
+	result.m_name = name;
+	result.m_iterations = iterations;
+	result.m_realTime = elapsed * 1.0e9 / iterations;
+	result.m_cpuTime = cpu * 1.0e9 / iterations;
+	result.m_itemsPerSecond = items * iterations / elapsed;
+	result.m_bytesPerSecond = bytes / elapsed;
+	result.m_allocs = (double)allocs / iterations;
+	results.push_back(result);
+
+	fprintf(stderr, "%-50s %10lu %14.0f ns %12.0f items/s %10.2f allocs\n",
+			name.c_str(), iterations, result.m_realTime,
+			result.m_itemsPerSecond, result.m_allocs);
+}
+
+/**
+ * Write the results in the JSON format of Google Benchmark, so that the
+ * tools that compare two runs of it may be used to find regressions
+ *
+ * @param fp	The file to write to
+ */
+static void report(FILE *fp)
+{
+char	date[64];
+time_t	now = time(NULL);
+
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+	fprintf(fp, "{\n  \"context\": {\n");
+	fprintf(fp, "    \"date\": \"%s\",\n", date);
+	fprintf(fp, "    \"executable\": \"gcp_serialization_benchmark\",\n");
+	fprintf(fp, "    \"min_time\": %.3f\n", minTime);
+	fprintf(fp, "  },\n  \"benchmarks\": [\n");
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const Result& r = results[i];
+		fprintf(fp, "    {\n");
+		fprintf(fp, "      \"name\": \"%s\",\n", r.m_name.c_str());
+		fprintf(fp, "      \"run_name\": \"%s\",\n", r.m_name.c_str());
+		fprintf(fp, "      \"run_type\": \"iteration\",\n");
+		fprintf(fp, "      \"iterations\": %lu,\n", r.m_iterations);
+		fprintf(fp, "      \"real_time\": %.3f,\n", r.m_realTime);
+		fprintf(fp, "      \"cpu_time\": %.3f,\n", r.m_cpuTime);
+		fprintf(fp, "      \"time_unit\": \"ns\",\n");
+		fprintf(fp, "      \"items_per_second\": %.3f,\n", r.m_itemsPerSecond);
+		fprintf(fp, "      \"bytes_per_second\": %.3f,\n", r.m_bytesPerSecond);
+		fprintf(fp, "      \"allocs_per_iteration\": %.3f\n", r.m_allocs);
+		fprintf(fp, "    }%s\n", i + 1 < results.size() ? "," : "");
+	}
+	fprintf(fp, "  ]\n}\n");
+}
+
+/**
+ * Benchmark the serialization of each reading of a block in isolation, the
+ * timestamp, the datapoints and the fragment written by the payload writer
+ *
+ * @param scenario	The shape of the readings
+ */
+static void kernels(const Scenario& scenario)
+{
+vector<Reading *>	readings;
+unsigned long		id = 1;
+PayloadWriter		writer;
+TimestampEncoder	timestamps;
+string			suffix;
+
+	generateReadings(scenario, id, readings);
+	suffix = string("/type:") + Scenario::typeName(scenario.m_type)
+		+ "/block:" + to_string(scenario.m_blockSize);
+
+	measure("timestamp" + suffix, readings.size(), [&]() {
+		size_t bytes = 0;
+		for (auto it = readings.begin(); it != readings.end(); it++)
+			bytes += (*it)->getAssetDateUserTime(Reading::FMT_DEFAULT, true).length();
+		return bytes;
+	});
+	measure("timestamp_encoder" + suffix, readings.size(), [&]() {
+		size_t bytes = 0, length;
+		for (auto it = readings.begin(); it != readings.end(); it++)
+		{
+			timestamps.date(*it, &length);
+			bytes += length;
+		}
+		return bytes;
+	});
+	measure("datapoint" + suffix, readings.size(), [&]() {
+		size_t bytes = 0;
+		for (auto it = readings.begin(); it != readings.end(); it++)
+		{
+			vector<Datapoint *>& datapoints = (*it)->getReadingData();
+			for (auto dp = datapoints.begin(); dp != datapoints.end(); dp++)
+				bytes += (*dp)->toJSONProperty().length();
+		}
+		return bytes;
+	});
+	measure("datapoint_writer" + suffix, readings.size(), [&]() {
+		writer.clear();
+		for (auto it = readings.begin(); it != readings.end(); it++)
+		{
+			vector<Datapoint *>& datapoints = (*it)->getReadingData();
+			for (auto dp = datapoints.begin(); dp != datapoints.end(); dp++)
+				writer.appendDatapoint(*dp);
+		}
+		return writer.length();
+	});
+	measure("fragment" + suffix, readings.size(), [&]() {
+		writer.clear();
+		for (auto it = readings.begin(); it != readings.end(); it++)
+			writer.appendReading(*it);
+		return writer.length();
+	});
+	freeReadings(readings);
+}
+
+/**
+ * Check the timestamp encoder gives the same strings as the readings, for
+ * readings within a second, across the end of a second, with timestamps
+ * that go backwards and for random timestamps
+ */
+static void checkTimestamps()
+{
+vector<Reading *>	readings;
+TimestampEncoder	timestamps;
+mt19937_64		random(1);
+struct timeval		tv;
+unsigned long		mismatches = 0;
+
+	gettimeofday(&tv, NULL);
+	tv.tv_usec = 999000;
+	for (int i = 0; i < 20000; i++)
+	{
+		struct timeval ts = tv;
+		switch (i % 4)
+		{
+			case 0:
+			case 1:
+				// Readings at 1kHz across several seconds
+				ts.tv_sec += i / 1000;
+				ts.tv_usec = (i % 1000) * 1000 + 999;
+				break;
+			case 2:
+				// Random timestamps, including the ends of a second
+				ts.tv_sec = random() % 4102444800L;
+				ts.tv_usec = (i % 3 == 0) ? 0 : (i % 3 == 1) ? 999999 : random() % 1000000;
+				break;
+			default:
+				// Backwards within the same second
+				ts.tv_usec = 999999 - i % 1000000;
+				break;
+		}
+		DatapointValue value((long)i);
+		Reading *reading = new Reading("timestamp", new Datapoint("value", value));
+		reading->setUserTimestamp(ts);
+		readings.push_back(reading);
+	}
+	for (auto it = readings.begin(); it != readings.end(); it++)
+	{
+		size_t length;
+		const char *date = timestamps.date(*it, &length);
+		string expected = (*it)->getAssetDateUserTime(Reading::FMT_DEFAULT, true);
+		if (expected.compare(0, string::npos, date, length) != 0)
+		{
+			if (mismatches++ < 10)
+				fprintf(stderr, "Timestamp mismatch: %s, expected %s\n",
+						string(date, length).c_str(), expected.c_str());
+		}
+	}
+	if (mismatches)
+	{
+		fprintf(stderr, "%lu of %lu timestamps differ\n", mismatches,
+				(unsigned long)readings.size());
+		failures++;
+	}
+	freeReadings(readings);
+}
+
+/**
+ * Check the datapoints written by the payload writer are the same as the
+ * JSON created by the datapoints, for integers, floating point values
+ * across the whole range including values that must be rounded, arrays of
+ * floating point values and strings that do and do not need escaping
+ */
+static void checkValues()
+{
+vector<Datapoint *>	datapoints;
+mt19937_64		random(2);
+PayloadWriter		writer;
+unsigned long		mismatches = 0;
+double			special[] = { 0.0, -0.0, 0.5, 1e-10, 5e-11, 1.5e-10, 2.5e-10,
+				-5e-11, 1e-300, 4.9e-324, 0.1, 123456.789, 1e15, 1e18,
+				1e19, 1e300, numeric_limits<double>::infinity(),
+				-numeric_limits<double>::infinity(),
+				numeric_limits<double>::quiet_NaN() };
+
+	for (unsigned int i = 0; i < sizeof(special) / sizeof(special[0]); i++)
+	{
+		DatapointValue value(special[i]);
+		datapoints.push_back(new Datapoint("special", value));
+	}
+	for (int i = 0; i < 100000; i++)
+	{
+		uint64_t bits = random();
+		double d;
+		memcpy(&d, &bits, sizeof(d));
+		long l = (long)random() >> (random() % 64);
+		switch (i % 6)
+		{
+			case 0:
+			{
+				DatapointValue value(l);
+				datapoints.push_back(new Datapoint("integer", value));
+				break;
+			}
+			case 1:
+			{
+				// Any bit pattern
+				DatapointValue value(d);
+				datapoints.push_back(new Datapoint("bits", value));
+				break;
+			}
+			case 2:
+			{
+				// Typical measurements, and exact binary fractions that round
+				DatapointValue value(i % 4 ? (double)(l % 100000000) / 1000.0
+						: ldexp((double)(random() % (1ULL << 40)), -(int)(random() % 60)));
+				datapoints.push_back(new Datapoint("measurement", value));
+				break;
+			}
+			case 3:
+			{
+				vector<double> arr;
+				for (int j = 0; j < i % 7; j++)
+					arr.push_back((double)(random() % 2000000) / 7.0 - 100000.0);
+				DatapointValue value(arr);
+				datapoints.push_back(new Datapoint("array", value));
+				break;
+			}
+			default:
+			{
+				string str;
+				int length = random() % 40;
+				for (int j = 0; j < length; j++)
+				{
+					char ch = ' ' + random() % 95;
+					if (i % 5 == 0 && random() % 20 == 0)
+						ch = "\"\\\n\t\x01"[random() % 5];
+					str += ch;
+				}
+				DatapointValue value(str);
+				datapoints.push_back(new Datapoint("string", value));
+				break;
+			}
+		}
+	}
+	for (auto dp = datapoints.begin(); dp != datapoints.end(); dp++)
+	{
+		writer.clear();
+		writer.appendDatapoint(*dp);
+		string expected = (*dp)->toJSONProperty();
+		if (expected.compare(0, string::npos, writer.data(), writer.length()) != 0)
+		{
+			if (mismatches++ < 10)
+				fprintf(stderr, "Datapoint mismatch: %s, expected %s\n",
+						writer.data(), expected.c_str());
+		}
+		delete *dp;
+	}
+	if (mismatches)
+	{
+		fprintf(stderr, "%lu of %lu datapoints differ\n", mismatches,
+				(unsigned long)datapoints.size());
+		failures++;
+	}
+}
+
+/**
+ * Benchmark the building of the messages for a block, which groups the
+ * readings by asset and assembles them into messages
+ *
+ * @param scenario	The shape of the readings
+ */
+static void builder(const Scenario& scenario)
+{
+vector<Reading *>	readings;
+unsigned long		id = 1;
+const char		*formats[] = { "JSON", "Columnar", "CBOR", "MessagePack" };
+
+	generateReadings(scenario, id, readings);
+	for (unsigned int f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+	{
+		MessageBuilder messages;
+		string format = formats[f];
+		if (format.compare("Columnar") == 0)
+		{
+			messages.setFormat("JSON");
+			messages.setLayout("Columnar");
+		}
+		else
+		{
+			messages.setFormat(format);
+		}
+		messages.setLimits(256 * 1024, 0);
+		string name = "message/format:" + format
+			+ "/block:" + to_string(scenario.m_blockSize)
+			+ "/assets:" + to_string(scenario.m_assets);
+		// Check the messages cover the whole block before timing them
+		size_t end = 0;
+		messages.setBlock(readings);
+		while (messages.next())
+			end = messages.end();
+		if (end != readings.size())
+		{
+			fprintf(stderr, "%s: messages end at reading %lu of %lu\n",
+					name.c_str(), (unsigned long)end,
+					(unsigned long)readings.size());
+			failures++;
+			continue;
+		}
+		measure(name, readings.size(), [&]() {
+			size_t bytes = 0;
+			messages.setBlock(readings);
+			while (messages.next())
+				bytes += messages.length();
+			return bytes;
+		});
+	}
+	freeReadings(readings);
+}
+
+/**
+ * Benchmark the building of the messages for a large block on 1 to n
+ * threads, checking the messages are the same as those built on a single
+ * thread
+ *
+ * @param scenario	The shape of the readings
+ */
+static void scaling(const Scenario& scenario)
+{
+vector<Reading *>	readings;
+unsigned long		id = 1;
+unsigned int		cores = thread::hardware_concurrency();
+const char		*layouts[] = { "Rows", "Columnar" };
+
+	generateReadings(scenario, id, readings);
+	if (cores < 2)
+	{
+		cores = 2;
+	}
+	for (unsigned int l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++)
+	{
+		string expected;
+		for (unsigned int threads = 1; threads <= cores; threads++)
+		{
+			MessageBuilder messages;
+			messages.setLayout(layouts[l]);
+			messages.setLimits(256 * 1024, 0);
+			messages.setParallel(threads, 0);
+
+			string built;
+			messages.setBlock(readings);
+			while (messages.next())
+				built.append(messages.data(), messages.length());
+			if (threads == 1)
+			{
+				expected = built;
+			}
+			else if (built != expected)
+			{
+				fprintf(stderr, "%s messages built on %u threads differ from those built on one thread\n",
+						layouts[l], threads);
+				failures++;
+				continue;
+			}
+
+			string name = string("parallel/layout:") + layouts[l]
+				+ "/block:" + to_string(scenario.m_blockSize)
+				+ "/assets:" + to_string(scenario.m_assets)
+				+ "/threads:" + to_string(threads);
+			measure(name, readings.size(), [&]() {
+				size_t bytes = 0;
+				messages.setBlock(readings);
+				while (messages.next())
+					bytes += messages.length();
+				return bytes;
+			});
+		}
+	}
+	freeReadings(readings);
+}
+
+/**
+ * Benchmark the serialization of readings without a broker. The options
+ * are
+ *
+ *	--filter=<text>		Only run benchmarks whose name contains text
+ *	--min_time=<seconds>	The minimum time to run each benchmark
+ *	--out=<file>		Write the JSON results to file, not stdout
+ */
+int main(int argc, char **argv)
+{
+unsigned int	blockSizes[] = { 1, 100, 1000, 10000, 100000 };
+unsigned int	assets[] = { 1, 10, 100, 1000, 10000 };
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "--filter=", 9) == 0)
+			filter = argv[i] + 9;
+		else if (strncmp(argv[i], "--min_time=", 11) == 0)
+			minTime = strtod(argv[i] + 11, NULL);
+		else if (strncmp(argv[i], "--out=", 6) == 0)
+			output = argv[i] + 6;
+		else
+		{
+			fprintf(stderr, "Usage: %s [--filter=<text>] [--min_time=<seconds>] [--out=<file>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	checkTimestamps();
+	checkValues();
+
+	for (int t = Scenario::Integer; t <= Scenario::Mixed; t++)
+	{
+		Scenario scenario;
+		scenario.m_assets = 10;
+		scenario.m_datapoints = 5;
+		scenario.m_type = (Scenario::Type)t;
+		scenario.m_blockSize = 1000;
+		kernels(scenario);
+	}
+
+	for (unsigned int b = 0; b < sizeof(blockSizes) / sizeof(blockSizes[0]); b++)
+	{
+		for (unsigned int a = 0; a < sizeof(assets) / sizeof(assets[0]); a++)
+		{
+			if (assets[a] > blockSizes[b])
+				continue;
+			Scenario scenario;
+			scenario.m_assets = assets[a];
+			scenario.m_datapoints = 5;
+			scenario.m_type = Scenario::Mixed;
+			scenario.m_blockSize = blockSizes[b];
+			builder(scenario);
+		}
+	}
+
+	Scenario large;
+	large.m_assets = 100;
+	large.m_datapoints = 5;
+	large.m_type = Scenario::Mixed;
+	large.m_blockSize = 100000;
+	scaling(large);
+
+	FILE *fp = stdout;
+	if (!output.empty() && (fp = fopen(output.c_str(), "w")) == NULL)
+	{
+		fprintf(stderr, "Unable to write %s\n", output.c_str());
+		return 1;
+	}
+	report(fp);
+	if (fp != stdout)
+		fclose(fp);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Synthetic readings for the benchmarks.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <synthetic.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <new>
+#include <string>
+
+using namespace std;
+
+atomic<unsigned long> allocations(0);
+
+/*
+ * Count every allocation made by the process, the benchmarks read the
+ * counter either side of the code they measure.
+ */
+void *operator new(size_t size)
+{
+	allocations.fetch_add(1, memory_order_relaxed);
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete[](void *p) noexcept
+{
+	free(p);
+}
+
+/**
+ * Return the name of a type of datapoint
+ */
+const char *Scenario::typeName(Type type)
+{
+	static const char *names[] = { "int", "float", "string", "mixed" };
+
+	return names[type];
+}
+
+/**
+ * Generate a block of synthetic readings. The readings are spread over the
+ * assets in turn and have increasing IDs and timestamps, as they would if
+ * read from the storage service. Mixed readings have integer, float and
+ * string datapoints in turn.
+ *
+ * @param scenario	The shape of the readings
+ * @param id		The ID of the first reading, updated to the next ID
+ * @param readings	The vector to populate
+ */
+void generateReadings(const Scenario& scenario, unsigned long& id, vector<Reading *>& readings)
+{
+struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	for (unsigned int i = 0; i < scenario.m_blockSize; i++)
+	{
+		vector<Datapoint *> values;
+		for (unsigned int d = 0; d < scenario.m_datapoints; d++)
+		{
+			string name = "dp" + to_string(d);
+			Scenario::Type type = scenario.m_type;
+			if (type == Scenario::Mixed)
+			{
+				type = (Scenario::Type)(d % 3);
+			}
+			switch (type)
+			{
+				case Scenario::Integer:
+				{
+					DatapointValue value((long)(id * 7 + d));
+					values.push_back(new Datapoint(name, value));
+					break;
+				}
+				case Scenario::String:
+				{
+					DatapointValue value(string("state ") + to_string((id + d) % 16));
+					values.push_back(new Datapoint(name, value));
+					break;
+				}
+				default:
+				{
+					DatapointValue value((double)(id % 1000) / 7.0 + d);
+					values.push_back(new Datapoint(name, value));
+					break;
+				}
+			}
+		}
+		Reading *reading = new Reading("asset" + to_string(i % scenario.m_assets), values);
+		reading->setId(id++);
+		reading->setUserTimestamp(tv);
+		readings.push_back(reading);
+		tv.tv_usec += 1000;
+		if (tv.tv_usec >= 1000000)
+		{
+			tv.tv_usec -= 1000000;
+			tv.tv_sec++;
+		}
+	}
+}
+
+/**
+ * Delete a block of readings
+ *
+ * @param readings	The readings to delete
+ */
+void freeReadings(vector<Reading *>& readings)
+{
+	for (auto it = readings.begin(); it != readings.end(); it++)
+	{
+		delete *it;
+	}
+	readings.clear();
+}
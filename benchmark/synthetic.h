@@ -0,0 +1,29 @@
+#ifndef _SYNTHETIC_H
+#define _SYNTHETIC_H
+#include <reading.h>
+#include <atomic>
+#include <vector>
+
+/**
+ * The number of allocations made by the process, counted by replacing the
+ * global operator new
+ */
+extern std::atomic<unsigned long> allocations;
+
+/**
+ * The shape of a block of synthetic readings
+ */
+class Scenario {
+	public:
+		enum Type { Integer, Float, String, Mixed };
+		static const char	*typeName(Type type);
+		unsigned int	m_assets;
+		unsigned int	m_datapoints;
+		Type		m_type;
+		unsigned int	m_blockSize;
+};
+
+void	generateReadings(const Scenario& scenario, unsigned long& id,
+			std::vector<Reading *>& readings);
+void	freeReadings(std::vector<Reading *>& readings);
+#endif
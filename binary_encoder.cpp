@@ -0,0 +1,343 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <binary_encoder.h>
+#include <databuffer.h>
+#include <dpimage.h>
+#include <string.h>
+
+using namespace std;
+
+/*
+ * CBOR major types
+ */
+#define CBOR_UINT	0
+#define CBOR_NEGINT	1
+#define CBOR_BYTES	2
+#define CBOR_TEXT	3
+#define CBOR_ARRAY	4
+#define CBOR_MAP	5
+
+/**
+ * Append a reading as a map with the user timestamp as the "ts" entry,
+ * a string or an integer number of microseconds since the epoch,
+ * followed by an entry for each of the datapoints in the reading
+ *
+ * @param out		The buffer to write to
+ * @param reading	The reading to append
+ */
+void BinaryEncoder::appendReading(PayloadWriter& out, Reading *reading)
+{
+	const vector<Datapoint *>& dpv = reading->getReadingData();
+	writeMap(out, dpv.size() + 1);
+	writeString(out, "ts", 2);
+	TimestampEncoder& timestamps = out.timestamps();
+	if (timestamps.format() == TimestampEncoder::EpochMicros)
+	{
+		writeInt(out, TimestampEncoder::micros(reading));
+	}
+	else
+	{
+		size_t length;
+		const char *ts = timestamps.date(reading, &length);
+		writeString(out, ts, length);
+	}
+	for (auto dp = dpv.cbegin(); dp != dpv.cend(); dp++)
+	{
+		writeDatapoint(out, *dp);
+	}
+}
+
+/**
+ * Write a datapoint as a name and value pair of a map
+ *
+ * @param out		The buffer to write to
+ * @param datapoint	The datapoint to write
+ */
+void BinaryEncoder::writeDatapoint(PayloadWriter& out, Datapoint *datapoint)
+{
+	const string name = datapoint->getName();
+	writeString(out, name.data(), name.length());
+	writeValue(out, datapoint->getData());
+}
+
+/**
+ * Write a datapoint value in its native type. Types that have no
+ * binary representation are written as their JSON string.
+ *
+ * @param out		The buffer to write to
+ * @param value		The value to write
+ */
+void BinaryEncoder::writeValue(PayloadWriter& out, DatapointValue& value)
+{
+	switch (value.getType())
+	{
+		case DatapointValue::T_INTEGER:
+			writeInt(out, value.toInt());
+			break;
+		case DatapointValue::T_FLOAT:
+			writeDouble(out, value.toDouble());
+			break;
+		case DatapointValue::T_STRING:
+		{
+			string str = value.toStringValue();
+			writeString(out, str.data(), str.length());
+			break;
+		}
+		case DatapointValue::T_FLOAT_ARRAY:
+		{
+			vector<double> *arr = value.getDpArr();
+			writeArray(out, arr->size());
+			for (auto it = arr->cbegin(); it != arr->cend(); it++)
+			{
+				writeDouble(out, *it);
+			}
+			break;
+		}
+		case DatapointValue::T_2D_FLOAT_ARRAY:
+		{
+			vector<vector<double> *> *arr = value.getDp2DArr();
+			writeArray(out, arr->size());
+			for (auto row = arr->cbegin(); row != arr->cend(); row++)
+			{
+				writeArray(out, (*row)->size());
+				for (auto it = (*row)->cbegin(); it != (*row)->cend(); it++)
+				{
+					writeDouble(out, *it);
+				}
+			}
+			break;
+		}
+		case DatapointValue::T_DP_DICT:
+		{
+			vector<Datapoint *> *dpv = value.getDpVec();
+			writeMap(out, dpv->size());
+			for (auto dp = dpv->cbegin(); dp != dpv->cend(); dp++)
+			{
+				writeDatapoint(out, *dp);
+			}
+			break;
+		}
+		case DatapointValue::T_DP_LIST:
+		{
+			vector<Datapoint *> *dpv = value.getDpVec();
+			writeArray(out, dpv->size());
+			for (auto dp = dpv->cbegin(); dp != dpv->cend(); dp++)
+			{
+				writeValue(out, (*dp)->getData());
+			}
+			break;
+		}
+		case DatapointValue::T_DATABUFFER:
+		{
+			DataBuffer *buffer = value.getDataBuffer();
+			writeBytes(out, buffer->getData(), buffer->getItemSize() * buffer->getItemCount());
+			break;
+		}
+		case DatapointValue::T_IMAGE:
+		{
+			DPImage *image = value.getImage();
+			writeMap(out, 4);
+			writeString(out, "width", 5);
+			writeInt(out, image->getWidth());
+			writeString(out, "height", 6);
+			writeInt(out, image->getHeight());
+			writeString(out, "depth", 5);
+			writeInt(out, image->getDepth());
+			writeString(out, "data", 4);
+			writeBytes(out, image->getData(),
+				((size_t)image->getWidth() * image->getHeight() * image->getDepth()) / 8);
+			break;
+		}
+		default:
+		{
+			string str = value.toString();
+			writeString(out, str.data(), str.length());
+			break;
+		}
+	}
+}
+
+/**
+ * Write a prefix byte followed by a value in big endian byte order
+ *
+ * @param out		The buffer to write to
+ * @param prefix	The prefix byte
+ * @param value		The value to write
+ * @param bytes		The number of bytes of the value to write
+ */
+void BinaryEncoder::writeBigEndian(PayloadWriter& out, uint8_t prefix, uint64_t value, int bytes)
+{
+char	buf[9];
+
+	buf[0] = (char)prefix;
+	for (int i = bytes; i > 0; i--)
+	{
+		buf[i] = (char)(value & 0xff);
+		value >>= 8;
+	}
+	out.append(buf, bytes + 1);
+}
+
+/**
+ * Write a CBOR initial byte and argument
+ *
+ * @param out		The buffer to write to
+ * @param major		The CBOR major type
+ * @param value		The argument
+ */
+void BinaryEncoder::writeHeader(PayloadWriter& out, uint8_t major, uint64_t value)
+{
+	major <<= 5;
+	if (value < 24)
+		out.append((char)(major | value));
+	else if (value <= 0xff)
+		writeBigEndian(out, major | 24, value, 1);
+	else if (value <= 0xffff)
+		writeBigEndian(out, major | 25, value, 2);
+	else if (value <= 0xffffffffUL)
+		writeBigEndian(out, major | 26, value, 4);
+	else
+		writeBigEndian(out, major | 27, value, 8);
+}
+
+/**
+ * Write the header of a map
+ *
+ * @param out		The buffer to write to
+ * @param count		The number of entries in the map
+ */
+void BinaryEncoder::writeMap(PayloadWriter& out, uint64_t count)
+{
+	if (m_format == CBOR)
+		writeHeader(out, CBOR_MAP, count);
+	else if (count < 16)
+		out.append((char)(0x80 | count));
+	else if (count <= 0xffff)
+		writeBigEndian(out, 0xde, count, 2);
+	else
+		writeBigEndian(out, 0xdf, count, 4);
+}
+
+/**
+ * Write the header of an array
+ *
+ * @param out		The buffer to write to
+ * @param count		The number of items in the array
+ */
+void BinaryEncoder::writeArray(PayloadWriter& out, uint64_t count)
+{
+	if (m_format == CBOR)
+		writeHeader(out, CBOR_ARRAY, count);
+	else if (count < 16)
+		out.append((char)(0x90 | count));
+	else if (count <= 0xffff)
+		writeBigEndian(out, 0xdc, count, 2);
+	else
+		writeBigEndian(out, 0xdd, count, 4);
+}
+
+/**
+ * Write a UTF-8 string
+ *
+ * @param out		The buffer to write to
+ * @param str		The string
+ * @param length	The length of the string
+ */
+void BinaryEncoder::writeString(PayloadWriter& out, const char *str, size_t length)
+{
+	if (m_format == CBOR)
+		writeHeader(out, CBOR_TEXT, length);
+	else if (length < 32)
+		out.append((char)(0xa0 | length));
+	else if (length <= 0xff)
+		writeBigEndian(out, 0xd9, length, 1);
+	else if (length <= 0xffff)
+		writeBigEndian(out, 0xda, length, 2);
+	else
+		writeBigEndian(out, 0xdb, length, 4);
+	out.append(str, length);
+}
+
+/**
+ * Write a byte string
+ *
+ * @param out		The buffer to write to
+ * @param data		The bytes
+ * @param length	The number of bytes
+ */
+void BinaryEncoder::writeBytes(PayloadWriter& out, const void *data, size_t length)
+{
+	if (m_format == CBOR)
+		writeHeader(out, CBOR_BYTES, length);
+	else if (length <= 0xff)
+		writeBigEndian(out, 0xc4, length, 1);
+	else if (length <= 0xffff)
+		writeBigEndian(out, 0xc5, length, 2);
+	else
+		writeBigEndian(out, 0xc6, length, 4);
+	out.append((const char *)data, length);
+}
+
+/**
+ * Write a signed integer in the smallest representation
+ *
+ * @param out		The buffer to write to
+ * @param value		The integer
+ */
+void BinaryEncoder::writeInt(PayloadWriter& out, int64_t value)
+{
+	if (m_format == CBOR)
+	{
+		if (value >= 0)
+			writeHeader(out, CBOR_UINT, (uint64_t)value);
+		else
+			writeHeader(out, CBOR_NEGINT, (uint64_t)(-1 - value));
+	}
+	else if (value >= 0)
+	{
+		if (value < 128)
+			out.append((char)value);
+		else if (value <= 0xff)
+			writeBigEndian(out, 0xcc, value, 1);
+		else if (value <= 0xffff)
+			writeBigEndian(out, 0xcd, value, 2);
+		else if (value <= 0xffffffffL)
+			writeBigEndian(out, 0xce, value, 4);
+		else
+			writeBigEndian(out, 0xcf, value, 8);
+	}
+	else
+	{
+		if (value >= -32)
+			out.append((char)value);
+		else if (value >= -128)
+			writeBigEndian(out, 0xd0, (uint64_t)value, 1);
+		else if (value >= -32768)
+			writeBigEndian(out, 0xd1, (uint64_t)value, 2);
+		else if (value >= -2147483648LL)
+			writeBigEndian(out, 0xd2, (uint64_t)value, 4);
+		else
+			writeBigEndian(out, 0xd3, (uint64_t)value, 8);
+	}
+}
+
+/**
+ * Write a double precision floating point value
+ *
+ * @param out		The buffer to write to
+ * @param value		The value
+ */
+void BinaryEncoder::writeDouble(PayloadWriter& out, double value)
+{
+uint64_t	bits;
+
+	memcpy(&bits, &value, sizeof(bits));
+	writeBigEndian(out, m_format == CBOR ? 0xfb : 0xcb, bits, 8);
+}
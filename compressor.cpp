@@ -0,0 +1,219 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <compressor.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+using namespace std;
+
+/**
+ * Return the CPU time used by the calling thread in milliseconds
+ */
+static double threadCpuTime()
+{
+struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * Constructor for the compressor
+ */
+Compressor::Compressor() : m_algorithm(None), m_name("none"), m_level(6), m_zinit(false),
+#ifdef HAVE_ZSTD
+	m_zstd(NULL),
+#endif
+	m_buffer(NULL), m_size(0), m_length(0), m_messages(0), m_bytesIn(0),
+	m_bytesOut(0), m_cpuTime(0.0)
+{
+	m_log = Logger::getLogger();
+	memset(&m_zstream, 0, sizeof(m_zstream));
+}
+
+/**
+ * Destructor for the compressor
+ */
+Compressor::~Compressor()
+{
+	release();
+	free(m_buffer);
+}
+
+/**
+ * Release the compression context
+ */
+void Compressor::release()
+{
+	if (m_zinit)
+	{
+		deflateEnd(&m_zstream);
+		m_zinit = false;
+	}
+#ifdef HAVE_ZSTD
+	if (m_zstd)
+	{
+		ZSTD_freeCCtx(m_zstd);
+		m_zstd = NULL;
+	}
+#endif
+}
+
+/**
+ * Configure the compression algorithm and create the context for it
+ *
+ * @param algorithm	The name of the algorithm, none, deflate, gzip or zstd
+ * @param level		The compression level
+ */
+void Compressor::configure(const string& algorithm, int level)
+{
+	release();
+	m_algorithm = None;
+	m_name = "none";
+	m_level = level;
+	if (algorithm.compare("deflate") == 0 || algorithm.compare("gzip") == 0)
+	{
+		bool gzip = algorithm.compare("gzip") == 0;
+		if (m_level < Z_BEST_SPEED || m_level > Z_BEST_COMPRESSION)
+		{
+			m_level = Z_DEFAULT_COMPRESSION;
+		}
+		// Window bits of 15 give a zlib stream, adding 16 gives a gzip stream
+		if (deflateInit2(&m_zstream, m_level, Z_DEFLATED, gzip ? 15 + 16 : 15,
+					8, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			m_log->error("Failed to initialise %s compression, messages will not be compressed",
+					algorithm.c_str());
+			return;
+		}
+		m_zinit = true;
+		m_algorithm = gzip ? Gzip : Deflate;
+		m_name = gzip ? "gzip" : "deflate";
+	}
+	else if (algorithm.compare("zstd") == 0)
+	{
+#ifdef HAVE_ZSTD
+		m_zstd = ZSTD_createCCtx();
+		if (!m_zstd)
+		{
+			m_log->error("Failed to create zstd compression context, messages will not be compressed");
+			return;
+		}
+		ZSTD_CCtx_setParameter(m_zstd, ZSTD_c_compressionLevel, m_level);
+		m_algorithm = Zstd;
+		m_name = "zstd";
+#else
+		m_log->error("The plugin was built without zstd support, messages will not be compressed");
+#endif
+	}
+}
+
+/**
+ * Grow the output buffer to at least the given size
+ *
+ * @param size	The required size of the buffer
+ * @return	False if the buffer could not be allocated
+ */
+bool Compressor::reserve(size_t size)
+{
+	if (size <= m_size)
+	{
+		return true;
+	}
+	char *buffer = (char *)realloc(m_buffer, size);
+	if (!buffer)
+	{
+		return false;
+	}
+	m_buffer = buffer;
+	m_size = size;
+	return true;
+}
+
+/**
+ * Compress a message into the output buffer
+ *
+ * @param data		The message to compress
+ * @param length	The length of the message
+ * @return		False if the message could not be compressed
+ */
+bool Compressor::compress(const char *data, size_t length)
+{
+double	start = threadCpuTime();
+
+	m_length = 0;
+	switch (m_algorithm)
+	{
+		case Deflate:
+		case Gzip:
+		{
+			if (deflateReset(&m_zstream) != Z_OK
+					|| !reserve(deflateBound(&m_zstream, length)))
+			{
+				return false;
+			}
+			m_zstream.next_in = (Bytef *)data;
+			m_zstream.avail_in = length;
+			m_zstream.next_out = (Bytef *)m_buffer;
+			m_zstream.avail_out = m_size;
+			if (deflate(&m_zstream, Z_FINISH) != Z_STREAM_END)
+			{
+				m_log->error("Failed to compress message of %lu bytes", (unsigned long)length);
+				return false;
+			}
+			m_length = m_size - m_zstream.avail_out;
+			break;
+		}
+#ifdef HAVE_ZSTD
+		case Zstd:
+		{
+			if (!reserve(ZSTD_compressBound(length)))
+			{
+				return false;
+			}
+			size_t rval = ZSTD_compress2(m_zstd, m_buffer, m_size, data, length);
+			if (ZSTD_isError(rval))
+			{
+				m_log->error("Failed to compress message, %s", ZSTD_getErrorName(rval));
+				return false;
+			}
+			m_length = rval;
+			break;
+		}
+#endif
+		default:
+			return false;
+	}
+	m_cpuTime += threadCpuTime() - start;
+	m_messages++;
+	m_bytesIn += length;
+	m_bytesOut += m_length;
+	return true;
+}
+
+/**
+ * Log the compression ratio and CPU cost since the last call, then
+ * reset the statistics
+ */
+void Compressor::logStatistics()
+{
+	if (m_messages == 0)
+	{
+		return;
+	}
+	m_log->info("Compressed %lu messages with %s from %lu to %lu bytes, ratio %.2f, %.3fms CPU",
+			m_messages, m_name, m_bytesIn, m_bytesOut,
+			m_bytesOut ? (double)m_bytesIn / m_bytesOut : 0.0, m_cpuTime);
+	m_messages = 0;
+	m_bytesIn = 0;
+	m_bytesOut = 0;
+	m_cpuTime = 0.0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <connection_state.h>
+
+using namespace std;
+
+static const unsigned long kInitialConnectIntervalMillis = 500L;
+static const unsigned long kMaxConnectIntervalMillis = 60000L;
+static const float kIntervalMultiplier = 1.5f;
+static const unsigned long kDefaultBudgetMillis = 2000L;
+
+/**
+ * Constructor for the connection state
+ */
+ConnectionState::ConnectionState() :
+	m_random(Clock::now().time_since_epoch().count()),
+	m_budget(kDefaultBudgetMillis), m_backoff(kInitialConnectIntervalMillis),
+	m_nextAttempt(Clock::now()), m_down(true), m_downSince(Clock::now()),
+	m_attempts(0), m_reconnects(0), m_failures(0), m_downTime(0.0),
+	m_handshakeTotal(0.0), m_handshakeMax(0.0)
+{
+	m_log = Logger::getLogger();
+}
+
+/**
+ * Return the time until the next connection attempt may be made
+ *
+ * @return	The time in milliseconds, 0 if an attempt may be made now
+ */
+unsigned long ConnectionState::untilAttempt()
+{
+	lock_guard<mutex> guard(m_mutex);
+	Clock::time_point now = Clock::now();
+	if (now >= m_nextAttempt)
+	{
+		return 0;
+	}
+	return chrono::duration_cast<chrono::milliseconds>(m_nextAttempt - now).count() + 1;
+}
+
+/**
+ * The connection has been lost or closed. The first attempt to connect
+ * again may be made at once.
+ */
+void ConnectionState::lost()
+{
+	lock_guard<mutex> guard(m_mutex);
+	if (!m_down)
+	{
+		m_down = true;
+		m_downSince = Clock::now();
+		m_nextAttempt = m_downSince;
+		m_backoff = kInitialConnectIntervalMillis;
+	}
+}
+
+/**
+ * A connection attempt has failed, schedule the next attempt after the
+ * backoff interval, with a jitter of up to half the interval, and
+ * increase the interval.
+ */
+void ConnectionState::failed()
+{
+	lock_guard<mutex> guard(m_mutex);
+	unsigned long delay = m_backoff / 2 + m_random() % (m_backoff / 2 + 1);
+	m_nextAttempt = Clock::now() + chrono::milliseconds(delay);
+	m_attempts++;
+	m_failures++;
+	m_backoff *= kIntervalMultiplier;
+	if (m_backoff > kMaxConnectIntervalMillis)
+	{
+		m_backoff = kMaxConnectIntervalMillis;
+	}
+	m_log->warn("Connection attempt %u failed, next attempt in %lums", m_attempts, delay);
+}
+
+/**
+ * A connection attempt has succeeded
+ *
+ * @param handshake	The time taken to connect in milliseconds
+ */
+void ConnectionState::connected(double handshake)
+{
+	lock_guard<mutex> guard(m_mutex);
+	double down = chrono::duration<double>(Clock::now() - m_downSince).count();
+	if (m_reconnects)
+	{
+		m_log->info("Reconnected to GCP after %.1fs and %u failed attempts, handshake took %.1fms",
+				down, m_attempts, handshake);
+	}
+	else
+	{
+		m_log->info("Connected to GCP, handshake took %.1fms", handshake);
+	}
+	m_reconnects++;
+	m_downTime += down;
+	m_handshakeTotal += handshake;
+	if (handshake > m_handshakeMax)
+		m_handshakeMax = handshake;
+	m_down = false;
+	m_attempts = 0;
+	m_backoff = kInitialConnectIntervalMillis;
+}
+
+/**
+ * Log the connection statistics
+ */
+void ConnectionState::logStatistics()
+{
+	lock_guard<mutex> guard(m_mutex);
+	double down = m_downTime;
+	if (m_down)
+	{
+		down += chrono::duration<double>(Clock::now() - m_downSince).count();
+	}
+	m_log->info("GCP connection made %lu times, %lu failed attempts, %.1fs disconnected, handshake average %.1fms, maximum %.1fms",
+			m_reconnects, m_failures, down,
+			m_reconnects ? m_handshakeTotal / m_reconnects : 0.0, m_handshakeMax);
+}
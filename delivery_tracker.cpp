@@ -0,0 +1,188 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <delivery_tracker.h>
+#include <chrono>
+
+using namespace std;
+
+/**
+ * Constructor for the delivery tracker
+ */
+DeliveryTracker::DeliveryTracker() : m_outstanding(0), m_deliveries(0)
+{
+}
+
+/**
+ * Start tracking a new block of readings
+ */
+void DeliveryTracker::reset()
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_messages.clear();
+	m_early.clear();
+	m_outstanding = 0;
+}
+
+/**
+ * Record a message that has been published
+ *
+ * @param token	The delivery token of the message
+ * @param end	The index in the block after the last reading in the message
+ */
+void DeliveryTracker::sent(int token, size_t end)
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_messages.push_back(Message(token, end, false));
+	auto early = m_early.find(token);
+	if (early != m_early.end())
+	{
+		// Delivered before the publish call returned
+		m_early.erase(early);
+		m_messages.back().m_acked = true;
+	}
+	else
+	{
+		m_outstanding++;
+	}
+}
+
+/**
+ * Record a control message that has been published. The message holds no
+ * readings of the block.
+ *
+ * @param token	The delivery token of the message
+ */
+void DeliveryTracker::control(int token)
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_messages.push_back(Message(token, 0, true));
+	auto early = m_early.find(token);
+	if (early != m_early.end())
+	{
+		m_early.erase(early);
+		m_messages.back().m_acked = true;
+	}
+}
+
+/**
+ * Wait for a control message to be delivered
+ *
+ * @param token		The delivery token of the message
+ * @param timeout	The maximum time to wait in milliseconds
+ * @return		True if the message was delivered
+ */
+bool DeliveryTracker::waitControl(int token, unsigned long timeout)
+{
+	unique_lock<mutex> lck(m_mutex);
+	return m_cv.wait_for(lck, chrono::milliseconds(timeout),
+			[this, token]{ return controlDelivered(token); });
+}
+
+/**
+ * Return true if a control message has been delivered. Called with the
+ * mutex held.
+ *
+ * @param token	The delivery token of the message
+ */
+bool DeliveryTracker::controlDelivered(int token) const
+{
+	for (auto it = m_messages.cbegin(); it != m_messages.cend(); it++)
+	{
+		if (it->m_control && it->m_token == token)
+		{
+			return it->m_acked;
+		}
+	}
+	return false;
+}
+
+/**
+ * Called from the MQTT library thread when a message has been delivered
+ *
+ * @param token	The delivery token of the message
+ */
+void DeliveryTracker::delivered(int token)
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_deliveries++;
+	for (auto it = m_messages.begin(); it != m_messages.end(); it++)
+	{
+		if (it->m_token == token && !it->m_acked)
+		{
+			it->m_acked = true;
+			if (!it->m_control)
+			{
+				m_outstanding--;
+			}
+			m_cv.notify_all();
+			return;
+		}
+	}
+	m_early.insert(token);
+}
+
+/**
+ * Wait for all the messages of the block to be delivered
+ *
+ * @param timeout	The maximum time to wait in milliseconds
+ * @return		The number of readings delivered
+ */
+size_t DeliveryTracker::wait(unsigned long timeout)
+{
+	unique_lock<mutex> lck(m_mutex);
+	m_cv.wait_for(lck, chrono::milliseconds(timeout), [this]{ return m_outstanding == 0; });
+	return prefix();
+}
+
+/**
+ * Return the number of readings delivered without waiting
+ *
+ * @return	The number of readings delivered
+ */
+size_t DeliveryTracker::acknowledged()
+{
+	lock_guard<mutex> guard(m_mutex);
+	return prefix();
+}
+
+/**
+ * Return the end of the run of acknowledged messages from the start of
+ * the block, passing over any control messages. Called with the mutex
+ * held.
+ */
+size_t DeliveryTracker::prefix()
+{
+size_t	end = 0;
+
+	for (auto it = m_messages.cbegin(); it != m_messages.cend(); it++)
+	{
+		if (it->m_control)
+		{
+			continue;
+		}
+		if (!it->m_acked)
+		{
+			break;
+		}
+		end = it->m_end;
+	}
+	return end;
+}
+
+/**
+ * Return the number of messages waiting to be acknowledged
+ *
+ * @return	The number of messages
+ */
+unsigned int DeliveryTracker::outstanding()
+{
+	lock_guard<mutex> guard(m_mutex);
+	return m_outstanding;
+}
@@ -15,11 +15,14 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <thread>
 
 #include "jwt.h"
 #include "openssl/ec.h"
 #include "openssl/evp.h"
-#include "MQTTClient.h"
+#include <sync_transport.h>
+#include <async_transport.h>
 #include "simple_https.h"
 #include <rapidjson/document.h>
 
@@ -28,70 +31,24 @@ using namespace rapidjson;
 static const int kQos = 1;
 static const unsigned long kTimeout = 10000L;
 static const char* kUsername = "unused";
-
-static const unsigned long kInitialConnectIntervalMillis = 500L;
-static const unsigned long kMaxConnectIntervalMillis = 6000L;
-static const unsigned long kMaxConnectRetryTimeElapsedMillis = 900000L;
-static const float kIntervalMultiplier = 1.5f;
+static const size_t kMaxMessageSize = 256 * 1024;	// IoT Core telemetry limit
+static const size_t kSpoolBatch = 64;	// Spooled messages sent before waiting for completion
+static const unsigned long kConnectRetry = 1000L;	// Interval between background connection attempts
+static const unsigned int kConnectTimeout = 30;		// Longest time in seconds of a connection attempt
 
 using namespace std;
 
-const string GCP::m_address("ssl://mqtt.googleapis.com:8883");
-
-/*
- * Callback functions
- *
- * C Functions that are called by the MQTT library for various events
- */
-
-/**
- * Callback function that is called when a message for one of the topic we subscribe to arrives.
- *
- * @param context	The GCP object instance
- * @param topicName	The name of the topic the message arrived on
- * @param topicLen	The length of the topic name
- * @param message	The MQTT message content
- */
-static int messageArrived(void *context, char *topicName, int topicLen, MQTTClient_message *message)
-{
-GCP *gcp = (GCP *)context;
-
-	gcp->msgArrived(topicName, message);
-	return 1;
-}
-
-/**
- * Callback function that is called when the MQTT connection is lost
- *
- * @param context	The GCP object instance
- * @param cause		The cause of the lost connection
- */
-static void connectionLost(void *context, char *cause)
-{
-GCP *gcp = (GCP *)context;
-
-	gcp->lostConnection(cause);
-}
-
-/**
- * Callback function that is called when an MQTT message is delivered.
- *
- * @param context	The GCP object instance
- * @param dt		The delivery token of the packet that was delivered
- */
-static void deliveryComplete(void *context, MQTTClient_deliveryToken dt)
-{
-GCP *gcp = (GCP *)context;
-
-	gcp->delivered(dt);
-}
-
-
 /**
  * Constructor for the GCP object
  */
-GCP::GCP() : m_jwtStr(NULL), m_subscribed(false), m_connected(false),
-	m_lastDelivered(0), m_lastSent(0), m_jwtExpire(0)
+GCP::GCP() : m_tls(true), m_publishState(false), m_subscribed(false), m_connected(false), m_gateway(false),
+	m_bytesPublished(0), m_maxReadings(0),
+	m_lastSent(0), m_transport(NULL), m_qos(kQos),
+	m_pipeline(false), m_queue(NULL), m_free(NULL), m_ioThread(NULL),
+	m_running(false), m_queuedId(0), m_confirmedId(0), m_connectThread(NULL),
+	m_connecting(false), m_cancel(false), m_connectTimeout(kConnectTimeout),
+	m_attemptThread(NULL), m_attempt(AttemptIdle), m_attemptRc(TRANSPORT_SUCCESS),
+	m_handshake(0.0), m_attemptStop(false), m_pool(NULL)
 {
 	m_log = Logger::getLogger();
 	OpenSSL_add_all_algorithms();
@@ -104,10 +61,20 @@ GCP::GCP() : m_jwtStr(NULL), m_subscribed(false), m_connected(false),
  */
 GCP::~GCP()
 {
-	if (m_jwtStr)
+	cancel();
+	if (m_connectThread)
+	{
+		m_connectThread->join();
+		delete m_connectThread;
+		m_connectThread = NULL;
+	}
+	clearShards();
+	stopPipeline();
+	stopAttempts();
+	if (m_transport)
 	{
-		free(m_jwtStr);
-		m_jwtStr = NULL;
+		delete m_transport;
+		m_transport = NULL;
 	}
 }
 
@@ -116,9 +83,87 @@ GCP::~GCP()
  * the data from the Fledge configuration dategory that defines
  * the paramters of the GCP IoT Core we will connect with.
  *
+ * If a list of shards is configured a GCP object is created for each
+ * of the devices in the list, each with its own connection, and the
+ * readings are divided between them by asset name.
+ *
  * @param conf	Fledge configuration category
  */
 void GCP::configure(const ConfigCategory *conf)
+{
+	clearShards();
+	if (conf->itemExists("shards"))
+	{
+		Document doc;
+		string shards = conf->getValue("shards");
+		if (doc.Parse(shards.c_str()).HasParseError() || !doc.IsArray())
+		{
+			m_log->error("The list of shards must be a JSON array, shards will not be used");
+		}
+		else
+		{
+			for (SizeType i = 0; i < doc.Size(); i++)
+			{
+				const Value& item = doc[i];
+				if (!item.IsObject() || !item.HasMember("device_id") || !item["device_id"].IsString()
+					|| !item.HasMember("key") || !item["key"].IsString())
+				{
+					m_log->error("Each shard must have a device_id and a key, %d shards ignored",
+							(int)doc.Size());
+					clearShards();
+					break;
+				}
+				GCP *shard = new GCP();
+				shard->configure(conf, item["device_id"].GetString(), item["key"].GetString());
+				m_shards.push_back(shard);
+			}
+		}
+	}
+	if (!m_shards.empty())
+	{
+		m_shardBlocks.resize(m_shards.size());
+		m_shardPositions.resize(m_shards.size());
+		m_shardSent.assign(m_shards.size(), 0);
+		m_shardSentId.assign(m_shards.size(), 0);
+		m_pool = new WorkerPool(m_shards.size() - 1);
+		m_log->info("Readings will be sent to %d devices", (int)m_shards.size());
+		return;
+	}
+
+	string deviceID, key;
+	if (conf->itemExists("device_id"))
+		deviceID = conf->getValue("device_id");
+	else
+		m_log->error("Missing device ID in configuration");
+	if (conf->itemExists("key"))
+		key = conf->getValue("key");
+	else
+		m_log->error("Missing device key in configuration");
+
+	/*
+	 * Large blocks may be serialized on several threads, shards are
+	 * already serialized in parallel so this only applies to a single
+	 * device.
+	 */
+	unsigned int threads = 1;
+	size_t threshold = 5000;
+	if (conf->itemExists("serialization_threads"))
+		threads = strtoul(conf->getValue("serialization_threads").c_str(), NULL, 10);
+	if (conf->itemExists("parallel_threshold"))
+		threshold = strtoul(conf->getValue("parallel_threshold").c_str(), NULL, 10);
+	m_builder.setParallel(threads, threshold);
+
+	configure(conf, deviceID, key);
+}
+
+/**
+ * Configure the connection to a single device
+ *
+ * @param conf		Fledge configuration category
+ * @param deviceID	The device to send the readings as
+ * @param key		The name of the key of the device
+ */
+void GCP::configure(const ConfigCategory *conf, const string& deviceID, const string& key)
 {
 	if (conf->itemExists("project_id"))
 		m_projectID = conf->getValue("project_id");
@@ -132,121 +177,425 @@ void GCP::configure(const ConfigCategory *conf)
 		m_registryID = conf->getValue("registry_id");
 	else
 		m_log->error("Missing registry ID in configuration");
-	if (conf->itemExists("device_id"))
-		m_deviceID = conf->getValue("device_id");
-	else
-		m_log->error("Missing device ID in configuration");
+	m_deviceID = deviceID;
+
+	string host = "mqtt.googleapis.com";
+	unsigned int port = 8883;
+	if (conf->itemExists("broker_host"))
+		host = conf->getValue("broker_host");
+	if (conf->itemExists("broker_port"))
+		port = strtoul(conf->getValue("broker_port").c_str(), NULL, 10);
+	m_tls = true;
+	if (conf->itemExists("tls"))
+		m_tls = conf->getValue("tls").compare("true") == 0;
+	m_rootCA = "roots";
+	if (conf->itemExists("root_certificate") && !conf->getValue("root_certificate").empty())
+		m_rootCA = conf->getValue("root_certificate");
+	m_address = (m_tls ? "ssl://" : "tcp://") + host + ":" + to_string(port);
+
 	m_clientID = "projects/" + m_projectID +
 		"/locations/" + m_region + "/registries/" + m_registryID
 		+ "/devices/" + m_deviceID;
 	m_topic = "/devices/" + m_deviceID + "/events";
-	if (conf->itemExists("key"))
-		m_key = conf->getValue("key");
-	else
-		m_log->error("Missing device key in configuration");
+	m_key = key;
 	if (conf->itemExists("algorithm"))
 		m_algorithm = conf->getValue("algorithm");
 	else
 		m_log->error("Missing JWT algorithm in configuration");
+	m_tokens.configure(m_projectID, getKeyPath(), getAlgorithm());
+
+	/*
+	 * The options of the connection only change with the configuration,
+	 * apart from the token, so they are prepared here rather than for
+	 * every connection. The root certificates are given to OpenSSL as a
+	 * hashed directory if one can be built, so that a connection only
+	 * loads the certificates it needs rather than the whole bundle.
+	 */
+	m_options.m_address = m_address;
+	m_options.m_clientID = m_clientID;
+	m_options.m_keepAlive = 60;
+	m_options.m_username = kUsername;
+	m_options.m_password = NULL;
+	m_options.m_trustStore = NULL;
+	m_options.m_caPath = NULL;
+	m_options.m_privateKey = NULL;
+	if (m_tls)
+	{
+		getRootPath();
+		if (m_trustStore.build(m_rootPath, getCertificatePath()))
+			m_options.m_caPath = m_trustStore.directory().c_str();
+		else
+			m_options.m_trustStore = m_rootPath.c_str();
+		m_options.m_privateKey = m_keyPath.c_str();
+	}
+	unsigned int assetCacheSize = 1000, assetCacheTTL = 3600;
+	if (conf->itemExists("asset_cache_size"))
+		assetCacheSize = strtoul(conf->getValue("asset_cache_size").c_str(), NULL, 10);
+	if (conf->itemExists("asset_cache_ttl"))
+		assetCacheTTL = strtoul(conf->getValue("asset_cache_ttl").c_str(), NULL, 10);
+	m_builder.setAssetCache(assetCacheSize, assetCacheTTL);
+	size_t maxBytes = kMaxMessageSize;
+	unsigned int maxReadings = 0;
+	if (conf->itemExists("max_message_size"))
+		maxBytes = strtoul(conf->getValue("max_message_size").c_str(), NULL, 10);
+	if (conf->itemExists("max_message_readings"))
+		maxReadings = strtoul(conf->getValue("max_message_readings").c_str(), NULL, 10);
+	m_maxReadings = maxReadings;
+
+	/*
+	 * Readings may be batched across calls, the size of the messages is
+	 * then the target size of the batcher rather than the maximum size.
+	 * An unlimited message size is bounded by the IoT Core limit for
+	 * the batcher, which needs a size to tune the target within.
+	 */
+	bool batching = false;
+	unsigned int linger = 1000;
+	if (conf->itemExists("batching"))
+		batching = conf->getValue("batching").compare("true") == 0;
+	if (conf->itemExists("batch_linger"))
+		linger = strtoul(conf->getValue("batch_linger").c_str(), NULL, 10);
+	m_batcher.configure(batching, linger, maxBytes ? maxBytes : kMaxMessageSize);
+	m_builder.setLimits(batching ? m_batcher.target() : maxBytes, maxReadings);
+	m_instrumentation.batchTarget(batching ? m_batcher.target() : 0);
+
+	double messageRate = 0, byteRate = 0;
+	if (conf->itemExists("rate_limit_messages"))
+		messageRate = strtod(conf->getValue("rate_limit_messages").c_str(), NULL);
+	if (conf->itemExists("rate_limit_bytes"))
+		byteRate = strtod(conf->getValue("rate_limit_bytes").c_str(), NULL);
+	m_limiter.configure(messageRate, byteRate);
+
+	if (conf->itemExists("qos"))
+		m_qos = strtol(conf->getValue("qos").c_str(), NULL, 10) ? 1 : 0;
+
+	string transport = "Synchronous";
+	unsigned int window = 10;
+	if (conf->itemExists("transport"))
+		transport = conf->getValue("transport");
+	if (conf->itemExists("inflight_window"))
+		window = strtoul(conf->getValue("inflight_window").c_str(), NULL, 10);
+	unsigned long budget = 2000;
+	if (conf->itemExists("connect_budget"))
+		budget = strtoul(conf->getValue("connect_budget").c_str(), NULL, 10);
+	m_state.setBudget(budget);
+	m_connectTimeout = kConnectTimeout;
+	if (conf->itemExists("connect_timeout"))
+		m_connectTimeout = strtoul(conf->getValue("connect_timeout").c_str(), NULL, 10);
+	stopPipeline();
+	stopAttempts();
+	if (m_transport)
+	{
+		delete m_transport;
+		m_connected = false;
+	}
+	if (transport.compare("Asynchronous") == 0)
+	{
+		m_transport = new AsyncTransport(this, window);
+	}
+	else
+	{
+		m_transport = new SyncTransport(this);
+	}
+
+	string compression = "none";
+	int level = 6;
+	if (conf->itemExists("compression"))
+		compression = conf->getValue("compression");
+	if (conf->itemExists("compression_level"))
+		level = strtol(conf->getValue("compression_level").c_str(), NULL, 10);
+	m_compressor.configure(compression, level);
+
+	string format = "JSON";
+	if (conf->itemExists("format"))
+		format = conf->getValue("format");
+	m_builder.setFormat(format);
+	if (conf->itemExists("timestamp_format"))
+		m_builder.setTimestampFormat(conf->getValue("timestamp_format"));
+	else
+		m_builder.setTimestampFormat("Date");
+	if (conf->itemExists("layout"))
+		m_builder.setLayout(conf->getValue("layout"));
+	else
+		m_builder.setLayout("Rows");
+
+	/*
+	 * Messages that are not plain JSON are sent to a subfolder of the
+	 * telemetry topic that names the encoding and compression, IoT Core
+	 * passes this to Pub/Sub as the subFolder attribute of the message.
+	 */
+	const char *encoding = m_builder.encoding();
+	m_eventsFolder = encoding ? string("/") + encoding : "";
+	m_compressedFolder = "/" + (encoding ? string(encoding) + "-" : "") + m_compressor.name();
+	m_topic = "/devices/" + m_deviceID + "/events" + m_eventsFolder;
+	m_compressedTopic = "/devices/" + m_deviceID + "/events" + m_compressedFolder;
+
+	/*
+	 * In gateway mode each asset is sent as a device bound to the
+	 * gateway, using the mapped asset name as the device ID.
+	 */
+	m_stateTopic = "/devices/" + m_deviceID + "/state";
+	unsigned int interval = 60;
+	if (conf->itemExists("statistics_interval"))
+		interval = strtoul(conf->getValue("statistics_interval").c_str(), NULL, 10);
+	m_instrumentation.setInterval(interval);
+	m_publishState = false;
+	if (conf->itemExists("statistics_state"))
+		m_publishState = conf->getValue("statistics_state").compare("true") == 0;
+
+	m_gateway = false;
+	if (conf->itemExists("gateway"))
+		m_gateway = conf->getValue("gateway").compare("true") == 0;
+	m_builder.setPerAsset(m_gateway);
+	m_attached.clear();
+
+	m_spool.close();
+	if (conf->itemExists("spool") && conf->getValue("spool").compare("true") == 0)
+	{
+		unsigned long spoolSize = 64;
+		Spool::Policy policy = Spool::DropOldest;
+		if (conf->itemExists("spool_size"))
+			spoolSize = strtoul(conf->getValue("spool_size").c_str(), NULL, 10);
+		if (conf->itemExists("spool_policy")
+				&& conf->getValue("spool_policy").compare("Refuse new") == 0)
+			policy = Spool::Refuse;
+		m_spool.open(getSpoolPath(), (spoolSize ? spoolSize : 1) * 1024 * 1024, policy);
+	}
+
+	m_pipeline = false;
+	if (conf->itemExists("pipeline"))
+		m_pipeline = conf->getValue("pipeline").compare("true") == 0;
+	if (m_pipeline)
+	{
+		unsigned int queueSize = 16;
+		if (conf->itemExists("queue_size"))
+			queueSize = strtoul(conf->getValue("queue_size").c_str(), NULL, 10);
+		startPipeline(queueSize ? queueSize : 1);
+		if (m_spool.isOpen())
+		{
+			m_log->warn("The spool is not used when messages are sent by the I/O thread");
+		}
+		if (m_batcher.enabled())
+		{
+			m_log->warn("Readings are not batched when messages are sent by the I/O thread");
+		}
+	}
 }
 
 /**
- * Send a block of readings to GCP IoT core service using MQTT
+ * Send a block of readings to GCP IoT core service using MQTT. If the
+ * pipeline is enabled the readings are queued for the I/O thread to
+ * send, if batching is enabled they are added to the batch, otherwise
+ * they are sent on the calling thread. Whilst the first connection is
+ * being made in the background no readings are sent.
  *
  * @param readings	The readings to send
  * @return 		The number of readings sent
  */
 uint32_t GCP::send(const vector<Reading *>& readings)
+{
+	if (m_connecting)
+	{
+		// Not ready, the first connection is still being made
+		return 0;
+	}
+	if (!m_shards.empty())
+	{
+		return sendShards(readings);
+	}
+	if (m_pipeline && hasReadingIds(readings))
+	{
+		return queueBlock(readings);
+	}
+	lock_guard<mutex> guard(m_publishMutex);
+	if (m_batcher.enabled() && hasReadingIds(readings))
+	{
+		return batchBlock(readings);
+	}
+	return sendBlock(readings);
+}
+
+/**
+ * Add a block of readings to the batch and send the batch if it has
+ * reached the target size or waited long enough. The caller must hold
+ * the publish mutex.
+ *
+ * @param readings	The readings to send
+ * @return 		The number of readings of the block that have been sent
+ */
+uint32_t GCP::batchBlock(const vector<Reading *>& readings)
+{
+	m_batcher.add(readings);
+	if (m_batcher.ready())
+	{
+		bool full = m_batcher.full();
+		m_builder.setLimits(m_batcher.target(), m_maxReadings);
+		Batcher::Clock::time_point start = Batcher::Clock::now();
+		uint32_t n = sendBlock(m_batcher.readings());
+		RateLimiter::Limit limit = m_limiter.limited();
+		m_batcher.sent(n, m_builder.blockBytes(), Batcher::Clock::now() - start,
+				full && limit == RateLimiter::None);
+		if (limit == RateLimiter::Messages)
+		{
+			// Send fewer, larger messages within the message quota
+			m_batcher.grow();
+		}
+		m_instrumentation.batchTarget(m_batcher.target());
+	}
+	return m_batcher.confirmed(readings);
+}
+
+/**
+ * Send a block of readings to GCP IoT core service using MQTT on the
+ * calling thread. The caller must hold the publish mutex.
+ *
+ * @param readings	The readings to send
+ * @return 		The number of readings sent
+ */
+uint32_t GCP::sendBlock(const vector<Reading *>& readings)
 {
 uint32_t	n = 0;
-struct timeval tv1, tv2;
 int		rc;
 
-	gettimeofday(&tv1, NULL);
+	Instrumentation::Clock::time_point start = Instrumentation::Clock::now();
 	m_log->warn("GCP Send block of %d ....", readings.size());
+	checkToken();
 	if (!m_connected)
 	{
 		rc = connect();
-		if (rc != MQTTCLIENT_SUCCESS)
+		if (rc != TRANSPORT_SUCCESS && m_spool.isOpen())
+		{
+			return spoolBlock(readings);
+		}
+		if (rc == TRANSPORT_DISCONNECTED)
+		{
+			// Waiting to make the next connection attempt
+			return 0;
+		}
+		if (rc != TRANSPORT_SUCCESS)
 		{
 			m_log->error("Failed to connect to MQTT service %s, %d", m_address.c_str(), rc);
 			return 0;
 		}
 	}
+	if (!m_spool.empty() && !drainSpool())
+	{
+		// Keep the order of the messages, the block goes behind the spool
+		return spoolBlock(readings);
+	}
 
 
 	/*
-	 * First do a pass to get all the asset names in this block of readings and
-	 * add them to the set of assets to process.
+	 * Serialize the block and publish it as one or more messages, each
+	 * message is sent without waiting for the previous to complete.
 	 */
-	for (auto reading = readings.cbegin(); reading != readings.cend(); reading ++)
 	{
-		string assetName = (*reading)->getAssetName();
-		mapAssetName(assetName);
-		if (m_asset.find(assetName) == m_asset.end())
+		Instrumentation::Timer timer(m_instrumentation, Instrumentation::Serialization);
+		m_builder.setBlock(readings);
+	}
+	m_tracker.reset();
+	bool failed = false;
+	int messages = 0;
+	size_t lastEnd = 0;
+	while (nextMessage())
+	{
+		const char *payload = m_builder.data();
+		size_t length = m_builder.length();
+		const string& topic = encodeMessage(&payload, &length);
+		// Only the last message of a range confirms the readings in it
+		size_t end = m_builder.rangeComplete() ? m_builder.end() : lastEnd;
+		if (!publishMessage(topic, payload, length, end))
 		{
-				m_asset.insert(assetName);
+			failed = true;
+			break;
 		}
+		lastEnd = end;
+		messages++;
 	}
-
-	string payload = "{";
-	bool first = true;
-
-	/*
-	 * For each asset gather the readings for that asset
-	 */
-	for (auto itr = m_asset.cbegin(); itr != m_asset.cend(); itr++)
+	if (m_qos == 0)
 	{
-		bool outputAsset = true;
-		for (auto reading = readings.cbegin(); reading != readings.cend(); reading++)
+		// Messages are never acknowledged, count those that were published
+		n = failed ? lastEnd : m_builder.end();
+		if (messages && m_connected)
 		{
-
-			string assetName = (*reading)->getAssetName();
-			mapAssetName(assetName);
-			if (itr->compare(assetName))	// Skip over if asset name does not match
-				continue;
-			if (outputAsset)
-			{
-				if (!first)
-				{
-					payload += ",";
-				}
-				payload += "\"";
-				payload += *itr;
-				payload += "\" : [ ";
-				outputAsset = false;
-			}
-			else
-			{
-				payload += ",";
-			}
-			payload += makePayload(*reading);
-			n++;
+			// Wait for last message sent to complete
+			m_log->info("Waiting for delivery completion of the message");
+			Instrumentation::Timer timer(m_instrumentation, Instrumentation::Acknowledge);
+			if ((rc = m_transport->waitForCompletion(kTimeout)) != TRANSPORT_SUCCESS)
+				m_log->error("Failed to complete message transmission, %d", rc);
 		}
-		if (!outputAsset)
+	}
+	else
+	{
+		// Only count the readings in messages the broker has acknowledged
+		m_log->info("Waiting for acknowledgement of %d messages", messages);
+		Instrumentation::Timer timer(m_instrumentation, Instrumentation::Acknowledge);
+		size_t acked = m_tracker.wait(kTimeout);
+		timer.stop();
+		if (!failed && acked == lastEnd)
 		{
-			payload += "]";
+			n = m_builder.end();
+		}
+		else
+		{
+			n = acked;
+			m_log->warn("Only %d of %d published readings were acknowledged",
+					n, (int)lastEnd);
 		}
 	}
-	payload += "}";
-	char *pl = strdup(payload.c_str());
-	char topic[1024];
-	snprintf(topic, sizeof(topic), "/devices/%s/events", m_deviceID.c_str());
-	int retryCnt = 0;
+	m_compressor.logStatistics();
+	m_tokens.logStatistics();
+	m_state.logStatistics();
+	m_spool.logStatistics();
+	m_limiter.logStatistics();
+	TransportStatistics stats;
+	if (m_transport->getStatistics(stats))
+	{
+		m_log->info("GCP pipeline depth %u, %lu acknowledged, %lu failed, ack latency average %.1fms, maximum %.1fms",
+				stats.m_maxInFlight, stats.m_acks, stats.m_failures,
+				stats.m_ackLatencyAvg, stats.m_ackLatencyMax);
+	}
+	reportStatistics();
+	double elapsed = chrono::duration<double>(Instrumentation::Clock::now() - start).count();
+	m_log->warn("GCP Send block sent %d readings in %d messages in %.3fms, averages %.1f per second",
+			n, messages, elapsed * 1000.0, elapsed > 0.0 ? n / elapsed : 0.0);
+	return n;
+}
+
+/**
+ * Publish a message, reconnecting and retrying if the connection has
+ * been lost. The message is registered with the delivery tracker.
+ *
+ * @param topic		The topic to publish on
+ * @param payload	The message payload
+ * @param length	The length of the payload
+ * @param end		The position reported to the delivery tracker when
+ *			the message is delivered
+ * @return		True if the message was published
+ */
+bool GCP::publishMessage(const string& topic, const char *payload, size_t length, size_t end)
+{
+int	rc;
+int	retryCnt = 0;
+
 retry:
 	if (!m_connected)
 	{
 		m_log->info("GCP connection lost, reconnecting");
-		if ((rc = connect()) != MQTTCLIENT_SUCCESS)
+		if ((rc = connect()) != TRANSPORT_SUCCESS)
 		{
-			m_log->error("GCP Send block lost connection after %d readings",
-				       n);
-			return 0;
+			m_log->error("GCP Send block lost connection");
+			return false;
 		}
 	}
-	if ((rc = publish(topic, pl, strlen(pl))) == MQTTCLIENT_SUCCESS)
+	if ((!m_gateway || (rc = attachDevice(topic)) == TRANSPORT_SUCCESS)
+			&& (rc = publish(topic, payload, length)) == TRANSPORT_SUCCESS)
 	{
-		m_log->info("Published %s, %d sent, %d delivered", pl, m_lastSent, m_lastDelivered);
+		m_tracker.sent(m_lastSent, end);
+		if (m_qos)
+			m_instrumentation.inFlight(m_tracker.outstanding());
+		m_log->info("Published %d bytes to %s, %d sent, %lu delivered", (int)length,
+				topic.c_str(), m_lastSent, m_tracker.deliveries());
+		return true;
 	}
 	else if (rc == -3)
 	{
@@ -255,142 +604,470 @@ retry:
 		disconnect();
 		if (retryCnt++ < 3)
 			goto retry;
-		m_log->error("Failed after 3 disconnects to publish %s", topic);
+		m_log->error("Failed after 3 disconnects to publish %s", topic.c_str());
 	}
 	else
 	{
-		m_log->error("MQTT publication to topic %s failed, %d", topic, rc);
+		m_log->error("MQTT publication to topic %s failed, %d", topic.c_str(), rc);
 		disconnect();
 	}
-	free(pl);
-	// Wait for last message sent to complete
-	m_log->info("Waiting for delivery completion of the message");
-	MQTTClient_deliveryToken dt = m_lastSent;
-	if ((rc = MQTTClient_waitForCompletion(m_client, dt, kTimeout)) != MQTTCLIENT_SUCCESS)
-		m_log->error("Failed to complete message transmission, %d", rc);
-	gettimeofday(&tv2, NULL);
-	m_log->warn("GCP Send block sent %d readings, averages %.1f per second", n,
-			(float)(1000 * n) / (((tv2.tv_sec - tv1.tv_sec) * 1000) + (tv2.tv_usec - tv1.tv_usec) / 1000));
+	return false;
+}
+
+/**
+ * Add the messages for a block of readings to the spool, to be sent once
+ * the connection returns. The readings are serialized and compressed as
+ * they would have been had they been sent.
+ *
+ * @param readings	The readings to spool
+ * @return		The number of readings in the complete ranges of messages
+ *			added to the spool
+ */
+uint32_t GCP::spoolBlock(const vector<Reading *>& readings)
+{
+uint32_t	n = 0;
+bool		failed = false;
+
+	m_builder.setBlock(readings);
+	while (m_builder.next())
+	{
+		const char *payload = m_builder.data();
+		size_t length = m_builder.length();
+		const string& topic = encodeMessage(&payload, &length);
+		if (!m_spool.append(topic, payload, length))
+		{
+			failed = true;
+			break;
+		}
+		if (m_builder.rangeComplete())
+		{
+			n = m_builder.end();
+		}
+	}
+	if (!failed)
+	{
+		n = m_builder.end();
+	}
+	m_spool.commit();
+	m_compressor.logStatistics();
+	m_spool.logStatistics();
 	return n;
 }
 
 /**
- * Construct a payload from a single reading.
+ * Send the messages in the spool. Messages are published in batches
+ * without waiting for each to complete and removed from the spool once
+ * they have been published, or acknowledged for QoS 1.
  *
- * @param reading	The reading to use for payload construction
- * @return	The JSON payload
- */
-string GCP::makePayload(Reading *reading)
-{
-	string payload = "{";
-	struct timeval tm;
-	reading->getTimestamp(&tm);
-	payload += "\"ts\":\"";
-	// Add timestamp
-	payload += reading->getAssetDateUserTime(Reading::FMT_DEFAULT, true);
-	payload += "\",";
-	string assetName = reading->getAssetName();
-	vector<Datapoint *> dpv = reading->getReadingData();
-	for (auto dp = dpv.cbegin(); dp != dpv.cend(); dp++)
-	{
-		payload += (*dp)->toJSONProperty();
-		if ((dp + 1) != dpv.cend())
+ * @return	True if the spool has been emptied
+ */
+bool GCP::drainSpool()
+{
+struct timeval	tv1, tv2;
+unsigned long	messages = 0, bytes = 0;
+bool		failed = false;
+
+	gettimeofday(&tv1, NULL);
+	while (!m_spool.empty() && !failed)
+	{
+		Spool::Cursor cursor = m_spool.begin();
+		string topic;
+		const char *payload;
+		size_t length;
+		size_t published = 0, confirmed = 0, sent = 0;
+
+		m_tracker.reset();
+		while (published < kSpoolBatch && m_spool.read(cursor, topic, &payload, &length))
+		{
+			if (!publishMessage(topic, payload, length, published + 1))
+			{
+				failed = true;
+				break;
+			}
+			published++;
+			sent += length;
+		}
+		if (m_qos == 0)
+		{
+			confirmed = published;
+		}
+		else if (published)
 		{
-			payload += ",";
+			confirmed = m_tracker.wait(kTimeout);
 		}
+		if (confirmed < published)
+		{
+			failed = true;
+		}
+		m_spool.consume(confirmed);
+		m_spool.commit();
+		messages += confirmed;
+		bytes += confirmed == published ? sent : 0;
 	}
-	payload += "}";
-	return payload;
+	gettimeofday(&tv2, NULL);
+	m_spool.drained(messages, bytes, (tv2.tv_sec - tv1.tv_sec) + (tv2.tv_usec - tv1.tv_usec) / 1000000.0);
+	return m_spool.empty();
 }
 
 /**
- * Connect to the Google Cloud IoT Core using MQTT
+ * Compress a message if compression is enabled and return the topic
+ * the message should be published to. Compressed messages are sent to
+ * a subfolder of the telemetry topic named after the algorithm.
+ *
+ * @param payload	The message payload, updated if compressed
+ * @param length	The length of the payload, updated if compressed
+ * @return		The topic to publish the message to
+ */
+const string& GCP::encodeMessage(const char **payload, size_t *length)
+{
+	bool compressed = false;
+
+	Instrumentation::Timer timer(m_instrumentation, Instrumentation::Compression);
+	if (m_compressor.enabled() && m_compressor.compress(*payload, *length))
+	{
+		*payload = m_compressor.data();
+		*length = m_compressor.length();
+		compressed = true;
+	}
+	if (m_gateway)
+	{
+		m_deviceTopic.assign("/devices/");
+		m_deviceTopic.append(m_builder.asset());
+		m_deviceTopic.append("/events");
+		m_deviceTopic.append(compressed ? m_compressedFolder : m_eventsFolder);
+		return m_deviceTopic;
+	}
+	return compressed ? m_compressedTopic : m_topic;
+}
+
+/**
+ * Attach the device a message is to be published for to the gateway, if
+ * it has not already been attached on this connection. The attach message
+ * must be acknowledged before the device may publish, so the call waits
+ * for it to complete.
+ *
+ * @param topic	The topic of the message, /devices/<device>/...
+ * @return	The transport return code
+ */
+int GCP::attachDevice(const string& topic)
+{
+static const char	*authorization = "{\"authorization\" : \"\"}";
+const size_t		start = sizeof("/devices/") - 1;
+int			token, rc;
+
+	size_t end = topic.find('/', start);
+	m_attachDevice.assign(topic, start, end == string::npos ? string::npos : end - start);
+	if (m_attachDevice.compare(m_deviceID) == 0
+			|| m_attached.find(m_attachDevice) != m_attached.end())
+	{
+		return TRANSPORT_SUCCESS;
+	}
+	string attachTopic = "/devices/" + m_attachDevice + "/attach";
+	if ((rc = m_transport->publish(attachTopic, authorization, strlen(authorization),
+					1, &token)) == TRANSPORT_SUCCESS)
+	{
+		// Keep the acknowledgement apart from those of the readings and
+		// wait for it alone, rather than for every message in flight
+		m_tracker.control(token);
+		if (!m_tracker.waitControl(token, kTimeout))
+		{
+			rc = TRANSPORT_FAILURE;
+		}
+	}
+	if (rc != TRANSPORT_SUCCESS)
+	{
+		m_log->error("Failed to attach device %s to the gateway %s, %d",
+				m_attachDevice.c_str(), m_deviceID.c_str(), rc);
+		return rc;
+	}
+	m_attached.insert(m_attachDevice);
+	m_log->info("Attached device %s to the gateway %s", m_attachDevice.c_str(),
+			m_deviceID.c_str());
+	return TRANSPORT_SUCCESS;
+}
+
+/**
+ * Assemble the next message of the block, timing the grouping of the
+ * readings into the message
+ *
+ * @return	True if there is another message
+ */
+bool GCP::nextMessage()
+{
+	Instrumentation::Timer timer(m_instrumentation, Instrumentation::Grouping);
+	return m_builder.next();
+}
+
+/**
+ * Report the statistics of the stages of sending readings if they are due,
+ * and publish them as the state of the device if configured to. IoT Core
+ * accepts at most one state update per second for a device.
+ */
+void GCP::reportStatistics()
+{
+	if (!m_instrumentation.due())
+	{
+		return;
+	}
+	string state;
+	m_instrumentation.report(m_deviceID, state);
+	if (m_publishState && m_connected)
+	{
+		int token, rc;
+		if ((rc = m_transport->publish(m_stateTopic, state.c_str(), state.length(),
+						0, &token)) != TRANSPORT_SUCCESS)
+		{
+			m_log->warn("Failed to publish the statistics to %s, %d", m_stateTopic.c_str(), rc);
+		}
+	}
+}
+
+/**
+ * Connect to the Google Cloud IoT Core using MQTT. Attempts are made
+ * when the connection state allows, on the attempt thread, each waiting
+ * for at most the connect timeout. The caller waits for at most the
+ * connect budget. If the connection is not made within the budget the
+ * call returns, leaving any attempt in progress to continue, and a later
+ * call collects its outcome, so the caller is never blocked for long
+ * whilst the link is down or slow.
  *
  * @return connection status
  */
 int GCP::connect()
 {
-int rc = -1;
-MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
-
-	createJWT();
-	MQTTClient_create(&m_client, m_address.c_str(), m_clientID.c_str(),
-			MQTTCLIENT_PERSISTENCE_NONE, NULL);
-	MQTTClient_setCallbacks(m_client, this, connectionLost, messageArrived, deliveryComplete);
-	conn_opts.keepAliveInterval = 60;
-	conn_opts.cleansession = 1;
-	conn_opts.username = kUsername;
-	conn_opts.password = m_jwtStr;
-	MQTTClient_SSLOptions sslopts = MQTTClient_SSLOptions_initializer;
-
-	getRootPath();
-	getKeyPath();
-	sslopts.trustStore = m_rootPath.c_str();
-	sslopts.privateKey = m_keyPath.c_str();
-	conn_opts.ssl = &sslopts;
-	unsigned long retry_interval_ms = kInitialConnectIntervalMillis;
-	unsigned long total_retry_time_ms = 0;
-	while ((rc = MQTTClient_connect(m_client, &conn_opts)) != MQTTCLIENT_SUCCESS)
-	{
-		if (rc == 3)
+int rc = TRANSPORT_DISCONNECTED;
+double handshake = 0.0;
+
+	if (!m_shards.empty())
+	{
+		return connectShards();
+	}
+	if (!m_attemptThread)
+	{
+		m_attemptThread = new thread(&GCP::attemptThread, this);
+	}
+	m_state.lost();
+
+	ConnectionState::Clock::time_point begin = ConnectionState::Clock::now();
+	ConnectionState::Clock::time_point deadline = begin
+		+ chrono::milliseconds(m_state.budget());
+	unique_lock<mutex> lck(m_cancelMutex);
+	while (!m_cancel)
+	{
+		if (m_attempt == AttemptRequested || m_attempt == AttemptRunning)
 		{
-		      	// connection refused: server unavailable
-			usleep(retry_interval_ms * 1000);
-			total_retry_time_ms += retry_interval_ms;
-			if (total_retry_time_ms >= kMaxConnectRetryTimeElapsedMillis)
+			if (!m_cancelCv.wait_until(lck, deadline,
+					[this]{ return m_attempt == AttemptDone || m_cancel.load(); }))
 			{
-				m_log->error("Failed to connect, maximum retry time exceeded.");
-				return -1; 
+				// The attempt continues, a later call collects the outcome
+				return TRANSPORT_DISCONNECTED;
 			}
-			retry_interval_ms *= kIntervalMultiplier;
-			if (retry_interval_ms > kMaxConnectIntervalMillis)
+			continue;
+		}
+		if (m_attempt == AttemptDone)
+		{
+			m_attempt = AttemptIdle;
+			if (m_attemptRc == TRANSPORT_SUCCESS)
 			{
-				retry_interval_ms = kMaxConnectIntervalMillis;
+				rc = TRANSPORT_SUCCESS;
+				handshake = m_handshake;
+				break;
 			}
+			continue;
 		}
-		else
+		unsigned long wait = m_state.untilAttempt();
+		if (wait)
 		{
-			if (rc < 0)
+			if (ConnectionState::Clock::now() + chrono::milliseconds(wait) > deadline)
 			{
-				m_log->error("Failed to connect to MQTT server %s, return code %d\n", 
-					m_address.c_str(), rc);
+				// The next attempt is not due within the budget
+				return TRANSPORT_DISCONNECTED;
 			}
-			else
+			if (m_cancelCv.wait_for(lck, chrono::milliseconds(wait),
+						[this]{ return m_cancel.load(); }))
 			{
-				switch (rc)
-				{
-					case 1:
-						m_log->error("MQTT Connection refused: Unacceptable protocol version");
-						break;
-					case 2:
-						m_log->error("MQTT Connection refused: Identifier rejected");
-						break;
-					case 3:
-						m_log->error("MQTT Connection refused: Server unavailable");
-						break;
-					case 4:
-						m_log->error("MQTT Connection refused: Bad user name or password");
-						break;
-					case 5:
-						m_log->error("MQTT Connection refused: Not authorized");
-						break;
-					default:
-						m_log->error("Failed to connect to MQTT server %s, return code %d\n", 
-							m_address.c_str(), rc);
-						break;
-				}
+				return TRANSPORT_DISCONNECTED;
 			}
+		}
+		const char *token = m_tokens.token();
+		if (token == NULL)
+		{
+			m_log->error("Unable to create a JWT token to connect with");
 			return -1;
 		}
+		m_options.m_password = token;
+		m_options.m_connectTimeout = m_connectTimeout;
+		m_attempt = AttemptRequested;
+		m_cancelCv.notify_all();
 	}
-	if (rc == MQTTCLIENT_SUCCESS)
+	lck.unlock();
+	if (rc != TRANSPORT_SUCCESS)
 	{
-		m_connected = true;
-		createSubscriptions();
+		return rc;
 	}
+	m_state.connected(handshake);
+	m_instrumentation.record(Instrumentation::Reconnect, ConnectionState::Clock::now() - begin);
+	m_connected = true;
+	m_attached.clear();
+	createSubscriptions();
 	return rc;
 }
 
+/**
+ * The thread that makes the connection attempts requested by connect. An
+ * attempt may take as long as the connect timeout, which is longer than
+ * the connect budget a caller waits for, so the attempts are made here
+ * rather than on the thread of the caller.
+ */
+void GCP::attemptThread()
+{
+	unique_lock<mutex> lck(m_cancelMutex);
+	while (true)
+	{
+		m_cancelCv.wait(lck, [this]{ return m_attempt == AttemptRequested || m_attemptStop; });
+		if (m_attemptStop)
+		{
+			break;
+		}
+		m_attempt = AttemptRunning;
+		lck.unlock();
+
+		ConnectionState::Clock::time_point start = ConnectionState::Clock::now();
+		int rc = m_transport->connect(m_options);
+		double handshake = chrono::duration<double, milli>(
+				ConnectionState::Clock::now() - start).count();
+		if (rc < 0)
+		{
+			m_log->error("Failed to connect to MQTT server %s, return code %d",
+				m_address.c_str(), rc);
+		}
+		else if (rc != TRANSPORT_SUCCESS)
+		{
+			switch (rc)
+			{
+				case 1:
+					m_log->error("MQTT Connection refused: Unacceptable protocol version");
+					break;
+				case 2:
+					m_log->error("MQTT Connection refused: Identifier rejected");
+					break;
+				case 3:
+					m_log->error("MQTT Connection refused: Server unavailable");
+					break;
+				case 4:
+					m_log->error("MQTT Connection refused: Bad user name or password");
+					break;
+				case 5:
+					m_log->error("MQTT Connection refused: Not authorized");
+					break;
+				default:
+					m_log->error("Failed to connect to MQTT server %s, return code %d",
+						m_address.c_str(), rc);
+					break;
+			}
+		}
+		if (rc != TRANSPORT_SUCCESS)
+		{
+			m_state.failed();
+		}
+
+		lck.lock();
+		m_attemptRc = rc;
+		m_handshake = handshake;
+		m_attempt = AttemptDone;
+		m_cancelCv.notify_all();
+	}
+}
+
+/**
+ * Stop the attempt thread, waiting for any attempt in progress to finish
+ */
+void GCP::stopAttempts()
+{
+	if (m_attemptThread)
+	{
+		{
+			lock_guard<mutex> guard(m_cancelMutex);
+			m_attemptStop = true;
+			m_cancelCv.notify_all();
+		}
+		m_attemptThread->join();
+		delete m_attemptThread;
+		m_attemptThread = NULL;
+		m_attemptStop = false;
+	}
+	m_attempt = AttemptIdle;
+}
+
+/**
+ * Start making the first connection on a background thread, so that the
+ * plugin may be started without waiting for the broker. Readings are not
+ * sent until the thread has connected.
+ */
+void GCP::start()
+{
+	m_cancel = false;
+	m_connecting = true;
+	m_connectThread = new thread(&GCP::connectThread, this);
+}
+
+/**
+ * Cancel any connection being made, so that the plugin may be shut down
+ * without waiting for the broker. An attempt in progress is abandoned
+ * once the MQTT library returns from it.
+ */
+void GCP::cancel()
+{
+	{
+		lock_guard<mutex> guard(m_cancelMutex);
+		m_cancel = true;
+		m_cancelCv.notify_all();
+	}
+	for (auto it = m_shards.begin(); it != m_shards.end(); it++)
+	{
+		(*it)->cancel();
+	}
+}
+
+/**
+ * The thread that makes the first connection. Attempts continue, at the
+ * interval allowed by the connection state, until one succeeds or the
+ * connection is cancelled.
+ *
+ * When sending as several devices a single round of attempts is made.
+ * Each shard that did not connect then reconnects, with its own backoff,
+ * when it next sends, so that one device that cannot connect does not
+ * hold up the others.
+ */
+void GCP::connectThread()
+{
+	Instrumentation::Clock::time_point start = Instrumentation::Clock::now();
+	while (!m_cancel)
+	{
+		{
+			lock_guard<mutex> guard(m_publishMutex);
+			int rc = connect();
+			if (rc == TRANSPORT_SUCCESS)
+			{
+				m_log->info("Ready to send readings %.1fms after starting",
+						chrono::duration<double, milli>(
+							Instrumentation::Clock::now() - start).count());
+				break;
+			}
+			if (!m_shards.empty())
+			{
+				m_log->warn("Not all devices connected, %d, they will reconnect when sending",
+						rc);
+				break;
+			}
+		}
+		unique_lock<mutex> lck(m_cancelMutex);
+		m_cancelCv.wait_for(lck, chrono::milliseconds(kConnectRetry),
+				[this]{ return m_cancel.load(); });
+	}
+	m_connecting = false;
+}
+
 /**
  * Publish a reading payload to the GCP IoT Core Device default topic
  * using MQTT
@@ -398,7 +1075,7 @@ MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
  * @param payload	The payload to publich
  * @param payload_size	Size of the payload
  */
-int GCP::publish(char *payload, const int payload_size)
+int GCP::publish(const char *payload, const int payload_size)
 {
 	return publish(m_topic, payload, payload_size);
 }
@@ -411,16 +1088,21 @@ int GCP::publish(char *payload, const int payload_size)
  * @param payload	The payload to publich
  * @param payload_size	Size of the payload
  */
-int GCP::publish(const string& topic, char *payload, const int payload_size)
+int GCP::publish(const string& topic, const char *payload, const int payload_size)
 {
-MQTTClient_message pubmsg = MQTTClient_message_initializer;
-MQTTClient_deliveryToken token = {++m_lastSent};
+int	token = 0;
 
-	pubmsg.payload = payload;
-	pubmsg.payloadlen = payload_size;
-	pubmsg.qos = 0;
-	pubmsg.retained = 0;
-	return MQTTClient_publishMessage(m_client, topic.c_str(), &pubmsg, &token);
+	m_instrumentation.record(Instrumentation::Throttle, m_limiter.acquire(payload_size));
+	Instrumentation::Timer timer(m_instrumentation, Instrumentation::Publish);
+	int rc = m_transport->publish(topic, payload, payload_size, m_qos, &token);
+	timer.stop();
+	if (rc == TRANSPORT_SUCCESS)
+	{
+		m_lastSent = token;
+		m_bytesPublished += payload_size;
+		m_instrumentation.published(payload_size);
+	}
+	return rc;
 }
 
 
@@ -433,20 +1115,36 @@ void GCP::createSubscriptions()
 	char	topic[1024];
 	snprintf(topic, sizeof(topic), "/devices/%s/errors", m_deviceID.c_str());
 	int rc;
-	if ((rc = MQTTClient_subscribe(m_client, topic, 0)) != MQTTCLIENT_SUCCESS)
+	if ((rc = m_transport->subscribe(topic, 0)) != TRANSPORT_SUCCESS)
 	{
 		m_log->error("Failed to subscribe to error topic '%s', %d", topic, rc);
 	}
 }
 
+/**
+ * If the token the connection was made with is due to be replaced, because
+ * it is close to expiry or the key has changed, disconnect so that the
+ * next message sent reconnects with the new token. This is only called
+ * when no messages are in flight, so the connection is not dropped by
+ * the broker part way through a block when the token expires.
+ */
+void GCP::checkToken()
+{
+	if (m_connected && m_tokens.rotationDue())
+	{
+		m_log->info("Reconnecting to GCP to replace the JWT token");
+		disconnect();
+	}
+}
+
 /**
  * Disconnect from the IoT Core MQTT
  */
 void GCP::disconnect()
 {
 	m_connected = false;
-	MQTTClient_disconnect(m_client, 10000);
-	MQTTClient_destroy(&m_client);
+	m_state.lost();
+	m_transport->disconnect();
 }
 
 /**
@@ -454,29 +1152,32 @@ void GCP::disconnect()
  * 
  * @param dt	Delivery token
  */
-void GCP::delivered(MQTTClient_deliveryToken dt)
+void GCP::delivered(int dt)
 {
-	if (dt > m_lastDelivered)
-		m_lastDelivered = dt;
+	m_tracker.delivered(dt);
 }
 
 /**
  * Process an MQTT message from the Cloud IoT Core
  *
  * @param topic	The topic that IoT published to
- * @param msg	The message content that IoT Core published
+ * @param payload	The message content that IoT Core published
+ * @param len		The length of the message content
  */
-void GCP::msgArrived(char *topic, MQTTClient_message *msg)
+void GCP::msgArrived(const char *topic, const char *payload, int len)
 {
 	m_log->error("MQTT message received for topic '%s'", topic);
-	int len = msg->payloadlen;
 	char *buf = (char *)malloc(len + 1);
-	memcpy(buf, msg->payload, len);
+	memcpy(buf, payload, len);
 	buf [len] = 0;
 	m_log->error("Message payload is %*s", len, buf);
 	free(buf);
-	MQTTClient_freeMessage(&msg);
-	MQTTClient_free(topic);
+	size_t tlen = strlen(topic);
+	if (tlen >= 7 && strcmp(topic + tlen - 7, "/errors") == 0)
+	{
+		// The broker may drop the connection if the quotas are exceeded
+		m_limiter.backoff();
+	}
 }
 
 /**
@@ -488,107 +1189,7 @@ void GCP::lostConnection(const char *reason)
 {
 	m_log->error("MQTT connection lost: %s", reason);
 	m_connected = false;
-}
-
-/**
- * Calculates a JSON Web Token (JWT) given the path to a private key and
- * Google Cloud project ID. The JWT token is saved in the member variable
- * m_jwtStr.
- */
-void GCP::createJWT()
-{
-char iat_time[sizeof(time_t) * 3 + 2];
-char exp_time[sizeof(time_t) * 3 + 2];
-uint8_t* key = NULL; // Stores the Base64 encoded certificate
-size_t key_len = 0;
-jwt_t *jwt = NULL;
-int ret = 0;
-char *out = NULL;
-
-	if (m_jwtExpire && m_jwtExpire < time(0))
-	{
-		m_log->info("JWT token has not yet expired");
-		return;
-	}
-	else
-	{
-		m_log->info("Generating a new JWT token for MQTT bridge.");
-	}
-	// Read private key from file
-	FILE *fp = fopen(getKeyPath().c_str(), "r");
-	if (fp == (void*) NULL)
-	{
-		m_log->error("Could not open private key file: %s\n", getKeyPath().c_str());
-		return;
-	}
-	fseek(fp, 0L, SEEK_END);
-	key_len = ftell(fp);
-	fseek(fp, 0L, SEEK_SET);
-	key = (uint8_t *)malloc(sizeof(uint8_t) * (key_len + 1)); // certificate length + \0
-
-	if (fread(key, 1, key_len, fp) != key_len)
-	{
-		m_log->error("Failed to read key %s", getKeyPath().c_str());
-	}
-	key[key_len] = '\0';
-	fclose(fp);
-
-	// Get JWT parts
-	getIatExp(iat_time, exp_time, sizeof(iat_time));
-
-	jwt_new(&jwt);
-
-	// Write JWT
-	ret = jwt_add_grant(jwt, "iat", iat_time);
-	if (ret)
-	{
-		m_log->error("Error setting issue timestamp: %d\n", ret);
-	}
-	ret = jwt_add_grant(jwt, "exp", exp_time);
-	if (ret)
-	{
-		m_log->error("Error setting expiration: %d\n", ret);
-	}
-	ret = jwt_add_grant(jwt, "aud", m_projectID.c_str());
-	if (ret)
-	{
-		m_log->error("Error adding audience: %d\n", ret);
-	}
-	ret = jwt_set_alg(jwt, getAlgorithm(), key, key_len);
-	if (ret)
-	{
-		m_log->error("Error during set alg: %d\n", ret);
-	}
-	out = jwt_encode_str(jwt);
-	if(!out)
-	{
-		extern int errno;
-		m_log->error("Error during JWT token creation: %d", errno);
-	}
-	if (m_jwtStr)
-	{
-		free(m_jwtStr);
-	}
-	m_jwtStr = out;
-
-	jwt_free(jwt);
-	free(key);
-	m_jwtExpire = time(0) + 3500;	// Set expiry time to give us a little leeway
-}
-
-/**
- * Populate the issue time and expiry time of the JWT token
- *
- * @param iat	Buffer to write issue time into
- * @param exp	Buffer to write expiry time into (issue time + 1 hour)
- * @param time_size	The size of each of the buffers above
- */
-void GCP::getIatExp(char* iat, char* exp, int time_size)
-{
-time_t now_seconds = time(NULL);
-
-	snprintf(iat, time_size, "%lu", now_seconds);
-	snprintf(exp, time_size, "%lu", now_seconds + 3600);
+	m_state.lost();
 }
 
 /**
@@ -637,6 +1238,66 @@ string GCP::getKeyPath()
 	return m_keyPath;
 }
 
+/**
+ * Return the path of the spool file for this device, creating the spool
+ * directory if required.
+ *
+ * @return path to the spool file
+ */
+string GCP::getSpoolPath()
+{
+string path;
+
+	if (getenv("FLEDGE_DATA"))
+	{
+		path = getenv("FLEDGE_DATA");
+	}
+	else if (getenv("FLEDGE_ROOT"))
+	{
+		path = getenv("FLEDGE_ROOT");
+		path += "/data";
+	}
+	else
+	{
+		path = "/usr/local/fledge/data";
+	}
+	path += "/spool";
+	mkdir(path.c_str(), 0700);
+	path += "/gcp_" + m_deviceID + ".spool";
+
+	return path;
+}
+
+/**
+ * Return the path of the directory of root certificates prepared for
+ * this device, creating the cache directory if required.
+ *
+ * @return path to the certificate directory
+ */
+string GCP::getCertificatePath()
+{
+string path;
+
+	if (getenv("FLEDGE_DATA"))
+	{
+		path = getenv("FLEDGE_DATA");
+	}
+	else if (getenv("FLEDGE_ROOT"))
+	{
+		path = getenv("FLEDGE_ROOT");
+		path += "/data";
+	}
+	else
+	{
+		path = "/usr/local/fledge/data";
+	}
+	path += "/cache";
+	mkdir(path.c_str(), 0700);
+	path += "/gcp_" + m_deviceID + "_" + m_rootCA;
+
+	return path;
+}
+
 /**
  * Return the path of the root key
  *
@@ -658,24 +1319,7 @@ string GCP::getRootPath()
 	{
 		m_rootPath = "/usr/local/fledge/data/etc/certs/"; 
 	}
-	m_rootPath += "pem/roots.pem";
+	m_rootPath += "pem/" + m_rootCA + ".pem";
 
 	return m_rootPath;
 }
-
-/**
- * Map an asset name to a suitable device name in GCP IoT Core
- *
- * @param assetName 	The asset name to map
- * @result		The mapped asset name
- */
-void GCP::mapAssetName(string& assetName)
-{
-	for (string::iterator it = assetName.begin(); it != assetName.end(); ++it)
-	{
-		if (*it == ' ')
-		{
-			*it = '_';
-		}
-	}
-}
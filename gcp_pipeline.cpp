@@ -0,0 +1,268 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <gcp.h>
+#include <stdio.h>
+
+/*
+ * The pipelined send mode of the GCP plugin.
+ *
+ * In this mode plugin_send only serializes the readings into messages and
+ * adds them to a lock-free queue. A dedicated I/O thread takes messages from
+ * the queue and publishes them, so the serialization of one block overlaps
+ * the transmission of the previous one. A second queue returns the messages
+ * to the plugin thread once they are sent, so the message buffers are reused.
+ *
+ * Progress is tracked using the reading IDs. Each message records the ID of
+ * the last reading it contains, and the I/O thread advances the confirmed ID
+ * as messages are published, or with QoS 1 acknowledged. The count returned
+ * to Fledge is the number of readings in the block up to the confirmed ID.
+ * Readings that Fledge offers again, because they were not yet confirmed,
+ * but that are already queued are not serialized a second time.
+ */
+
+using namespace std;
+
+static const unsigned long kQueueTimeout = 10000L;
+static const unsigned long kRetryInterval = 1000L;
+
+/**
+ * Create the message queues and start the I/O thread
+ *
+ * @param queueSize	The number of messages that may be queued
+ */
+void GCP::startPipeline(unsigned int queueSize)
+{
+	m_queue = new MessageQueue(queueSize);
+	m_free = new MessageQueue(queueSize);
+	for (unsigned int i = 0; i < queueSize; i++)
+	{
+		QueuedMessage *message = new QueuedMessage();
+		m_messages.push_back(message);
+		m_free->push(message);
+	}
+	m_running = true;
+	m_ioThread = new thread(&GCP::ioThread, this);
+	m_log->info("Started pipelined sending with a queue of %d messages", queueSize);
+}
+
+/**
+ * Stop the I/O thread and discard any messages that have not been sent
+ */
+void GCP::stopPipeline()
+{
+	if (m_ioThread)
+	{
+		{
+			lock_guard<mutex> guard(m_ioMutex);
+			m_running = false;
+			m_ioCv.notify_all();
+		}
+		m_ioThread->join();
+		delete m_ioThread;
+		m_ioThread = NULL;
+	}
+	if (!m_backlog.empty() || (m_queue && !m_queue->empty()))
+	{
+		m_log->warn("Discarding %d unsent messages", (int)(m_backlog.size() + m_queue->size()));
+	}
+	m_backlog.clear();
+	for (auto it = m_messages.begin(); it != m_messages.end(); it++)
+	{
+		delete *it;
+	}
+	m_messages.clear();
+	delete m_queue;
+	delete m_free;
+	m_queue = NULL;
+	m_free = NULL;
+}
+
+/**
+ * Check the readings have increasing, non-zero IDs that can be used to
+ * track the progress of the pipeline
+ *
+ * @param readings	The block of readings
+ * @return		True if the readings IDs can be used
+ */
+bool GCP::hasReadingIds(const vector<Reading *>& readings)
+{
+unsigned long last = 0;
+
+	for (auto it = readings.cbegin(); it != readings.cend(); it++)
+	{
+		unsigned long id = (*it)->getId();
+		if (id <= last)
+		{
+			m_log->warn("Reading IDs are not usable for pipelined sending, sending block directly");
+			return false;
+		}
+		last = id;
+	}
+	return true;
+}
+
+/**
+ * Serialize a block of readings into messages on the queue for the I/O
+ * thread. If no message buffers are free the call waits for the I/O thread
+ * to send messages, if none become free the remaining readings are left for
+ * Fledge to offer again.
+ *
+ * @param readings	The block of readings
+ * @return		The number of readings in the block confirmed as sent
+ */
+uint32_t GCP::queueBlock(const vector<Reading *>& readings)
+{
+	if (readings.empty())
+	{
+		return 0;
+	}
+
+	// Skip over the readings that have already been queued
+	size_t first = 0;
+	while (first < readings.size() && readings[first]->getId() <= m_queuedId)
+	{
+		first++;
+	}
+
+	if (first < readings.size())
+	{
+		{
+			Instrumentation::Timer timer(m_instrumentation, Instrumentation::Serialization);
+			m_builder.setBlock(readings, first);
+		}
+		while (nextMessage())
+		{
+			QueuedMessage *message = m_free->pop();
+			if (!message)
+			{
+				// Back pressure, wait for the I/O thread to free a buffer
+				unique_lock<mutex> lck(m_ioMutex);
+				m_ioCv.wait_for(lck, chrono::milliseconds(kQueueTimeout),
+					[this, &message]{
+						return !m_running || (message = m_free->pop()) != NULL;
+					});
+			}
+			if (!message)
+			{
+				m_log->warn("Send queue is full, %d readings not queued",
+						(int)(readings.size() - m_builder.end() + m_builder.readings()));
+				break;
+			}
+			const char *payload = m_builder.data();
+			size_t length = m_builder.length();
+			message->m_topic = encodeMessage(&payload, &length);
+			message->m_payload.clear();
+			message->m_payload.append(payload, length);
+			message->m_readings = m_builder.readings();
+			// Only the last message of a range confirms the readings in it
+			message->m_lastId = m_builder.rangeComplete()
+				? readings[m_builder.end() - 1]->getId() : m_queuedId;
+			m_queue->push(message);
+			m_queuedId = message->m_lastId;
+			lock_guard<mutex> guard(m_ioMutex);
+			m_ioCv.notify_all();
+		}
+	}
+
+	m_compressor.logStatistics();
+
+	// Wait for some of this block to be confirmed by the I/O thread
+	unsigned long firstId = readings.front()->getId();
+	{
+		unique_lock<mutex> lck(m_ioMutex);
+		m_ioCv.wait_for(lck, chrono::milliseconds(kQueueTimeout),
+			[this, firstId]{ return !m_running || m_confirmedId >= firstId; });
+	}
+	unsigned long confirmed = m_confirmedId;
+	uint32_t n = 0;
+	while (n < readings.size() && readings[n]->getId() <= confirmed)
+	{
+		n++;
+	}
+	return n;
+}
+
+/**
+ * The I/O thread. Messages are taken from the queue and published, once
+ * published, or with QoS 1 acknowledged, the confirmed ID is advanced and
+ * the message buffers are returned to the plugin thread. Messages that
+ * are not confirmed are retried.
+ */
+void GCP::ioThread()
+{
+	while (m_running)
+	{
+		QueuedMessage *message;
+		while ((message = m_queue->pop()) != NULL)
+		{
+			m_backlog.push_back(message);
+		}
+		if (m_backlog.empty())
+		{
+			unique_lock<mutex> lck(m_ioMutex);
+			m_ioCv.wait_for(lck, chrono::milliseconds(kRetryInterval),
+				[this]{ return !m_running || !m_queue->empty(); });
+			continue;
+		}
+
+		size_t published = 0, confirmed = 0;
+		{
+			lock_guard<mutex> guard(m_publishMutex);
+			checkToken();
+			if (!m_connected && connect() != TRANSPORT_SUCCESS)
+			{
+				m_log->error("Failed to connect to MQTT service %s, %d messages waiting",
+						m_address.c_str(), (int)m_backlog.size());
+			}
+			else
+			{
+				m_tracker.reset();
+				for (auto it = m_backlog.cbegin(); it != m_backlog.cend() && m_running; it++)
+				{
+					if (!publishMessage((*it)->m_topic, (*it)->m_payload.data(),
+							(*it)->m_payload.length(), published + 1))
+					{
+						break;
+					}
+					published++;
+				}
+				if (m_qos == 0)
+				{
+					confirmed = published;
+				}
+				else if (published)
+				{
+					Instrumentation::Timer timer(m_instrumentation, Instrumentation::Acknowledge);
+					confirmed = m_tracker.wait(kQueueTimeout);
+				}
+				reportStatistics();
+			}
+		}
+
+		for (size_t i = 0; i < confirmed; i++)
+		{
+			message = m_backlog.front();
+			m_backlog.pop_front();
+			m_confirmedId = message->m_lastId;
+			m_free->push(message);
+		}
+		{
+			lock_guard<mutex> guard(m_ioMutex);
+			m_ioCv.notify_all();
+		}
+		if (confirmed < m_backlog.size())
+		{
+			// Some messages were not sent, wait before trying again
+			unique_lock<mutex> lck(m_ioMutex);
+			m_ioCv.wait_for(lck, chrono::milliseconds(kRetryInterval),
+				[this]{ return !m_running; });
+		}
+	}
+}
@@ -0,0 +1,170 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <gcp.h>
+
+/*
+ * The sharded send mode of the GCP plugin.
+ *
+ * In this mode the plugin sends as several devices, each with its own GCP
+ * object, connection and telemetry quota. The readings of a block are
+ * divided between the shards by a hash of the asset name, so all of the
+ * readings of an asset go to the same device in block order. The shards
+ * serialize and publish their part of the block in parallel.
+ *
+ * Fledge must be told how many readings of the block were sent and can only
+ * move forward over a prefix of the block. The count returned is the index
+ * in the block of the first reading that a shard failed to send. Later
+ * readings that other shards did send are remembered, using the reading
+ * IDs, and are not sent again when Fledge offers them again.
+ */
+
+using namespace std;
+
+/**
+ * Delete the shards and the worker pool that runs them
+ */
+void GCP::clearShards()
+{
+	for (auto it = m_shards.begin(); it != m_shards.end(); it++)
+	{
+		delete *it;
+	}
+	m_shards.clear();
+	if (m_pool)
+	{
+		delete m_pool;
+		m_pool = NULL;
+	}
+}
+
+/**
+ * Return the shard that sends the readings of an asset. The FNV-1a hash
+ * is used, as it does not change between runs of the plugin.
+ *
+ * @param assetName	The name of the asset
+ * @return		The index of the shard
+ */
+unsigned int GCP::shardOf(const string& assetName) const
+{
+	uint32_t hash = 2166136261U;
+
+	for (auto it = assetName.cbegin(); it != assetName.cend(); it++)
+	{
+		hash = (hash ^ (unsigned char)*it) * 16777619U;
+	}
+	return hash % m_shards.size();
+}
+
+/**
+ * Connect each of the shards that is not already connected, in parallel.
+ * Shards that are connected are left alone.
+ *
+ * @return	TRANSPORT_SUCCESS if all of the shards are connected
+ */
+int GCP::connectShards()
+{
+	vector<function<void()> > tasks;
+	vector<int> results(m_shards.size(), TRANSPORT_SUCCESS);
+
+	for (size_t i = 0; i < m_shards.size(); i++)
+	{
+		if (!m_shards[i]->m_connected)
+		{
+			tasks.push_back([this, i, &results]{ results[i] = m_shards[i]->connect(); });
+		}
+	}
+	m_pool->run(tasks);
+	for (auto it = results.cbegin(); it != results.cend(); it++)
+	{
+		if (*it != TRANSPORT_SUCCESS)
+		{
+			return *it;
+		}
+	}
+	return TRANSPORT_SUCCESS;
+}
+
+/**
+ * Divide a block of readings between the shards and send the parts in
+ * parallel.
+ *
+ * @param readings	The readings to send
+ * @return		The number of readings sent
+ */
+uint32_t GCP::sendShards(const vector<Reading *>& readings)
+{
+	bool useIds = hasReadingIds(readings);
+
+	for (size_t i = 0; i < m_shards.size(); i++)
+	{
+		m_shardBlocks[i].clear();
+		m_shardPositions[i].clear();
+	}
+	for (size_t i = 0; i < readings.size(); i++)
+	{
+		unsigned int shard = shardOf(readings[i]->getAssetName());
+		if (useIds && readings[i]->getId() <= m_shardSentId[shard])
+		{
+			// Already sent by this shard in an earlier call
+			continue;
+		}
+		m_shardBlocks[shard].push_back(readings[i]);
+		m_shardPositions[shard].push_back(i);
+	}
+
+	vector<function<void()> > tasks;
+	for (size_t i = 0; i < m_shards.size(); i++)
+	{
+		m_shardSent[i] = 0;
+		if (!m_shardBlocks[i].empty())
+		{
+			tasks.push_back([this, i]{ m_shardSent[i] = m_shards[i]->send(m_shardBlocks[i]); });
+		}
+	}
+	m_pool->run(tasks);
+
+	size_t n = readings.size();
+	for (size_t i = 0; i < m_shards.size(); i++)
+	{
+		const vector<Reading *>& block = m_shardBlocks[i];
+		size_t sent = m_shardSent[i];
+		if (sent && useIds)
+		{
+			m_shardSentId[i] = block[sent - 1]->getId();
+		}
+		if (sent < block.size() && m_shardPositions[i][sent] < n)
+		{
+			n = m_shardPositions[i][sent];
+		}
+	}
+	if (n < readings.size())
+	{
+		m_log->warn("Sent %d of %d readings, a shard was unable to send reading %d",
+				(int)n, (int)readings.size(), (int)n);
+	}
+	return n;
+}
+
+/**
+ * Return the number of payload bytes published since the plugin was
+ * created, including those published by the shards
+ *
+ * @return	The number of bytes
+ */
+unsigned long GCP::bytesPublished() const
+{
+unsigned long bytes = m_bytesPublished;
+
+	for (auto it = m_shards.begin(); it != m_shards.end(); it++)
+	{
+		bytes += (*it)->bytesPublished();
+	}
+	return bytes;
+}
@@ -0,0 +1,79 @@
+#ifndef _ASSET_REGISTRY_H
+#define _ASSET_REGISTRY_H
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <time.h>
+
+/**
+ * A bounded registry of the asset names the plugin has seen. Each raw
+ * asset name is interned to an entry that caches the mapped name used in
+ * the payload. Entries are evicted on a least recently used basis once the
+ * registry exceeds its maximum size, or once they have not been used for
+ * the configured time to live.
+ *
+ * The registry also maintains a per-block view, the set of distinct mapped
+ * asset names seen since the last call to beginBlock(). Each of these is
+ * given a slot number, starting at zero, that the caller can use to index
+ * the data it holds for the block.
+ */
+class AssetRegistry {
+	public:
+		typedef void	(*Mapper)(std::string& name);
+
+		AssetRegistry(Mapper mapper, unsigned int maxEntries = 1000,
+				unsigned int ttl = 3600);
+		void		setLimits(unsigned int maxEntries, unsigned int ttl);
+		void		beginBlock();
+		unsigned int	lookup(const std::string& assetName);
+		void		endBlock();
+		/**
+		 * Return the number of distinct assets in the current block
+		 */
+		unsigned int	blockAssets() const { return m_blockNames.size(); };
+		/**
+		 * Return the mapped asset name of a slot in the current block
+		 */
+		const std::string&
+				blockAssetName(unsigned int slot) const
+				{
+					return m_blockNames[slot];
+				};
+		/**
+		 * Return the number of asset names held in the registry
+		 */
+		size_t		size() const { return m_index.size(); };
+		/**
+		 * Return the number of entries evicted since creation
+		 */
+		unsigned long	evictions() const { return m_evictions; };
+	private:
+		class Entry {
+			public:
+				std::string	m_mapped;
+				time_t		m_lastUsed;
+				unsigned long	m_block;
+				unsigned int	m_slot;
+				std::list<const std::string *>::iterator
+						m_lru;
+		};
+		typedef std::unordered_map<std::string, Entry>	EntryMap;
+		void		evict(time_t now);
+		Mapper		m_mapper;
+		unsigned int	m_maxEntries;
+		unsigned int	m_ttl;
+		EntryMap	m_index;
+		std::list<const std::string *>
+				m_lru;
+		unsigned long	m_block;
+		time_t		m_blockTime;
+		std::vector<std::string>
+				m_blockNames;
+		std::unordered_map<std::string, unsigned int>
+				m_blockSlots;
+		std::string	m_lastName;
+		unsigned int	m_lastSlot;
+		unsigned long	m_evictions;
+};
+#endif
@@ -0,0 +1,74 @@
+#ifndef _ASYNC_TRANSPORT_H
+#define _ASYNC_TRANSPORT_H
+#include <mqtt_transport.h>
+#include <logger.h>
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "MQTTAsync.h"
+
+/**
+ * An MQTT transport that uses the asynchronous MQTTAsync API.
+ *
+ * Messages are sent without waiting for the previous message to complete,
+ * up to a window of messages that may be in flight at any one time. The
+ * completion of each message is reported by the onSuccess and onFailure
+ * callbacks of the library, which release a place in the window.
+ *
+ * Messages sent with QoS 0 all have a token of 0, so they are tracked
+ * separately from the other messages, by the time each was sent. They
+ * complete in the order they were sent.
+ */
+class AsyncTransport : public MQTTTransport {
+	public:
+		AsyncTransport(TransportListener *listener, unsigned int window);
+		~AsyncTransport();
+		int		connect(const TransportOptions& options);
+		void		disconnect();
+		int		subscribe(const std::string& topic, int qos);
+		int		publish(const std::string& topic, const char *payload,
+					int length, int qos, int *token);
+		int		waitForCompletion(unsigned long timeout);
+		bool		getStatistics(TransportStatistics& stats);
+		void		msgArrived(char *topic, MQTTAsync_message *msg);
+		void		lostConnection(const char *reason);
+		void		connectComplete(int rc);
+		void		disconnectComplete();
+		void		sendComplete(MQTTAsync_token token, bool success, int code);
+	private:
+		typedef std::chrono::steady_clock	Clock;
+		/**
+		 * Return the number of messages in flight
+		 */
+		size_t		inFlight() const { return m_inFlight.size() + m_unacked.size(); };
+		void		ackLatency(Clock::time_point sent);
+		Logger		*m_log;
+		MQTTAsync	m_client;
+		bool		m_created;
+		unsigned int	m_window;
+		std::mutex	m_mutex;
+		std::condition_variable
+				m_cv;
+		bool		m_connecting;
+		bool		m_connected;
+		bool		m_disconnecting;
+		int		m_connectRc;
+		unsigned int	m_reserved;
+		std::map<MQTTAsync_token, Clock::time_point>
+				m_inFlight;
+		std::set<MQTTAsync_token>
+				m_early;
+		std::deque<Clock::time_point>
+				m_unacked;
+		unsigned int	m_earlyUnacked;
+		unsigned int	m_maxInFlight;
+		unsigned long	m_acks;
+		unsigned long	m_failures;
+		double		m_ackLatencyTotal;
+		unsigned long	m_ackLatencySamples;
+		double		m_ackLatencyMax;
+};
+#endif
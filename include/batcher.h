@@ -0,0 +1,79 @@
+#ifndef _BATCHER_H
+#define _BATCHER_H
+#include <reading.h>
+#include <logger.h>
+#include <vector>
+#include <chrono>
+
+/**
+ * Coalesce the readings of several calls to send into batches.
+ *
+ * Fledge frees the readings it passes to the plugin once the call returns,
+ * so the readings are copied into the batch. Readings are only reported to
+ * Fledge as sent once the batch that holds them has been sent; until then
+ * Fledge offers them again and the reading IDs identify those that are
+ * already in the batch.
+ *
+ * A batch is sent once the estimated size of the readings in it reaches
+ * the target message size, or once the oldest reading in it has waited for
+ * the linger time. The messages of the batch are limited to the target
+ * size. The target is tuned each time a full batch is sent: it moves in
+ * steps in whichever direction last increased the throughput, and is
+ * reduced whenever sending a batch takes longer than the linger time.
+ * When a rate limit on the number of messages delays the batch the target
+ * is increased instead, so that the readings are sent in fewer messages.
+ */
+class Batcher {
+	public:
+		typedef std::chrono::steady_clock Clock;
+		Batcher();
+		~Batcher();
+		void		configure(bool enabled, unsigned int linger, size_t maxBytes);
+		/**
+		 * Return true if readings are batched
+		 */
+		bool		enabled() const { return m_enabled; };
+		void		add(const std::vector<Reading *>& readings);
+		bool		ready() const;
+		/**
+		 * Return true if the batch has reached the target size
+		 */
+		bool		full() const { return estimate() >= m_target; };
+		/**
+		 * Return the readings in the batch
+		 */
+		const std::vector<Reading *>&
+				readings() const { return m_readings; };
+		/**
+		 * Return the target size of a message
+		 */
+		size_t		target() const { return m_target; };
+		void		sent(size_t n, size_t bytes, Clock::duration elapsed, bool full);
+		void		grow();
+		uint32_t	confirmed(const std::vector<Reading *>& readings) const;
+		void		clear();
+	private:
+		/**
+		 * Return the estimated size of the readings in the batch
+		 */
+		size_t		estimate() const
+				{
+					return m_readings.size() * m_bytesPerReading;
+				};
+		void		tune(size_t bytes, Clock::duration elapsed);
+		Logger		*m_log;
+		bool		m_enabled;
+		Clock::duration	m_linger;
+		size_t		m_maxBytes;
+		size_t		m_target;
+		double		m_bytesPerReading;
+		double		m_throughput;
+		bool		m_growing;
+		std::vector<Reading *>
+				m_readings;
+		Clock::time_point
+				m_oldest;
+		unsigned long	m_lastId;
+		unsigned long	m_confirmedId;
+};
+#endif
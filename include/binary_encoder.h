@@ -0,0 +1,55 @@
+#ifndef _BINARY_ENCODER_H
+#define _BINARY_ENCODER_H
+#include <reading_encoder.h>
+#include <stdint.h>
+
+/**
+ * A binary encoding of messages using either CBOR (RFC 8949) or
+ * MessagePack. The structure of the message is the same as the JSON
+ * encoding, but datapoint values are written in their native form,
+ * integers, double precision floats, strings and byte strings, without
+ * being converted to text.
+ */
+class BinaryEncoder : public ReadingEncoder {
+	public:
+		enum Format { CBOR, MessagePack };
+		BinaryEncoder(Format format) : m_format(format) {};
+		const char	*name() const
+				{
+					return m_format == CBOR ? "cbor" : "msgpack";
+				};
+		void		appendReading(PayloadWriter& out, Reading *reading);
+		void		startMessage(PayloadWriter& out, unsigned int assets)
+				{
+					writeMap(out, assets);
+				};
+		void		startAsset(PayloadWriter& out, const std::string& name,
+					unsigned int readings, bool first)
+				{
+					writeString(out, name.data(), name.length());
+					writeArray(out, readings);
+				};
+		void		nextReading(PayloadWriter& out) {};
+		void		endAsset(PayloadWriter& out) {};
+		void		endMessage(PayloadWriter& out) {};
+		size_t		messageOverhead() const { return 5; };
+		size_t		assetOverhead(size_t nameLength) const
+				{
+					return nameLength + 10;
+				};
+		size_t		readingSeparator() const { return 0; };
+	private:
+		void		writeDatapoint(PayloadWriter& out, Datapoint *datapoint);
+		void		writeValue(PayloadWriter& out, DatapointValue& value);
+		void		writeHeader(PayloadWriter& out, uint8_t major, uint64_t value);
+		void		writeMap(PayloadWriter& out, uint64_t count);
+		void		writeArray(PayloadWriter& out, uint64_t count);
+		void		writeString(PayloadWriter& out, const char *str, size_t length);
+		void		writeBytes(PayloadWriter& out, const void *data, size_t length);
+		void		writeInt(PayloadWriter& out, int64_t value);
+		void		writeDouble(PayloadWriter& out, double value);
+		void		writeBigEndian(PayloadWriter& out, uint8_t prefix,
+					uint64_t value, int bytes);
+		Format		m_format;
+};
+#endif
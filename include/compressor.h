@@ -0,0 +1,62 @@
+#ifndef _COMPRESSOR_H
+#define _COMPRESSOR_H
+#include <string>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include <logger.h>
+
+/**
+ * Compress the messages sent to GCP.
+ *
+ * The compression context and the output buffer are created once and reused
+ * for every message. The name of the algorithm is added as a subfolder of
+ * the telemetry topic, which IoT Core passes on as the subFolder attribute
+ * of the Pub/Sub message, so the consumer knows how to decode the payload.
+ */
+class Compressor {
+	public:
+		enum Algorithm { None, Deflate, Gzip, Zstd };
+		Compressor();
+		~Compressor();
+		void		configure(const std::string& algorithm, int level);
+		bool		compress(const char *data, size_t length);
+		/**
+		 * Return true if messages are to be compressed
+		 */
+		bool		enabled() const { return m_algorithm != None; };
+		/**
+		 * Return the name of the compression algorithm
+		 */
+		const char	*name() const { return m_name; };
+		/**
+		 * Return the compressed message
+		 */
+		const char	*data() const { return m_buffer; };
+		/**
+		 * Return the length of the compressed message
+		 */
+		size_t		length() const { return m_length; };
+		void		logStatistics();
+	private:
+		void		release();
+		bool		reserve(size_t size);
+		Logger		*m_log;
+		Algorithm	m_algorithm;
+		const char	*m_name;
+		int		m_level;
+		z_stream	m_zstream;
+		bool		m_zinit;
+#ifdef HAVE_ZSTD
+		ZSTD_CCtx	*m_zstd;
+#endif
+		char		*m_buffer;
+		size_t		m_size;
+		size_t		m_length;
+		unsigned long	m_messages;
+		unsigned long	m_bytesIn;
+		unsigned long	m_bytesOut;
+		double		m_cpuTime;
+};
+#endif
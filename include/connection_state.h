@@ -0,0 +1,58 @@
+#ifndef _CONNECTION_STATE_H
+#define _CONNECTION_STATE_H
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <logger.h>
+
+/**
+ * Track the state of the connection to the broker and decide when the
+ * next connection attempt may be made.
+ *
+ * After a failed attempt the next attempt is delayed by an exponential
+ * backoff, with a random jitter so that many gateways that lose their
+ * connection together do not reconnect in step. The caller never sleeps
+ * for longer than the connect budget waiting for an attempt to become
+ * due; if it is not due within the budget the caller gives up at once and
+ * tries again on a later call.
+ *
+ * The loss of the connection may be reported on the thread of the MQTT
+ * library, so all access is protected by a mutex.
+ */
+class ConnectionState {
+	public:
+		typedef std::chrono::steady_clock Clock;
+		ConnectionState();
+		/**
+		 * Set the maximum time in milliseconds a caller waits to connect
+		 */
+		void		setBudget(unsigned long budget) { m_budget = budget; };
+		/**
+		 * Return the maximum time in milliseconds a caller waits to connect
+		 */
+		unsigned long	budget() const { return m_budget; };
+		unsigned long	untilAttempt();
+		void		lost();
+		void		failed();
+		void		connected(double handshake);
+		void		logStatistics();
+	private:
+		Logger		*m_log;
+		std::mutex	m_mutex;
+		std::minstd_rand
+				m_random;
+		unsigned long	m_budget;
+		unsigned long	m_backoff;
+		Clock::time_point
+				m_nextAttempt;
+		bool		m_down;
+		Clock::time_point
+				m_downSince;
+		unsigned int	m_attempts;
+		unsigned long	m_reconnects;
+		unsigned long	m_failures;
+		double		m_downTime;
+		double		m_handshakeTotal;
+		double		m_handshakeMax;
+};
+#endif
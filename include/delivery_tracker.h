@@ -0,0 +1,65 @@
+#ifndef _DELIVERY_TRACKER_H
+#define _DELIVERY_TRACKER_H
+#include <vector>
+#include <set>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * Track the delivery of the messages published for a block of readings.
+ *
+ * Each message covers a contiguous range of the block and is identified by
+ * the delivery token returned when it was published. The MQTT library
+ * reports the delivery of a message on its own thread, so all access is
+ * protected by a mutex. The number of readings delivered is the end of the
+ * longest run of acknowledged messages from the start of the block, so that
+ * Fledge only moves forward over readings that have been delivered.
+ *
+ * Control messages, such as the attachment of a device to a gateway, are
+ * also tracked so that their acknowledgements are not mistaken for those
+ * of later messages. They carry no readings and are waited for on their
+ * own.
+ *
+ * When a range of the block is sent as several messages, one per asset,
+ * only the last message of the range carries the end of the range. The
+ * others carry the end of the previous range, so that the range is only
+ * counted once all of its messages are delivered.
+ */
+class DeliveryTracker {
+	public:
+		DeliveryTracker();
+		void		reset();
+		void		sent(int token, size_t end);
+		void		control(int token);
+		bool		waitControl(int token, unsigned long timeout);
+		void		delivered(int token);
+		size_t		wait(unsigned long timeout);
+		size_t		acknowledged();
+		unsigned int	outstanding();
+		/**
+		 * Return the number of messages acknowledged since creation
+		 */
+		unsigned long	deliveries() const { return m_deliveries; };
+	private:
+		class Message {
+			public:
+				Message(int token, size_t end, bool control) :
+					m_token(token), m_end(end), m_acked(false),
+					m_control(control) {};
+				int	m_token;
+				size_t	m_end;
+				bool	m_acked;
+				bool	m_control;
+		};
+		size_t		prefix();
+		bool		controlDelivered(int token) const;
+		std::mutex	m_mutex;
+		std::condition_variable
+				m_cv;
+		std::vector<Message>
+				m_messages;
+		std::set<int>	m_early;
+		unsigned int	m_outstanding;
+		unsigned long	m_deliveries;
+};
+#endif
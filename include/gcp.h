@@ -4,55 +4,167 @@
 #include <config_category.h>
 #include <logger.h>
 #include <string>
-#include "MQTTClient.h"
+#include <mqtt_transport.h>
 #include <jwt.h>
-#include <set>
+#include <vector>
+#include <message_builder.h>
+#include <delivery_tracker.h>
+#include <compressor.h>
+#include <token_manager.h>
+#include <connection_state.h>
+#include <instrumentation.h>
+#include <batcher.h>
+#include <rate_limiter.h>
+#include <trust_store.h>
+#include <spool.h>
+#include <worker_pool.h>
+#include <message_queue.h>
+#include <deque>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 
-class GCP {
+class GCP : public TransportListener {
 	public:
 		GCP();
 		~GCP();
 		void		configure(const ConfigCategory *conf);
+		void		configure(const ConfigCategory *conf,
+					const std::string& deviceID, const std::string& key);
 		uint32_t	send(const std::vector<Reading *>& readings);
-		void		msgArrived(char *topic, MQTTClient_message *msg);
+		void		msgArrived(const char *topic, const char *payload, int length);
 		void		lostConnection(const char *reason);
-		void		delivered(MQTTClient_deliveryToken dt);
+		void		delivered(int token);
 		int		connect();
+		void		start();
+		void		cancel();
+		unsigned long	bytesPublished() const;
 	private:
-		int		publish(char *payload, const int payload_size);
-		int		publish(const std::string& topic, char *payload, const int payload_size);
-		void		mapAssetName(std::string& name);
+		/**
+		 * The state of a connection attempt made on the attempt thread
+		 */
+		enum AttemptState { AttemptIdle, AttemptRequested, AttemptRunning, AttemptDone };
+		int		publish(const char *payload, const int payload_size);
+		int		publish(const std::string& topic, const char *payload, const int payload_size);
 		void		disconnect();
 		void		createSubscriptions();
-		std::string	makePayload(Reading *reading);
-		void		createJWT();
-		void		getIatExp(char* iat, char* exp, int time_size);
+		uint32_t	sendBlock(const std::vector<Reading *>& readings);
+		uint32_t	batchBlock(const std::vector<Reading *>& readings);
+		bool		publishMessage(const std::string& topic, const char *payload,
+					size_t length, size_t end);
+		const std::string&
+				encodeMessage(const char **payload, size_t *length);
+		int		attachDevice(const std::string& topic);
+		bool		nextMessage();
+		void		reportStatistics();
+		void		startPipeline(unsigned int queueSize);
+		void		stopPipeline();
+		bool		hasReadingIds(const std::vector<Reading *>& readings);
+		uint32_t	queueBlock(const std::vector<Reading *>& readings);
+		void		ioThread();
+		void		connectThread();
+		void		attemptThread();
+		void		stopAttempts();
+		void		checkToken();
+		void		clearShards();
+		unsigned int	shardOf(const std::string& assetName) const;
+		int		connectShards();
+		uint32_t	sendShards(const std::vector<Reading *>& readings);
+		uint32_t	spoolBlock(const std::vector<Reading *>& readings);
+		bool		drainSpool();
+		std::string	getSpoolPath();
+		std::string	getCertificatePath();
 		jwt_alg_t	getAlgorithm();
 		std::string	getRootPath();
 		std::string	getKeyPath();
-		MQTTClient	m_client;
-		static const std::string
-				m_address;
+		MQTTTransport	*m_transport;
+		std::string	m_address;
+		bool		m_tls;
+		std::string	m_rootCA;
 		std::string	m_projectID;
 		std::string	m_region;
 		std::string	m_registryID;
 		std::string	m_deviceID;
 		std::string	m_clientID;
 		std::string	m_topic;
+		std::string	m_compressedTopic;
+		std::string	m_eventsFolder;
+		std::string	m_compressedFolder;
+		bool		m_gateway;
+		std::string	m_deviceTopic;
+		std::string	m_attachDevice;
+		std::unordered_set<std::string>
+				m_attached;
 		std::string	m_algorithm;
 		std::string	m_key;
 		std::string	m_keyPath;
 		std::string	m_rootPath;
+		TrustStore	m_trustStore;
+		TransportOptions
+				m_options;
 		std::string	m_authToken;
-		char		*m_jwtStr;
-		time_t		m_jwtExpire;
+		TokenManager	m_tokens;
+		ConnectionState	m_state;
+		Spool		m_spool;
+		Instrumentation	m_instrumentation;
+		bool		m_publishState;
+		std::string	m_stateTopic;
 		Logger		*m_log;
 		bool		m_subscribed;
 		bool		m_connected;
-		std::set<std::string>
-				m_asset;
+		MessageBuilder	m_builder;
+		DeliveryTracker	m_tracker;
+		Compressor	m_compressor;
+		Batcher		m_batcher;
+		RateLimiter	m_limiter;
+		unsigned int	m_maxReadings;
+		int		m_qos;
 		int		m_lastSent;
-		int		m_lastDelivered;
+		unsigned long	m_bytesPublished;
+		std::mutex	m_publishMutex;
+		bool		m_pipeline;
+		MessageQueue	*m_queue;
+		MessageQueue	*m_free;
+		std::vector<QueuedMessage *>
+				m_messages;
+		std::deque<QueuedMessage *>
+				m_backlog;
+		std::thread	*m_ioThread;
+		std::atomic<bool>
+				m_running;
+		std::mutex	m_ioMutex;
+		std::condition_variable
+				m_ioCv;
+		unsigned long	m_queuedId;
+		std::atomic<unsigned long>
+				m_confirmedId;
+		std::thread	*m_connectThread;
+		std::atomic<bool>
+				m_connecting;
+		std::atomic<bool>
+				m_cancel;
+		std::mutex	m_cancelMutex;
+		std::condition_variable
+				m_cancelCv;
+		unsigned int	m_connectTimeout;
+		std::thread	*m_attemptThread;
+		AttemptState	m_attempt;
+		int		m_attemptRc;
+		double		m_handshake;
+		bool		m_attemptStop;
+		std::vector<GCP *>
+				m_shards;
+		WorkerPool	*m_pool;
+		std::vector<std::vector<Reading *> >
+				m_shardBlocks;
+		std::vector<std::vector<size_t> >
+				m_shardPositions;
+		std::vector<uint32_t>
+				m_shardSent;
+		std::vector<unsigned long>
+				m_shardSentId;
 };
 
 #endif
@@ -0,0 +1,184 @@
+#ifndef _INSTRUMENTATION_H
+#define _INSTRUMENTATION_H
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <stdint.h>
+#include <logger.h>
+
+/**
+ * A histogram of durations in nanoseconds.
+ *
+ * The buckets are arranged as in an HDR histogram, each power of two is
+ * divided into 16 linear buckets, so that any duration is recorded with a
+ * relative error of no more than one sixteenth, in a fixed number of
+ * buckets. Recording a value is a relaxed atomic increment of its bucket,
+ * so the histogram may be updated by several threads without a lock.
+ */
+class Histogram {
+	public:
+		/**
+		 * The summary of the values recorded in an interval
+		 */
+		class Snapshot {
+			public:
+				uint64_t	m_count;
+				uint64_t	m_total;
+				uint64_t	m_p50;
+				uint64_t	m_p99;
+				uint64_t	m_max;
+		};
+		Histogram();
+		void		record(uint64_t value)
+				{
+					m_counts[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+					m_total.fetch_add(value, std::memory_order_relaxed);
+					uint64_t max = m_max.load(std::memory_order_relaxed);
+					while (value > max && !m_max.compare_exchange_weak(max, value,
+								std::memory_order_relaxed))
+						;
+				};
+		void		snapshot(Snapshot& snapshot);
+	private:
+		static const unsigned int	kSubBits = 4;
+		static const unsigned int	kSubBuckets = 1 << kSubBits;
+		static const unsigned int	kBuckets = (64 - kSubBits + 1) * kSubBuckets;
+		/**
+		 * Return the bucket that holds a value
+		 */
+		static unsigned int
+				bucket(uint64_t value)
+				{
+					if (value < kSubBuckets)
+						return value;
+					unsigned int exponent = 63 - __builtin_clzll(value);
+					return (exponent - kSubBits + 1) * kSubBuckets
+						+ ((value >> (exponent - kSubBits)) & (kSubBuckets - 1));
+				};
+		static uint64_t	highest(unsigned int bucket, uint64_t max);
+		std::atomic<uint64_t>	m_counts[kBuckets];
+		std::atomic<uint64_t>	m_total;
+		std::atomic<uint64_t>	m_max;
+};
+
+/**
+ * The instrumentation of the stages of sending readings to GCP.
+ *
+ * The time taken by each stage is recorded in a histogram, together with
+ * counts of the messages and bytes published, the greatest number of
+ * messages waiting for acknowledgement and the target size of batched
+ * messages. The statistics are reported at an interval, in the log and
+ * optionally as the state of the device, and then start again.
+ *
+ * Unless the plugin is built with GCP_INSTRUMENTATION defined the methods
+ * are empty, the timers do not read the clock and the statistics are not
+ * held, so the compiler removes the instrumentation entirely.
+ */
+class Instrumentation {
+	public:
+		typedef std::chrono::steady_clock Clock;
+		enum Stage { Serialization, Grouping, Compression, Publish,
+				Acknowledge, Reconnect, Throttle, Stages };
+		/**
+		 * Time a stage from the creation of the timer until it is
+		 * stopped or destroyed
+		 */
+		class Timer {
+			public:
+#ifdef GCP_INSTRUMENTATION
+				Timer(Instrumentation& instrumentation, Stage stage) :
+					m_instrumentation(instrumentation), m_stage(stage),
+					m_running(instrumentation.enabled())
+				{
+					if (m_running)
+						m_start = Clock::now();
+				};
+				~Timer() { stop(); };
+				void	stop()
+				{
+					if (m_running)
+					{
+						m_instrumentation.record(m_stage, Clock::now() - m_start);
+						m_running = false;
+					}
+				};
+			private:
+				Instrumentation&	m_instrumentation;
+				Stage			m_stage;
+				bool			m_running;
+				Clock::time_point	m_start;
+#else
+				Timer(Instrumentation&, Stage) {};
+				void	stop() {};
+#endif
+		};
+		Instrumentation();
+		void		setInterval(unsigned int interval);
+#ifdef GCP_INSTRUMENTATION
+		/**
+		 * Return true if statistics are being collected
+		 */
+		bool		enabled() const { return m_interval != 0; };
+		/**
+		 * Record the time taken by a stage
+		 */
+		void		record(Stage stage, Clock::duration duration)
+				{
+					m_stages[stage].record(std::chrono::duration_cast<
+						std::chrono::nanoseconds>(duration).count());
+				};
+		/**
+		 * Record the publication of a message
+		 */
+		void		published(size_t bytes)
+				{
+					m_messages.fetch_add(1, std::memory_order_relaxed);
+					m_bytes.fetch_add(bytes, std::memory_order_relaxed);
+				};
+		/**
+		 * Record the number of messages waiting for acknowledgement
+		 */
+		void		inFlight(unsigned int messages)
+				{
+					unsigned int max = m_inFlight.load(std::memory_order_relaxed);
+					while (messages > max && !m_inFlight.compare_exchange_weak(max,
+								messages, std::memory_order_relaxed))
+						;
+				};
+		/**
+		 * Record the current target size of a batched message
+		 */
+		void		batchTarget(size_t bytes)
+				{
+					m_batchTarget.store(bytes, std::memory_order_relaxed);
+				};
+		bool		due();
+		void		report(const std::string& device, std::string& state);
+#else
+		bool		enabled() const { return false; };
+		void		record(Stage, Clock::duration) {};
+		void		published(size_t) {};
+		void		inFlight(unsigned int) {};
+		void		batchTarget(size_t) {};
+		bool		due() { return false; };
+		void		report(const std::string&, std::string&) {};
+#endif
+	private:
+		Logger		*m_log;
+#ifdef GCP_INSTRUMENTATION
+		static const char	*m_stageNames[Stages];
+		unsigned int	m_interval;
+		Histogram	m_stages[Stages];
+		std::atomic<unsigned long>
+				m_messages;
+		std::atomic<unsigned long>
+				m_bytes;
+		std::atomic<unsigned int>
+				m_inFlight;
+		std::atomic<size_t>
+				m_batchTarget;
+		std::atomic<Clock::rep>
+				m_lastReport;
+#endif
+};
+#endif
@@ -0,0 +1,194 @@
+#ifndef _MESSAGE_BUILDER_H
+#define _MESSAGE_BUILDER_H
+#include <reading.h>
+#include <logger.h>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <asset_registry.h>
+#include <payload_writer.h>
+#include <reading_encoder.h>
+#include <worker_pool.h>
+
+/**
+ * Build the messages to send to GCP from a block of readings.
+ *
+ * Each message is a map with an entry per asset, the value of which is an
+ * array of the readings for that asset, encoded as JSON, CBOR or
+ * MessagePack. A block is split into several messages if it would exceed
+ * the maximum message size in bytes or readings. Each message covers a
+ * contiguous range of the block, so that when a message fails to be sent
+ * the readings in the messages before it form a prefix of the block that
+ * may be reported as sent.
+ *
+ * Each reading is serialized once, into a fragment buffer, when the block
+ * is set. Messages are then assembled from these fragments, grouped by
+ * asset, in asset name order.
+ *
+ * JSON messages may instead use a columnar layout, in which the value for
+ * each asset is an object with the timestamp of the first reading as "ts",
+ * the offsets in microseconds of each reading from that timestamp as "dt"
+ * and an array of values for each datapoint. An asset whose readings in
+ * the message do not all have the same datapoints is written as an array
+ * of readings, as is an asset with a single reading in the message.
+ *
+ * Alternatively a message may be built for each asset in a range of the
+ * block, for sending each asset as a separate device.
+ *
+ * Large blocks may be serialized on several threads. The block is divided
+ * into contiguous segments, each serialized into a buffer of its own, and
+ * the buffers are then joined in block order to form the same fragments
+ * as if the block had been serialized on a single thread.
+ */
+class MessageBuilder {
+	public:
+		MessageBuilder();
+		~MessageBuilder();
+		void		setFormat(const std::string& format);
+		void		setLayout(const std::string& layout);
+		void		setPerAsset(bool perAsset);
+		void		setTimestampFormat(const std::string& format);
+		void		setParallel(unsigned int threads, size_t threshold);
+		/**
+		 * Return the name of the message encoding, NULL for JSON
+		 */
+		const char	*encoding() const
+				{
+					return m_columnar ? "columnar" : m_encoder->name();
+				};
+		void		setLimits(size_t maxBytes, unsigned int maxReadings);
+		void		setAssetCache(unsigned int maxEntries, unsigned int ttl)
+				{
+					m_assets.setLimits(maxEntries, ttl);
+				};
+		void		setBlock(const std::vector<Reading *>& readings,
+					size_t start = 0);
+		bool		next();
+		/**
+		 * Return the payload of the current message
+		 */
+		const char	*data() const { return m_payload.data(); };
+		/**
+		 * Return the length of the current message
+		 */
+		size_t		length() const { return m_payload.length(); };
+		/**
+		 * Return the number of readings in the current message
+		 */
+		unsigned int	readings() const { return m_count; };
+		/**
+		 * Return the mapped name of the asset of the current
+		 * message, when there is a message per asset
+		 */
+		const std::string&
+				asset() const
+				{
+					return m_assets.blockAssetName(m_groupOrder[m_group - 1]);
+				};
+		/**
+		 * Return true if the current message is the last of the
+		 * messages for its range of the block
+		 */
+		bool		rangeComplete() const { return m_group == m_groupOrder.size(); };
+		/**
+		 * Return the index in the block after the last reading
+		 * of the current message
+		 */
+		size_t		end() const { return m_base + m_end; };
+		/**
+		 * Return the size of the serialized readings of the block
+		 */
+		size_t		blockBytes() const { return m_fragments.length(); };
+		static void	mapAssetName(std::string& name);
+	private:
+		/**
+		 * The serialized readings of a segment of the block
+		 */
+		class Segment {
+			public:
+				Segment() : m_out(16 * 1024) {};
+				PayloadWriter	m_out;
+				std::vector<size_t>
+						m_offsets;
+				std::vector<size_t>
+						m_spans;
+				std::vector<size_t>
+						m_spanIndex;
+				std::vector<uint64_t>
+						m_signatures;
+				std::vector<long long>
+						m_times;
+		};
+		void		encodeReading(Reading *reading, PayloadWriter& out,
+					std::vector<size_t>& spans,
+					std::vector<size_t>& spanIndex,
+					std::vector<uint64_t>& signatures,
+					std::vector<long long>& times);
+		void		encodeParallel(const std::vector<Reading *>& readings,
+					size_t start);
+		void		clearSegments();
+		size_t		fragmentLength(size_t index) const
+				{
+					return m_offsets[index + 1] - m_offsets[index];
+				};
+		void		groupReadings(size_t start, size_t end);
+		void		assemble(size_t first, size_t last);
+		bool		sameDatapoints(const std::vector<unsigned int>& group) const;
+		void		appendColumns(const std::vector<unsigned int>& group);
+		/**
+		 * Return the offset in the fragment buffer of a part of
+		 * a reading recorded for the columnar layout
+		 */
+		size_t		span(size_t index, size_t part) const
+				{
+					return m_spans[m_spanIndex[index] + part];
+				};
+		/**
+		 * Return the number of datapoints in a reading recorded
+		 * for the columnar layout
+		 */
+		size_t		datapoints(size_t index) const
+				{
+					return (m_spanIndex[index + 1] - m_spanIndex[index] - 2) / 3;
+				};
+		Logger		*m_log;
+		ReadingEncoder	*m_encoder;
+		size_t		m_maxBytes;
+		unsigned int	m_maxReadings;
+		bool		m_columnar;
+		bool		m_perAsset;
+		AssetRegistry	m_assets;
+		PayloadWriter	m_fragments;
+		std::vector<size_t>
+				m_offsets;
+		std::vector<unsigned int>
+				m_slots;
+		std::vector<size_t>
+				m_spans;
+		std::vector<size_t>
+				m_spanIndex;
+		std::vector<uint64_t>
+				m_signatures;
+		std::vector<long long>
+				m_times;
+		std::vector<std::vector<unsigned int> >
+				m_groups;
+		std::vector<unsigned int>
+				m_groupOrder;
+		size_t		m_group;
+		std::vector<unsigned long>
+				m_chunk;
+		unsigned long	m_chunkNo;
+		PayloadWriter	m_payload;
+		WorkerPool	*m_pool;
+		size_t		m_threshold;
+		std::vector<Segment *>
+				m_segments;
+		std::vector<std::function<void()> >
+				m_tasks;
+		size_t		m_base;
+		size_t		m_blockSize;
+		size_t		m_end;
+		unsigned int	m_count;
+};
+#endif
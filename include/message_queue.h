@@ -0,0 +1,43 @@
+#ifndef _MESSAGE_QUEUE_H
+#define _MESSAGE_QUEUE_H
+#include <atomic>
+#include <vector>
+#include <string>
+#include <payload_writer.h>
+
+/**
+ * A serialized message waiting to be sent by the I/O thread
+ */
+class QueuedMessage {
+	public:
+		QueuedMessage() : m_payload(4096), m_readings(0), m_lastId(0) {};
+		PayloadWriter	m_payload;
+		std::string	m_topic;
+		unsigned int	m_readings;
+		unsigned long	m_lastId;
+};
+
+/**
+ * A lock-free bounded queue of messages with a single producer and a
+ * single consumer. The producer and consumer each own one of the indexes,
+ * the other thread only reads it, so no locking is required.
+ */
+class MessageQueue {
+	public:
+		MessageQueue(size_t capacity);
+		bool		push(QueuedMessage *message);
+		QueuedMessage	*pop();
+		bool		empty() const;
+		size_t		size() const;
+	private:
+		std::vector<QueuedMessage *>
+				m_ring;
+		size_t		m_capacity;
+		char		m_pad1[64];	// Keep the indexes on separate cache lines
+		std::atomic<size_t>
+				m_head;		// Next to pop, written by the consumer
+		char		m_pad2[64];
+		std::atomic<size_t>
+				m_tail;		// Next to push, written by the producer
+};
+#endif
@@ -0,0 +1,83 @@
+#ifndef _MQTT_TRANSPORT_H
+#define _MQTT_TRANSPORT_H
+#include <string>
+
+/**
+ * The return codes of the transport calls. These share the values of the
+ * MQTTClient and MQTTAsync return codes of the Paho library.
+ */
+#define TRANSPORT_SUCCESS	0
+#define TRANSPORT_FAILURE	-1
+#define TRANSPORT_DISCONNECTED	-3
+
+/**
+ * The interface used by an MQTT transport to report events to its owner
+ */
+class TransportListener {
+	public:
+		virtual ~TransportListener() {};
+		virtual void	msgArrived(const char *topic, const char *payload, int length) = 0;
+		virtual void	lostConnection(const char *reason) = 0;
+		virtual void	delivered(int token) = 0;
+};
+
+/**
+ * The parameters used to connect a transport to the MQTT broker. The
+ * connection uses TLS if either a trust store or a directory of trusted
+ * certificates is given.
+ */
+class TransportOptions {
+	public:
+		std::string	m_address;
+		std::string	m_clientID;
+		const char	*m_username;
+		const char	*m_password;
+		const char	*m_trustStore;
+		const char	*m_caPath;
+		const char	*m_privateKey;
+		int		m_keepAlive;
+		int		m_connectTimeout;
+};
+
+/**
+ * Statistics of the message pipeline of a transport since they were
+ * last retrieved
+ */
+class TransportStatistics {
+	public:
+		unsigned int	m_maxInFlight;
+		unsigned long	m_acks;
+		unsigned long	m_failures;
+		double		m_ackLatencyAvg;
+		double		m_ackLatencyMax;
+};
+
+/**
+ * An MQTT transport, the abstraction of the Paho client API used to
+ * communicate with the broker
+ */
+class MQTTTransport {
+	public:
+		MQTTTransport(TransportListener *listener) : m_listener(listener) {};
+		virtual ~MQTTTransport() {};
+		virtual int	connect(const TransportOptions& options) = 0;
+		/**
+		 * Disconnect from the broker. The client is kept so that
+		 * it may be connected again.
+		 */
+		virtual void	disconnect() = 0;
+		virtual int	subscribe(const std::string& topic, int qos) = 0;
+		virtual int	publish(const std::string& topic, const char *payload,
+					int length, int qos, int *token) = 0;
+		virtual int	waitForCompletion(unsigned long timeout) = 0;
+		/**
+		 * Retrieve and reset the pipeline statistics of the transport
+		 *
+		 * @return	False if the transport does not record statistics
+		 */
+		virtual bool	getStatistics(TransportStatistics& stats) { return false; };
+	protected:
+		TransportListener
+				*m_listener;
+};
+#endif
@@ -0,0 +1,72 @@
+#ifndef _PAYLOAD_WRITER_H
+#define _PAYLOAD_WRITER_H
+#include <reading.h>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <timestamp_encoder.h>
+
+/**
+ * A streaming writer for the JSON payloads sent to GCP. The payload is
+ * written directly into a single output buffer that is owned by the
+ * writer and reused for each block, so once the buffer has grown to the
+ * size of a typical block no further heap allocation is required.
+ *
+ * The buffer is always kept null terminated.
+ */
+class PayloadWriter {
+	public:
+		PayloadWriter(size_t initialSize = 64 * 1024);
+		~PayloadWriter();
+		/**
+		 * Empty the buffer, retaining the allocated memory
+		 */
+		void		clear() { m_length = 0; m_buffer[0] = 0; };
+		void		reserve(size_t size);
+		/**
+		 * Append raw characters to the buffer
+		 */
+		void		append(const char *str, size_t len)
+				{
+					if (m_length + len >= m_size)
+						reserve(m_length + len + 1);
+					memcpy(m_buffer + m_length, str, len);
+					m_length += len;
+					m_buffer[m_length] = 0;
+				};
+		void		append(const char *str) { append(str, strlen(str)); };
+		void		append(const std::string& str) { append(str.data(), str.length()); };
+		void		append(char ch)
+				{
+					if (m_length + 1 >= m_size)
+						reserve(m_length + 2);
+					m_buffer[m_length++] = ch;
+					m_buffer[m_length] = 0;
+				};
+		void		appendReading(Reading *reading,
+					std::vector<size_t> *spans = NULL);
+		void		appendDatapoint(Datapoint *datapoint);
+		/**
+		 * Return the encoder of the reading timestamps
+		 */
+		TimestampEncoder&
+				timestamps() { return m_timestamps; };
+		/**
+		 * Return the start of the payload
+		 */
+		char		*data() const { return m_buffer; };
+		/**
+		 * Return the length of the payload
+		 */
+		size_t		length() const { return m_length; };
+	private:
+		void		appendValue(DatapointValue& value);
+		void		appendDouble(double value);
+		void		appendString(const std::string& str);
+		char		*m_buffer;
+		size_t		m_size;
+		size_t		m_length;
+		TimestampEncoder
+				m_timestamps;
+};
+#endif
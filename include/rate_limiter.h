@@ -0,0 +1,84 @@
+#ifndef _RATE_LIMITER_H
+#define _RATE_LIMITER_H
+#include <chrono>
+#include <mutex>
+#include <logger.h>
+
+/**
+ * Pace the publication of messages to stay within the telemetry quotas of
+ * the broker, in messages per second and bytes per second.
+ *
+ * Each quota is a token bucket that holds at most one second of tokens. A
+ * message may be published once the buckets hold a token for it, or for
+ * the bytes of a message larger than a second of the byte quota, and then
+ * takes its tokens, which may leave the byte bucket in debt. The publisher
+ * sleeps until the message may be published.
+ *
+ * When the broker reports an error the rates are halved, down to a
+ * sixteenth of the quota, and then recover steadily once no error has been
+ * reported for a while. If no quota is configured the rate measured when
+ * the error arrives is used as the quota until the rates have recovered.
+ *
+ * Errors are reported on the thread of the MQTT library, so all access is
+ * protected by a mutex.
+ */
+class RateLimiter {
+	public:
+		typedef std::chrono::steady_clock Clock;
+		enum Limit { None, Bytes, Messages };
+		RateLimiter();
+		void		configure(double messages, double bytes);
+		Clock::duration	acquire(size_t bytes);
+		void		backoff();
+		Limit		limited();
+		void		logStatistics();
+	private:
+		/**
+		 * A token bucket holding at most one second of tokens
+		 */
+		class Bucket {
+			public:
+				Bucket() : m_rate(0), m_tokens(0) {};
+				void	setRate(double rate)
+					{
+						m_rate = rate;
+						m_tokens = rate;
+					};
+				/**
+				 * Return true if the bucket limits the rate
+				 */
+				bool	limited() const { return m_rate > 0; };
+				void	refill(double seconds, double scale);
+				double	delay(double cost, double scale) const;
+				/**
+				 * Take the tokens for a message
+				 */
+				void	take(double cost) { m_tokens -= cost; };
+				double	m_rate;
+				double	m_tokens;
+		};
+		void		update(Clock::time_point now);
+		Logger		*m_log;
+		std::mutex	m_mutex;
+		double		m_messageRate;
+		double		m_byteRate;
+		Bucket		m_messages;
+		Bucket		m_bytes;
+		double		m_scale;
+		bool		m_temporary;
+		Limit		m_limited;
+		Clock::time_point
+				m_lastUpdate;
+		Clock::time_point
+				m_lastError;
+		Clock::time_point
+				m_windowStart;
+		unsigned long	m_windowMessages;
+		unsigned long	m_windowBytes;
+		double		m_observedMessages;
+		double		m_observedBytes;
+		unsigned long	m_errors;
+		unsigned long	m_throttled;
+		double		m_waitTime;
+};
+#endif
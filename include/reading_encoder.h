@@ -0,0 +1,80 @@
+#ifndef _READING_ENCODER_H
+#define _READING_ENCODER_H
+#include <reading.h>
+#include <string>
+#include <payload_writer.h>
+
+/**
+ * The encoding of the messages sent to GCP.
+ *
+ * A message is a map from asset name to an array of the readings of that
+ * asset. Each reading is encoded once, as a fragment, and the messages are
+ * assembled from these fragments. The encoder also provides the number of
+ * bytes the message structure adds, so that the size of a message can be
+ * calculated before it is assembled.
+ */
+class ReadingEncoder {
+	public:
+		virtual ~ReadingEncoder() {};
+		/**
+		 * Return the name of the encoding used as the topic subfolder,
+		 * or NULL for the default JSON encoding
+		 */
+		virtual const char	*name() const = 0;
+		virtual void	appendReading(PayloadWriter& out, Reading *reading) = 0;
+		virtual void	startMessage(PayloadWriter& out, unsigned int assets) = 0;
+		virtual void	startAsset(PayloadWriter& out, const std::string& name,
+					unsigned int readings, bool first) = 0;
+		virtual void	nextReading(PayloadWriter& out) = 0;
+		virtual void	endAsset(PayloadWriter& out) = 0;
+		virtual void	endMessage(PayloadWriter& out) = 0;
+		/**
+		 * The maximum number of bytes added around the whole message
+		 */
+		virtual size_t	messageOverhead() const = 0;
+		/**
+		 * The maximum number of bytes added around the readings of an asset,
+		 * other than the first asset in a message
+		 */
+		virtual size_t	assetOverhead(size_t nameLength) const = 0;
+		/**
+		 * The number of bytes added between two readings of an asset
+		 */
+		virtual size_t	readingSeparator() const = 0;
+};
+
+/**
+ * The JSON encoding of messages
+ */
+class JSONEncoder : public ReadingEncoder {
+	public:
+		const char	*name() const { return NULL; };
+		void		appendReading(PayloadWriter& out, Reading *reading)
+				{
+					out.appendReading(reading);
+				};
+		void		startMessage(PayloadWriter& out, unsigned int assets)
+				{
+					out.append('{');
+				};
+		void		startAsset(PayloadWriter& out, const std::string& name,
+					unsigned int readings, bool first)
+				{
+					if (!first)
+						out.append(',');
+					out.append('"');
+					out.append(name);
+					out.append("\" : [ ", 5);
+				};
+		void		nextReading(PayloadWriter& out) { out.append(','); };
+		void		endAsset(PayloadWriter& out) { out.append(']'); };
+		void		endMessage(PayloadWriter& out) { out.append('}'); };
+		size_t		messageOverhead() const { return 2; };
+		size_t		assetOverhead(size_t nameLength) const
+				{
+					// ,"name" : [ ]
+					return nameLength + 9;
+				};
+		size_t		readingSeparator() const { return 1; };
+};
+#endif
@@ -0,0 +1,116 @@
+#ifndef _SPOOL_H
+#define _SPOOL_H
+#include <string>
+#include <stdint.h>
+#include <logger.h>
+
+/**
+ * A disk backed store of messages that could not be sent to GCP.
+ *
+ * The spool is a ring of records in a memory mapped file. Each record holds
+ * the topic and payload of a message exactly as it would have been
+ * published, so messages are serialized and compressed once and are
+ * published again without any further work when the connection returns.
+ *
+ * The file starts with a header page holding the positions of the oldest
+ * and newest records. Appended and consumed records only become durable
+ * when commit is called, which writes the records to disk before the
+ * header, so a crash leaves the spool as it was at the last commit. Each
+ * record carries a CRC so that a damaged spool is detected and discarded
+ * rather than published.
+ *
+ * When the spool is full the oldest messages are either dropped to make
+ * space for the new message, or the new message is refused. Dropping is
+ * committed before the space is reused, so the header never refers to a
+ * record that has been overwritten.
+ */
+class Spool {
+	public:
+		enum Policy { DropOldest, Refuse };
+		/**
+		 * A position within the spool used to read the records
+		 * without consuming them
+		 */
+		class Cursor {
+			public:
+				uint64_t	m_offset;
+				uint64_t	m_index;
+		};
+		Spool();
+		~Spool();
+		bool		open(const std::string& path, size_t size, Policy policy);
+		void		close();
+		/**
+		 * Return true if the spool is in use
+		 */
+		bool		isOpen() const { return m_base != NULL; };
+		/**
+		 * Return true if the spool holds no messages
+		 */
+		bool		empty() const { return m_records == 0; };
+		/**
+		 * Return the number of messages in the spool
+		 */
+		uint64_t	records() const { return m_records; };
+		bool		append(const std::string& topic, const char *payload, size_t length);
+		Cursor		begin() const;
+		bool		read(Cursor& cursor, std::string& topic, const char **payload,
+					size_t *length);
+		void		consume(uint64_t count);
+		void		commit();
+		void		drained(unsigned long messages, unsigned long bytes, double seconds);
+		void		logStatistics();
+	private:
+		/**
+		 * The header page at the start of the file
+		 */
+		class Header {
+			public:
+				uint32_t	m_magic;
+				uint32_t	m_version;
+				uint64_t	m_size;
+				uint64_t	m_head;
+				uint64_t	m_tail;
+				uint64_t	m_records;
+				uint64_t	m_dropped;
+		};
+		/**
+		 * The header of each record in the ring
+		 */
+		class Record {
+			public:
+				uint32_t	m_magic;
+				uint32_t	m_crc;
+				uint32_t	m_length;
+				uint16_t	m_topicLength;
+				uint16_t	m_flags;
+		};
+		bool		reserve(size_t need, uint64_t *offset);
+		uint64_t	recordOffset(uint64_t offset) const;
+		Record		*record(uint64_t offset) const
+				{
+					return (Record *)(m_data + offset);
+				};
+		void		reset();
+		uint64_t	depth() const;
+		Logger		*m_log;
+		std::string	m_path;
+		Policy		m_policy;
+		int		m_fd;
+		char		*m_base;
+		size_t		m_mapped;
+		char		*m_data;
+		uint64_t	m_size;
+		uint64_t	m_head;
+		uint64_t	m_tail;
+		uint64_t	m_records;
+		uint64_t	m_dropped;
+		uint64_t	m_droppedLogged;
+		bool		m_dirty;
+		unsigned long	m_appended;
+		unsigned long	m_refused;
+		unsigned long	m_drainedMessages;
+		unsigned long	m_drainedBytes;
+		double		m_drainTime;
+};
+#endif
@@ -0,0 +1,30 @@
+#ifndef _SYNC_TRANSPORT_H
+#define _SYNC_TRANSPORT_H
+#include <mqtt_transport.h>
+#include <logger.h>
+#include "MQTTClient.h"
+
+/**
+ * An MQTT transport that uses the synchronous MQTTClient API
+ */
+class SyncTransport : public MQTTTransport {
+	public:
+		SyncTransport(TransportListener *listener);
+		~SyncTransport();
+		int		connect(const TransportOptions& options);
+		void		disconnect();
+		int		subscribe(const std::string& topic, int qos);
+		int		publish(const std::string& topic, const char *payload,
+					int length, int qos, int *token);
+		int		waitForCompletion(unsigned long timeout);
+		void		msgArrived(char *topic, MQTTClient_message *msg);
+		void		lostConnection(const char *reason);
+		void		delivered(MQTTClient_deliveryToken dt);
+	private:
+		Logger		*m_log;
+		MQTTClient	m_client;
+		bool		m_created;
+		MQTTClient_deliveryToken
+				m_lastToken;
+};
+#endif
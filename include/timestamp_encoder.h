@@ -0,0 +1,50 @@
+#ifndef _TIMESTAMP_ENCODER_H
+#define _TIMESTAMP_ENCODER_H
+#include <reading.h>
+#include <sys/time.h>
+
+/**
+ * Format the user timestamps of readings.
+ *
+ * By default the timestamp is the date and time string of the reading,
+ * exactly as returned by getAssetDateUserTime. Readings taken at a high
+ * rate share the same second, so the string is created once for each
+ * second and only the microsecond digits are written for the readings
+ * that follow in the same second. If the string created by the reading
+ * does not end the seconds with the microseconds as expected the string
+ * is created for every reading.
+ *
+ * Alternatively the timestamp may be given as the number of microseconds
+ * since the epoch.
+ */
+class TimestampEncoder {
+	public:
+		enum Format { Date, EpochMicros };
+		TimestampEncoder();
+		void		setFormat(Format format) { m_format = format; };
+		/**
+		 * Return the format of the timestamps
+		 */
+		Format		format() const { return m_format; };
+		const char	*date(Reading *reading, size_t *length);
+		/**
+		 * Return the user timestamp of a reading in microseconds
+		 * since the epoch
+		 */
+		static long long
+				micros(Reading *reading)
+				{
+					struct timeval tv;
+					reading->getUserTimestamp(&tv);
+					return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+				};
+	private:
+		void		refill(Reading *reading, const struct timeval& tv);
+		Format		m_format;
+		time_t		m_second;
+		bool		m_cached;
+		char		m_buffer[64];
+		size_t		m_length;
+		size_t		m_digits;
+};
+#endif
@@ -0,0 +1,61 @@
+#ifndef _TOKEN_MANAGER_H
+#define _TOKEN_MANAGER_H
+#include <string>
+#include <time.h>
+#include <jwt.h>
+#include <logger.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * Manage the JSON Web Token used as the password of the MQTT connection.
+ *
+ * The private key is read once and only read again if the modification
+ * time of the key file changes. A background thread signs the next token
+ * ahead of the rotation time of the current token, so that connecting
+ * never waits for a token to be signed. Once the current token is due for
+ * rotation, or the key has changed, the caller is expected to reconnect
+ * at a quiet moment to present the new token, rather than wait for the
+ * broker to drop the connection when the token expires.
+ */
+class TokenManager {
+	public:
+		TokenManager();
+		~TokenManager();
+		void		configure(const std::string& audience, const std::string& keyPath,
+					jwt_alg_t algorithm);
+		const char	*token();
+		bool		rotationDue();
+		void		logStatistics();
+	private:
+		bool		keyChanged();
+		bool		loadKey();
+		char		*sign(const std::string& key, time_t issued);
+		void		start();
+		void		stop();
+		void		refreshThread();
+		Logger		*m_log;
+		std::string	m_audience;
+		std::string	m_keyPath;
+		jwt_alg_t	m_algorithm;
+		std::string	m_key;
+		struct timespec	m_keyTime;
+		bool		m_keyLoaded;
+		char		*m_current;
+		time_t		m_issued;
+		bool		m_stale;
+		char		*m_next;
+		time_t		m_nextIssued;
+		std::thread	*m_thread;
+		bool		m_running;
+		std::mutex	m_mutex;
+		std::condition_variable
+				m_cv;
+		unsigned long	m_refreshes;
+		unsigned long	m_keyLoads;
+		unsigned long	m_signs;
+		double		m_signTime;
+		double		m_signTimeMax;
+};
+#endif
@@ -0,0 +1,33 @@
+#ifndef _TRUST_STORE_H
+#define _TRUST_STORE_H
+#include <string>
+#include <logger.h>
+
+/**
+ * The root certificates used to verify the broker, as a directory of
+ * certificates named by the hash of their subject.
+ *
+ * A root certificate bundle such as the Google roots holds well over a
+ * hundred certificates, all of which OpenSSL parses on every connection
+ * when it is given the bundle as the trust store. Given a hashed directory
+ * instead, OpenSSL only loads the certificates that are needed to verify
+ * the chain the broker presents. The directory is built once from the
+ * bundle when the plugin is configured and replaces any previous contents,
+ * so certificates removed from the bundle are no longer trusted.
+ */
+class TrustStore {
+	public:
+		TrustStore();
+		bool		build(const std::string& bundle, const std::string& directory);
+		/**
+		 * Return the directory of certificates, empty if it
+		 * could not be built
+		 */
+		const std::string&
+				directory() const { return m_directory; };
+	private:
+		bool		clear(const std::string& directory);
+		Logger		*m_log;
+		std::string	m_directory;
+};
+#endif
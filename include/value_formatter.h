@@ -0,0 +1,26 @@
+#ifndef _VALUE_FORMATTER_H
+#define _VALUE_FORMATTER_H
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Format datapoint values as JSON text directly into a buffer.
+ *
+ * The text is identical to that created by DatapointValue, so that the
+ * payloads do not change, but is created without the general purpose
+ * printf and stream formatting and without temporary strings.
+ */
+class ValueFormatter {
+	public:
+		/**
+		 * The space a formatted number may need in the buffer
+		 */
+		static const size_t	kMaxNumber = 32;
+		static size_t	integer(char *buf, long value);
+		static int	fixed(char *buf, double value);
+		static int	general(char *buf, double value);
+		static size_t	escapeIndex(const char *str, size_t length);
+	private:
+		static size_t	digits(char *buf, uint64_t value);
+};
+#endif
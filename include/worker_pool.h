@@ -0,0 +1,41 @@
+#ifndef _WORKER_POOL_H
+#define _WORKER_POOL_H
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * A fixed pool of threads that runs a set of tasks in parallel.
+ *
+ * The calling thread takes part in running the tasks and the call returns
+ * once all of the tasks have completed, so a pool of n threads runs up to
+ * n + 1 tasks at once.
+ */
+class WorkerPool {
+	public:
+		WorkerPool(unsigned int threads);
+		~WorkerPool();
+		void		run(const std::vector<std::function<void()> >& tasks);
+		/**
+		 * Return the number of threads in the pool
+		 */
+		unsigned int	size() const { return m_threads.size(); };
+	private:
+		bool		runNext(std::unique_lock<std::mutex>& lck);
+		void		worker();
+		std::vector<std::thread>
+				m_threads;
+		std::mutex	m_mutex;
+		std::condition_variable
+				m_work;
+		std::condition_variable
+				m_done;
+		const std::vector<std::function<void()> >
+				*m_tasks;
+		size_t		m_next;
+		size_t		m_remaining;
+		bool		m_running;
+};
+#endif
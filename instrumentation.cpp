@@ -0,0 +1,206 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <instrumentation.h>
+#include <stdio.h>
+
+using namespace std;
+
+#ifdef GCP_INSTRUMENTATION
+const char *Instrumentation::m_stageNames[Stages] = {
+	"serialization", "grouping", "compression", "publish", "acknowledge", "reconnect",
+	"throttle"
+};
+#endif
+
+/**
+ * Constructor for a histogram
+ */
+Histogram::Histogram() : m_total(0), m_max(0)
+{
+	for (unsigned int i = 0; i < kBuckets; i++)
+	{
+		m_counts[i].store(0, memory_order_relaxed);
+	}
+}
+
+/**
+ * Return the highest value held by a bucket, limited to the largest value
+ * recorded
+ *
+ * @param bucket	The bucket
+ * @param max		The largest value recorded
+ * @return		The highest value of the bucket
+ */
+uint64_t Histogram::highest(unsigned int bucket, uint64_t max)
+{
+	uint64_t high;
+
+	if (bucket + 1 < kSubBuckets)
+	{
+		high = bucket;
+	}
+	else if (bucket + 1 >= kBuckets)
+	{
+		high = max;
+	}
+	else
+	{
+		unsigned int next = bucket + 1;
+		unsigned int exponent = next / kSubBuckets + kSubBits - 1;
+		high = ((uint64_t)(kSubBuckets + next % kSubBuckets) << (exponent - kSubBits)) - 1;
+	}
+	return high < max ? high : max;
+}
+
+/**
+ * Summarise the values recorded since the last snapshot and empty the
+ * histogram. Values recorded whilst the snapshot is taken are included
+ * in either this snapshot or the next.
+ *
+ * @param snapshot	The snapshot to populate
+ */
+void Histogram::snapshot(Snapshot& snapshot)
+{
+uint64_t	counts[kBuckets];
+uint64_t	count = 0;
+
+	for (unsigned int i = 0; i < kBuckets; i++)
+	{
+		counts[i] = m_counts[i].exchange(0, memory_order_relaxed);
+		count += counts[i];
+	}
+	snapshot.m_count = count;
+	snapshot.m_total = m_total.exchange(0, memory_order_relaxed);
+	snapshot.m_max = m_max.exchange(0, memory_order_relaxed);
+	snapshot.m_p50 = 0;
+	snapshot.m_p99 = 0;
+
+	uint64_t p50 = (count + 1) / 2, p99 = count - count / 100, seen = 0;
+	bool have50 = false;
+	for (unsigned int i = 0; i < kBuckets && count; i++)
+	{
+		seen += counts[i];
+		if (!have50 && seen >= p50)
+		{
+			snapshot.m_p50 = highest(i, snapshot.m_max);
+			have50 = true;
+		}
+		if (seen >= p99)
+		{
+			snapshot.m_p99 = highest(i, snapshot.m_max);
+			break;
+		}
+	}
+}
+
+/**
+ * Constructor for the instrumentation
+ */
+Instrumentation::Instrumentation()
+#ifdef GCP_INSTRUMENTATION
+	: m_interval(0), m_messages(0), m_bytes(0), m_inFlight(0), m_batchTarget(0),
+	m_lastReport(Clock::now().time_since_epoch().count())
+#endif
+{
+	m_log = Logger::getLogger();
+}
+
+/**
+ * Set the interval at which the statistics are reported
+ *
+ * @param interval	The interval in seconds, 0 to disable the statistics
+ */
+void Instrumentation::setInterval(unsigned int interval)
+{
+#ifdef GCP_INSTRUMENTATION
+	m_interval = interval;
+#else
+	if (interval)
+	{
+		m_log->warn("The plugin was built without instrumentation, no statistics will be reported");
+	}
+#endif
+}
+
+#ifdef GCP_INSTRUMENTATION
+/**
+ * Return true if the statistics are due to be reported. Only one caller
+ * is told that the report is due.
+ *
+ * @return	True if the caller should report the statistics
+ */
+bool Instrumentation::due()
+{
+	if (!m_interval)
+	{
+		return false;
+	}
+	Clock::rep now = Clock::now().time_since_epoch().count();
+	Clock::rep last = m_lastReport.load(memory_order_relaxed);
+	Clock::rep interval = chrono::duration_cast<Clock::duration>(
+			chrono::seconds(m_interval)).count();
+	if (now - last < interval)
+	{
+		return false;
+	}
+	return m_lastReport.compare_exchange_strong(last, now, memory_order_relaxed);
+}
+
+/**
+ * Log the statistics collected since the last report and start collecting
+ * again. The statistics are also returned as a JSON document that may be
+ * published as the state of the device.
+ *
+ * @param device	The device that sent the readings
+ * @param state		Populated with the statistics as JSON
+ */
+void Instrumentation::report(const string& device, string& state)
+{
+Histogram::Snapshot	snapshots[Stages];
+char			buf[256];
+
+	for (int i = 0; i < Stages; i++)
+	{
+		m_stages[i].snapshot(snapshots[i]);
+	}
+	unsigned long messages = m_messages.exchange(0, memory_order_relaxed);
+	unsigned long bytes = m_bytes.exchange(0, memory_order_relaxed);
+	unsigned int inFlight = m_inFlight.exchange(0, memory_order_relaxed);
+	unsigned long reconnects = snapshots[Reconnect].m_count;
+	unsigned long batchTarget = m_batchTarget.load(memory_order_relaxed);
+
+	m_log->info("GCP %s published %lu messages, %lu bytes, %.1f bytes per second, at most %u in flight, %lu connections in %us",
+			device.c_str(), messages, bytes, (double)bytes / m_interval,
+			inFlight, reconnects, m_interval);
+	if (batchTarget)
+	{
+		m_log->info("GCP %s batched message target size %lu bytes", device.c_str(), batchTarget);
+	}
+	snprintf(buf, sizeof(buf), "{\"interval\":%u,\"messages\":%lu,\"bytes\":%lu,\"inflight_max\":%u,\"reconnects\":%lu,\"batch_target\":%lu,\"stages\":{",
+			m_interval, messages, bytes, inFlight, reconnects, batchTarget);
+	state = buf;
+	for (int i = 0; i < Stages; i++)
+	{
+		const Histogram::Snapshot& s = snapshots[i];
+		if (s.m_count)
+		{
+			m_log->info("GCP %s %s: %lu times, average %.1fus, p50 %.1fus, p99 %.1fus, maximum %.1fus",
+					device.c_str(), m_stageNames[i], (unsigned long)s.m_count,
+					s.m_total / 1000.0 / s.m_count, s.m_p50 / 1000.0,
+					s.m_p99 / 1000.0, s.m_max / 1000.0);
+		}
+		snprintf(buf, sizeof(buf), "%s\"%s\":{\"count\":%lu,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}",
+				i ? "," : "", m_stageNames[i], (unsigned long)s.m_count,
+				s.m_p50 / 1000.0, s.m_p99 / 1000.0, s.m_max / 1000.0);
+		state += buf;
+	}
+	state += "}}";
+}
+#endif
@@ -0,0 +1,601 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <message_builder.h>
+#include <binary_encoder.h>
+#include <algorithm>
+#include <string.h>
+#include <stdio.h>
+
+using namespace std;
+
+static const unsigned int kSegmentsPerThread = 4;
+static const size_t kMinSegment = 256;		// Readings
+
+/**
+ * Constructor for the message builder
+ */
+MessageBuilder::MessageBuilder() : m_maxBytes(0), m_maxReadings(0),
+	m_columnar(false), m_perAsset(false), m_group(0), m_assets(MessageBuilder::mapAssetName), m_chunkNo(0), m_blockSize(0),
+	m_end(0), m_count(0), m_pool(NULL), m_threshold(0)
+{
+	m_log = Logger::getLogger();
+	m_encoder = new JSONEncoder();
+}
+
+/**
+ * Destructor for the message builder
+ */
+MessageBuilder::~MessageBuilder()
+{
+	delete m_encoder;
+	clearSegments();
+}
+
+/**
+ * Delete the worker pool and the buffers of the segments
+ */
+void MessageBuilder::clearSegments()
+{
+	delete m_pool;
+	m_pool = NULL;
+	for (auto it = m_segments.begin(); it != m_segments.end(); it++)
+	{
+		delete *it;
+	}
+	m_segments.clear();
+	m_tasks.clear();
+}
+
+/**
+ * Set the number of threads used to serialize large blocks
+ *
+ * @param threads	The number of threads, including the calling
+ *			thread, 1 or less to serialize on the calling thread
+ * @param threshold	The smallest block, in readings, serialized on
+ *			several threads
+ */
+void MessageBuilder::setParallel(unsigned int threads, size_t threshold)
+{
+	clearSegments();
+	m_threshold = threshold;
+	if (threads > 1)
+	{
+		m_pool = new WorkerPool(threads - 1);
+		// Several segments per thread to balance the work between threads
+		for (unsigned int i = 0; i < threads * kSegmentsPerThread; i++)
+		{
+			m_segments.push_back(new Segment());
+		}
+	}
+}
+
+/**
+ * Set the encoding of the messages
+ *
+ * @param format	The message format, JSON, CBOR or MessagePack
+ */
+void MessageBuilder::setFormat(const string& format)
+{
+	delete m_encoder;
+	if (format.compare("CBOR") == 0)
+	{
+		m_encoder = new BinaryEncoder(BinaryEncoder::CBOR);
+	}
+	else if (format.compare("MessagePack") == 0)
+	{
+		m_encoder = new BinaryEncoder(BinaryEncoder::MessagePack);
+	}
+	else
+	{
+		m_encoder = new JSONEncoder();
+	}
+	if (m_encoder->name())
+	{
+		m_columnar = false;
+	}
+}
+
+/**
+ * Set the layout of the readings of each asset within a message
+ *
+ * @param layout	The layout, Rows or Columnar
+ */
+void MessageBuilder::setLayout(const string& layout)
+{
+	m_columnar = layout.compare("Columnar") == 0;
+	if (m_columnar && m_encoder->name())
+	{
+		m_log->warn("The columnar layout is only supported for JSON messages, readings will be sent as rows");
+		m_columnar = false;
+	}
+}
+
+/**
+ * Set whether each message holds the readings of a single asset
+ *
+ * @param perAsset	True to build a message per asset
+ */
+void MessageBuilder::setPerAsset(bool perAsset)
+{
+	m_perAsset = perAsset;
+}
+
+/**
+ * Set the format of the reading timestamps, Date for the date and time
+ * string of the reading or Epoch microseconds for the number of
+ * microseconds since the epoch
+ *
+ * @param format	The timestamp format
+ */
+void MessageBuilder::setTimestampFormat(const string& format)
+{
+	if (format.compare("Epoch microseconds") == 0)
+	{
+		m_fragments.timestamps().setFormat(TimestampEncoder::EpochMicros);
+	}
+	else
+	{
+		m_fragments.timestamps().setFormat(TimestampEncoder::Date);
+	}
+}
+
+/**
+ * Set the limits on the size of a message
+ *
+ * @param maxBytes	The maximum size of a message in bytes, 0 is unlimited
+ * @param maxReadings	The maximum number of readings in a message, 0 is unlimited
+ */
+void MessageBuilder::setLimits(size_t maxBytes, unsigned int maxReadings)
+{
+	m_maxBytes = maxBytes;
+	m_maxReadings = maxReadings;
+}
+
+/**
+ * Set the block of readings to build messages from. A single pass is made
+ * over the block, looking up each asset name in the asset registry to find
+ * the slot of that asset within the block and serializing the reading into
+ * the fragment buffer.
+ *
+ * For the columnar layout the offsets of the parts of each reading, its
+ * timestamp and a signature of its datapoint names are also recorded.
+ *
+ * The readings are not referenced once this call returns.
+ *
+ * @param readings	The block of readings
+ * @param start		The index of the first reading of the block to use
+ */
+void MessageBuilder::setBlock(const vector<Reading *>& readings, size_t start)
+{
+	m_fragments.clear();
+	m_offsets.clear();
+	m_slots.clear();
+	m_offsets.reserve(readings.size() - start + 1);
+	m_slots.reserve(readings.size() - start);
+	m_spans.clear();
+	m_spanIndex.clear();
+	m_signatures.clear();
+	m_times.clear();
+
+	m_assets.beginBlock();
+	m_offsets.push_back(0);
+	if (m_pool && readings.size() - start >= m_threshold
+			&& readings.size() - start >= 2 * kMinSegment)
+	{
+		for (auto reading = readings.cbegin() + start; reading != readings.cend(); reading++)
+		{
+			m_slots.push_back(m_assets.lookup((*reading)->getAssetName()));
+		}
+		encodeParallel(readings, start);
+	}
+	else
+	{
+		for (auto reading = readings.cbegin() + start; reading != readings.cend(); reading++)
+		{
+			m_slots.push_back(m_assets.lookup((*reading)->getAssetName()));
+			encodeReading(*reading, m_fragments, m_spans, m_spanIndex,
+					m_signatures, m_times);
+			m_offsets.push_back(m_fragments.length());
+		}
+	}
+	m_spanIndex.push_back(m_spans.size());
+	m_assets.endBlock();
+
+	unsigned int nAssets = m_assets.blockAssets();
+	for (auto slot = m_groupOrder.cbegin(); slot != m_groupOrder.cend(); slot++)
+	{
+		if (*slot < m_groups.size())
+			m_groups[*slot].clear();
+	}
+	m_groupOrder.clear();
+	m_group = 0;
+	m_groups.resize(nAssets);
+	m_chunk.assign(nAssets, 0);
+	m_chunkNo = 0;
+	m_base = start;
+	m_blockSize = readings.size() - start;
+	m_end = 0;
+	m_count = 0;
+}
+
+/**
+ * Serialize a reading into a buffer. For the columnar layout the offsets
+ * of the parts of the reading, a signature of its datapoint names and its
+ * timestamp are also recorded.
+ *
+ * @param reading	The reading to serialize
+ * @param out		The buffer to serialize into
+ * @param spans		The offsets of the parts of the readings
+ * @param spanIndex	The index in spans of the first part of each reading
+ * @param signatures	The signatures of the datapoint names of the readings
+ * @param times		The timestamps of the readings in microseconds
+ */
+void MessageBuilder::encodeReading(Reading *reading, PayloadWriter& out,
+		vector<size_t>& spans, vector<size_t>& spanIndex,
+		vector<uint64_t>& signatures, vector<long long>& times)
+{
+	if (m_columnar)
+	{
+		size_t first = spans.size();
+		spanIndex.push_back(first);
+		out.appendReading(reading, &spans);
+		times.push_back(TimestampEncoder::micros(reading));
+
+		// FNV-1a hash of the datapoint names
+		uint64_t hash = 14695981039346656037ULL;
+		for (size_t i = first + 2; i < spans.size(); i += 3)
+		{
+			for (size_t j = spans[i]; j < spans[i + 1]; j++)
+			{
+				hash = (hash ^ (unsigned char)out.data()[j]) * 1099511628211ULL;
+			}
+		}
+		signatures.push_back(hash);
+	}
+	else
+	{
+		m_encoder->appendReading(out, reading);
+	}
+}
+
+/**
+ * Serialize a block on the threads of the worker pool. The block is
+ * divided into contiguous segments, each serialized into its own buffer,
+ * and the buffers are then appended to the fragment buffer in block order,
+ * with the offsets of the readings moved to their place in the fragment
+ * buffer.
+ *
+ * @param readings	The block of readings
+ * @param start		The index of the first reading of the block to use
+ */
+void MessageBuilder::encodeParallel(const vector<Reading *>& readings, size_t start)
+{
+	size_t count = readings.size() - start;
+	size_t segments = count / kMinSegment;
+	if (segments > m_segments.size())
+	{
+		segments = m_segments.size();
+	}
+	TimestampEncoder::Format format = m_fragments.timestamps().format();
+
+	m_tasks.clear();
+	for (size_t s = 0; s < segments; s++)
+	{
+		Segment *segment = m_segments[s];
+		size_t first = start + count * s / segments;
+		size_t last = start + count * (s + 1) / segments;
+		m_tasks.push_back([this, segment, &readings, first, last, format]() {
+			segment->m_out.clear();
+			segment->m_out.timestamps().setFormat(format);
+			segment->m_offsets.clear();
+			segment->m_spans.clear();
+			segment->m_spanIndex.clear();
+			segment->m_signatures.clear();
+			segment->m_times.clear();
+			for (size_t i = first; i < last; i++)
+			{
+				encodeReading(readings[i], segment->m_out, segment->m_spans,
+						segment->m_spanIndex, segment->m_signatures,
+						segment->m_times);
+				segment->m_offsets.push_back(segment->m_out.length());
+			}
+		});
+	}
+	m_pool->run(m_tasks);
+
+	size_t length = 0;
+	for (size_t s = 0; s < segments; s++)
+	{
+		length += m_segments[s]->m_out.length();
+	}
+	m_fragments.reserve(length + 1);
+	for (size_t s = 0; s < segments; s++)
+	{
+		Segment *segment = m_segments[s];
+		size_t base = m_fragments.length();
+		size_t spanBase = m_spans.size();
+		m_fragments.append(segment->m_out.data(), segment->m_out.length());
+		for (auto it = segment->m_offsets.cbegin(); it != segment->m_offsets.cend(); it++)
+		{
+			m_offsets.push_back(base + *it);
+		}
+		if (m_columnar)
+		{
+			for (auto it = segment->m_spanIndex.cbegin(); it != segment->m_spanIndex.cend(); it++)
+			{
+				m_spanIndex.push_back(spanBase + *it);
+			}
+			for (auto it = segment->m_spans.cbegin(); it != segment->m_spans.cend(); it++)
+			{
+				m_spans.push_back(base + *it);
+			}
+			m_signatures.insert(m_signatures.end(), segment->m_signatures.cbegin(),
+					segment->m_signatures.cend());
+			m_times.insert(m_times.end(), segment->m_times.cbegin(),
+					segment->m_times.cend());
+		}
+	}
+}
+
+/**
+ * Build the next message from the block. Readings are added to the
+ * message in block order until adding the next would exceed either of
+ * the message limits. A reading that on its own exceeds the maximum
+ * message size can never be sent and is dropped.
+ *
+ * When there is a message per asset, each range of the block is sent as
+ * a message for each of the assets in the range, all of which report the
+ * end of the range as their end.
+ *
+ * @return	True if a message was built, false if the block is complete
+ */
+bool MessageBuilder::next()
+{
+	if (m_perAsset && m_group < m_groupOrder.size())
+	{
+		assemble(m_group, m_group + 1);
+		return true;
+	}
+	while (m_end < m_blockSize)
+	{
+		size_t start = m_end;
+		size_t size = m_encoder->messageOverhead();
+		unsigned int assets = 0;
+		size_t i;
+
+		m_chunkNo++;
+		for (i = start; i < m_blockSize; i++)
+		{
+			unsigned int slot = m_slots[i];
+			bool newAsset = m_chunk[slot] != m_chunkNo;
+			size_t add = fragmentLength(i);
+			if (newAsset)
+			{
+				add += m_encoder->assetOverhead(m_assets.blockAssetName(slot).length());
+			}
+			else
+			{
+				add += m_encoder->readingSeparator();
+			}
+			if (i > start && ((m_maxBytes && size + add > m_maxBytes)
+					|| (m_maxReadings && i - start >= m_maxReadings)))
+			{
+				break;
+			}
+			if (newAsset)
+			{
+				m_chunk[slot] = m_chunkNo;
+				assets++;
+			}
+			size += add;
+		}
+		m_end = i;
+		if (m_maxBytes && size > m_maxBytes)
+		{
+			m_log->error("Reading %lu of the block for asset %s requires %lu bytes, which exceeds the maximum message size of %lu bytes, the reading will not be sent",
+					(unsigned long)(m_base + start),
+					m_assets.blockAssetName(m_slots[start]).c_str(),
+					(unsigned long)size, (unsigned long)m_maxBytes);
+			continue;
+		}
+		groupReadings(start, m_end);
+		if (m_perAsset)
+		{
+			assemble(0, 1);
+		}
+		else
+		{
+			assemble(0, m_groupOrder.size());
+		}
+		return true;
+	}
+	m_count = 0;
+	return false;
+}
+
+/**
+ * Group the readings in a range of the block by asset, with the assets
+ * in name order. The readings of each asset retain their order within
+ * the block.
+ *
+ * @param start		The index of the first reading in the range
+ * @param end		The index after the last reading in the range
+ */
+void MessageBuilder::groupReadings(size_t start, size_t end)
+{
+	for (auto slot = m_groupOrder.cbegin(); slot != m_groupOrder.cend(); slot++)
+	{
+		m_groups[*slot].clear();
+	}
+	m_groupOrder.clear();
+	for (size_t i = start; i < end; i++)
+	{
+		vector<unsigned int>& group = m_groups[m_slots[i]];
+		if (group.empty())
+		{
+			m_groupOrder.push_back(m_slots[i]);
+		}
+		group.push_back(i);
+	}
+	sort(m_groupOrder.begin(), m_groupOrder.end(),
+		[this](unsigned int a, unsigned int b) {
+			return m_assets.blockAssetName(a) < m_assets.blockAssetName(b);
+		});
+	m_group = 0;
+}
+
+/**
+ * Assemble a message from a range of the asset groups of the current
+ * range of the block.
+ *
+ * In the columnar layout an asset with a single reading, or with readings
+ * that have different datapoints, is written as rows. Messages are sized
+ * using the row layout, the columnar layout of two or more readings is
+ * never larger than the rows it replaces.
+ *
+ * @param first		The index of the first asset group in the message
+ * @param last		The index after the last asset group in the message
+ */
+void MessageBuilder::assemble(size_t first, size_t last)
+{
+	m_payload.clear();
+	m_count = 0;
+	m_encoder->startMessage(m_payload, last - first);
+	for (size_t i = first; i < last; i++)
+	{
+		unsigned int slot = m_groupOrder[i];
+		vector<unsigned int>& group = m_groups[slot];
+		m_count += group.size();
+		if (m_columnar && group.size() > 1 && sameDatapoints(group))
+		{
+			if (i != first)
+				m_payload.append(',');
+			m_payload.append('"');
+			m_payload.append(m_assets.blockAssetName(slot));
+			m_payload.append("\" : ", 4);
+			appendColumns(group);
+			continue;
+		}
+		m_encoder->startAsset(m_payload, m_assets.blockAssetName(slot), group.size(),
+				i == first);
+		for (auto index = group.cbegin(); index != group.cend(); index++)
+		{
+			if (index != group.cbegin())
+			{
+				m_encoder->nextReading(m_payload);
+			}
+			m_payload.append(m_fragments.data() + m_offsets[*index],
+					fragmentLength(*index));
+		}
+		m_encoder->endAsset(m_payload);
+	}
+	m_encoder->endMessage(m_payload);
+	m_group = last;
+}
+
+/**
+ * Check if the readings of an asset all have the same datapoints, in the
+ * same order, and so may be written in the columnar layout
+ *
+ * @param group	The indexes of the readings of the asset
+ * @return	True if the readings have the same datapoints
+ */
+bool MessageBuilder::sameDatapoints(const vector<unsigned int>& group) const
+{
+	unsigned int first = group.front();
+	size_t count = datapoints(first);
+	const char *data = m_fragments.data();
+
+	if (count == 0)
+	{
+		return false;
+	}
+	for (auto index = group.cbegin() + 1; index != group.cend(); index++)
+	{
+		if (m_signatures[*index] != m_signatures[first] || datapoints(*index) != count)
+		{
+			return false;
+		}
+		// Guard against a collision of the signatures
+		for (size_t dp = 0; dp < count; dp++)
+		{
+			size_t part = 2 + dp * 3;
+			size_t length = span(first, part + 1) - span(first, part);
+			if (span(*index, part + 1) - span(*index, part) != length
+				|| memcmp(data + span(*index, part), data + span(first, part), length))
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * Append the readings of an asset in the columnar layout. The value
+ * written is an object with the timestamp of the first reading, the
+ * offset in microseconds of each reading from that timestamp and an
+ * array of the values of each datapoint, keyed by the datapoint name.
+ *
+ * @param group	The indexes of the readings of the asset
+ */
+void MessageBuilder::appendColumns(const vector<unsigned int>& group)
+{
+	unsigned int first = group.front();
+	size_t count = datapoints(first);
+	const char *data = m_fragments.data();
+	char buf[24];
+
+	m_payload.append("{\"ts\":", 6);
+	m_payload.append(data + span(first, 0), span(first, 1) - span(first, 0));
+	m_payload.append(",\"dt\":[", 7);
+	for (auto index = group.cbegin(); index != group.cend(); index++)
+	{
+		if (index != group.cbegin())
+			m_payload.append(',');
+		int len = snprintf(buf, sizeof(buf), "%lld", m_times[*index] - m_times[first]);
+		m_payload.append(buf, len);
+	}
+	m_payload.append(']');
+	for (size_t dp = 0; dp < count; dp++)
+	{
+		size_t part = 2 + dp * 3;
+		m_payload.append(',');
+		// The name of the datapoint, with the trailing colon
+		m_payload.append(data + span(first, part), span(first, part + 1) - span(first, part));
+		m_payload.append('[');
+		for (auto index = group.cbegin(); index != group.cend(); index++)
+		{
+			if (index != group.cbegin())
+				m_payload.append(',');
+			m_payload.append(data + span(*index, part + 1),
+					span(*index, part + 2) - span(*index, part + 1));
+		}
+		m_payload.append(']');
+	}
+	m_payload.append('}');
+}
+
+/**
+ * Map an asset name to a suitable device name in GCP IoT Core
+ *
+ * @param assetName 	The asset name to map
+ * @result		The mapped asset name
+ */
+void MessageBuilder::mapAssetName(string& assetName)
+{
+	for (string::iterator it = assetName.begin(); it != assetName.end(); ++it)
+	{
+		if (*it == ' ')
+		{
+			*it = '_';
+		}
+	}
+}
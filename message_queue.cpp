@@ -0,0 +1,78 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <message_queue.h>
+
+using namespace std;
+
+/**
+ * Constructor for the message queue
+ *
+ * @param capacity	The maximum number of messages in the queue
+ */
+MessageQueue::MessageQueue(size_t capacity) : m_capacity(capacity + 1), m_head(0), m_tail(0)
+{
+	// One slot is always left empty to distinguish full from empty
+	m_ring.resize(m_capacity);
+}
+
+/**
+ * Add a message to the queue. Must only be called by the producer.
+ *
+ * @param message	The message to add
+ * @return		False if the queue is full
+ */
+bool MessageQueue::push(QueuedMessage *message)
+{
+	size_t tail = m_tail.load(memory_order_relaxed);
+	size_t next = (tail + 1) % m_capacity;
+	if (next == m_head.load(memory_order_acquire))
+	{
+		return false;
+	}
+	m_ring[tail] = message;
+	m_tail.store(next, memory_order_release);
+	return true;
+}
+
+/**
+ * Remove the oldest message from the queue. Must only be called by the
+ * consumer.
+ *
+ * @return	The message or NULL if the queue is empty
+ */
+QueuedMessage *MessageQueue::pop()
+{
+	size_t head = m_head.load(memory_order_relaxed);
+	if (head == m_tail.load(memory_order_acquire))
+	{
+		return NULL;
+	}
+	QueuedMessage *message = m_ring[head];
+	m_head.store((head + 1) % m_capacity, memory_order_release);
+	return message;
+}
+
+/**
+ * Return true if the queue is empty
+ */
+bool MessageQueue::empty() const
+{
+	return m_head.load(memory_order_acquire) == m_tail.load(memory_order_acquire);
+}
+
+/**
+ * Return the number of messages in the queue
+ */
+size_t MessageQueue::size() const
+{
+	size_t head = m_head.load(memory_order_acquire);
+	size_t tail = m_tail.load(memory_order_acquire);
+	return (tail + m_capacity - head) % m_capacity;
+}
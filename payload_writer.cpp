@@ -0,0 +1,227 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <payload_writer.h>
+#include <value_formatter.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+
+using namespace std;
+
+/**
+ * Constructor for the payload writer
+ *
+ * @param initialSize	The initial size of the output buffer
+ */
+PayloadWriter::PayloadWriter(size_t initialSize) : m_size(initialSize), m_length(0)
+{
+	m_buffer = (char *)malloc(m_size);
+	if (!m_buffer)
+	{
+		throw bad_alloc();
+	}
+	m_buffer[0] = 0;
+}
+
+/**
+ * Destructor for the payload writer
+ */
+PayloadWriter::~PayloadWriter()
+{
+	free(m_buffer);
+}
+
+/**
+ * Make sure the output buffer can hold at least size bytes. The buffer
+ * is grown by doubling so that the number of reallocations is small.
+ *
+ * @param size	The required size of the buffer
+ */
+void PayloadWriter::reserve(size_t size)
+{
+	if (size <= m_size)
+	{
+		return;
+	}
+	size_t newSize = m_size * 2;
+	if (newSize < size)
+	{
+		newSize = size;
+	}
+	char *buffer = (char *)realloc(m_buffer, newSize);
+	if (!buffer)
+	{
+		throw bad_alloc();
+	}
+	m_buffer = buffer;
+	m_size = newSize;
+}
+
+/**
+ * Append the JSON for a single reading. The reading is written as an
+ * object with the user timestamp as the "ts" property followed by a
+ * property for each of the datapoints in the reading. The timestamp is
+ * either a date and time string or a number of microseconds since the
+ * epoch.
+ *
+ * If spans is given the offsets of the parts of the reading are added
+ * to it, the start and end of the timestamp then, for each
+ * datapoint, the start of the property name, the start of the value and
+ * the end of the value.
+ *
+ * @param reading	The reading to append
+ * @param spans		Vector to add the offsets of the parts of the reading to
+ */
+void PayloadWriter::appendReading(Reading *reading, vector<size_t> *spans)
+{
+	append("{\"ts\":", 6);
+	if (spans)
+		spans->push_back(m_length);
+	if (m_timestamps.format() == TimestampEncoder::EpochMicros)
+	{
+		char buf[32];
+		int len = snprintf(buf, sizeof(buf), "%lld", TimestampEncoder::micros(reading));
+		append(buf, len);
+	}
+	else
+	{
+		size_t len;
+		const char *date = m_timestamps.date(reading, &len);
+		append('"');
+		append(date, len);
+		append('"');
+	}
+	if (spans)
+		spans->push_back(m_length);
+	append(',');
+	const vector<Datapoint *>& dpv = reading->getReadingData();
+	for (auto dp = dpv.cbegin(); dp != dpv.cend(); dp++)
+	{
+		if (dp != dpv.cbegin())
+		{
+			append(',');
+		}
+		if (spans)
+		{
+			spans->push_back(m_length);
+			append('"');
+			append((*dp)->getName());
+			append("\":", 2);
+			spans->push_back(m_length);
+			appendValue((*dp)->getData());
+			spans->push_back(m_length);
+		}
+		else
+		{
+			appendDatapoint(*dp);
+		}
+	}
+	append('}');
+}
+
+/**
+ * Append a datapoint as a JSON property. The output is the same as that
+ * of Datapoint::toJSONProperty() but is written directly to the buffer.
+ *
+ * @param datapoint	The datapoint to append
+ */
+void PayloadWriter::appendDatapoint(Datapoint *datapoint)
+{
+	append('"');
+	append(datapoint->getName());
+	append("\":", 2);
+	appendValue(datapoint->getData());
+}
+
+/**
+ * Append a datapoint value. Integers, floating point values, arrays of
+ * floating point values and strings that need no escaping are formatted
+ * directly into the buffer, all other types use the JSON representation
+ * created by DatapointValue. The text is the same in either case.
+ *
+ * @param value		The value to append
+ */
+void PayloadWriter::appendValue(DatapointValue& value)
+{
+	switch (value.getType())
+	{
+		case DatapointValue::T_INTEGER:
+			reserve(m_length + ValueFormatter::kMaxNumber);
+			m_length += ValueFormatter::integer(m_buffer + m_length, value.toInt());
+			m_buffer[m_length] = 0;
+			break;
+		case DatapointValue::T_FLOAT:
+			appendDouble(value.toDouble());
+			break;
+		case DatapointValue::T_FLOAT_ARRAY:
+		{
+			vector<double> *arr = value.getDpArr();
+			append('[');
+			for (auto it = arr->cbegin(); it != arr->cend(); it++)
+			{
+				if (it != arr->cbegin())
+					append(", ", 2);
+				reserve(m_length + ValueFormatter::kMaxNumber);
+				m_length += ValueFormatter::general(m_buffer + m_length, *it);
+			}
+			append(']');
+			break;
+		}
+		case DatapointValue::T_STRING:
+			appendString(value.toStringValue());
+			break;
+		default:
+			append(value.toString());
+			break;
+	}
+}
+
+/**
+ * Append a floating point value as DatapointValue formats it, with ten
+ * decimal places less any trailing zeros
+ *
+ * @param value		The value to append
+ */
+void PayloadWriter::appendDouble(double value)
+{
+	reserve(m_length + ValueFormatter::kMaxNumber);
+	int len = ValueFormatter::fixed(m_buffer + m_length, value);
+	if (len >= 0)
+	{
+		m_length += len;
+		m_buffer[m_length] = 0;
+		return;
+	}
+
+	// Values that are not finite or are very large are rare, use
+	// DatapointValue so that any truncation of the text is the same
+	DatapointValue dpv(value);
+	append(dpv.toString());
+}
+
+/**
+ * Append a string value as a quoted JSON string. Strings that contain
+ * characters that require escaping are passed to DatapointValue so that
+ * the escaping is identical to that of the Fledge JSON representation.
+ *
+ * @param str	The string to append
+ */
+void PayloadWriter::appendString(const string& str)
+{
+	if (ValueFormatter::escapeIndex(str.data(), str.length()) < str.length())
+	{
+		DatapointValue value(str);
+		append(value.toString());
+		return;
+	}
+	append('"');
+	append(str);
+	append('"');
+}
@@ -88,6 +88,298 @@ static const char *default_config = QUOTE({
 				"order" : "7",
 				"displayName" : "Data Source",
 				"options" : ["readings", "statistics"]
+			},
+			"asset_cache_size" : {
+				"description" : "The maximum number of asset names to cache the name mapping for",
+				"type" : "integer",
+				"default" : "1000",
+				"minimum" : "1",
+				"order" : "8",
+				"displayName" : "Asset Cache Size",
+				"group" : "Advanced"
+			},
+			"asset_cache_ttl" : {
+				"description" : "The time in seconds an unused asset name is retained in the cache",
+				"type" : "integer",
+				"default" : "3600",
+				"minimum" : "0",
+				"order" : "9",
+				"displayName" : "Asset Cache TTL",
+				"group" : "Advanced"
+			},
+			"max_message_size" : {
+				"description" : "The maximum size in bytes of a message sent to GCP, blocks that exceed this are split into several messages. 0 is unlimited",
+				"type" : "integer",
+				"default" : "262144",
+				"minimum" : "0",
+				"order" : "10",
+				"displayName" : "Maximum Message Size",
+				"group" : "Advanced"
+			},
+			"max_message_readings" : {
+				"description" : "The maximum number of readings in a message sent to GCP. 0 is unlimited",
+				"type" : "integer",
+				"default" : "0",
+				"minimum" : "0",
+				"order" : "11",
+				"displayName" : "Maximum Message Readings",
+				"group" : "Advanced"
+			},
+			"qos" : {
+				"description" : "The MQTT quality of service used to send messages. With QoS 1 readings are only reported as sent once the broker has acknowledged them",
+				"type" : "enumeration",
+				"options" : [ "0", "1" ],
+				"default" : "1",
+				"order" : "12",
+				"displayName" : "Quality of Service",
+				"group" : "Advanced"
+			},
+			"transport" : {
+				"description" : "The MQTT client API used to send messages. The asynchronous client sends messages without waiting for each to complete",
+				"type" : "enumeration",
+				"options" : [ "Synchronous", "Asynchronous" ],
+				"default" : "Synchronous",
+				"order" : "13",
+				"displayName" : "MQTT Transport",
+				"group" : "Advanced"
+			},
+			"inflight_window" : {
+				"description" : "The maximum number of messages in flight when using the asynchronous transport",
+				"type" : "integer",
+				"default" : "10",
+				"minimum" : "1",
+				"order" : "14",
+				"displayName" : "In Flight Window",
+				"validity" : "transport == \"Asynchronous\"",
+				"group" : "Advanced"
+			},
+			"pipeline" : {
+				"description" : "Send messages on a separate I/O thread, so that serializing the next block overlaps sending the current one",
+				"type" : "boolean",
+				"default" : "false",
+				"order" : "15",
+				"displayName" : "Pipelined Sending",
+				"group" : "Advanced"
+			},
+			"queue_size" : {
+				"description" : "The number of messages that may be queued for the I/O thread",
+				"type" : "integer",
+				"default" : "16",
+				"minimum" : "1",
+				"order" : "16",
+				"displayName" : "Send Queue Size",
+				"validity" : "pipeline == \"true\"",
+				"group" : "Advanced"
+			},
+			"format" : {
+				"description" : "The encoding of the messages sent to GCP. Binary encodings are sent to a subfolder of the telemetry topic named after the encoding",
+				"type" : "enumeration",
+				"options" : [ "JSON", "CBOR", "MessagePack" ],
+				"default" : "JSON",
+				"order" : "17",
+				"displayName" : "Message Format",
+				"group" : "Advanced"
+			},
+			"compression" : {
+				"description" : "Compress each message with the given algorithm. Compressed messages are sent to a subfolder of the telemetry topic named after the algorithm",
+				"type" : "enumeration",
+				"options" : [ "none", "deflate", "gzip", "zstd" ],
+				"default" : "none",
+				"order" : "18",
+				"displayName" : "Compression",
+				"group" : "Advanced"
+			},
+			"compression_level" : {
+				"description" : "The compression level, 1 to 9 for deflate and gzip, 1 to 19 for zstd",
+				"type" : "integer",
+				"default" : "6",
+				"minimum" : "1",
+				"maximum" : "19",
+				"order" : "19",
+				"displayName" : "Compression Level",
+				"validity" : "compression != \"none\"",
+				"group" : "Advanced"
+			},
+			"layout" : {
+				"description" : "The layout of the readings of each asset in a JSON message. Columnar messages are sent to a subfolder of the telemetry topic named columnar",
+				"type" : "enumeration",
+				"options" : [ "Rows", "Columnar" ],
+				"default" : "Rows",
+				"order" : "20",
+				"displayName" : "Reading Layout",
+				"validity" : "format == \"JSON\"",
+				"group" : "Advanced"
+			},
+			"connect_budget" : {
+				"description" : "The maximum time in milliseconds to wait for the connection to GCP when sending readings. If the connection can not be made in this time the readings are left for Fledge to send later",
+				"type" : "integer",
+				"default" : "2000",
+				"minimum" : "100",
+				"order" : "21",
+				"displayName" : "Connect Budget",
+				"group" : "Advanced"
+			},
+			"connect_timeout" : {
+				"description" : "The maximum time in seconds a connection attempt may take. Attempts are made in the background, so an attempt may continue after the connect budget has been used and its outcome is collected when readings are next sent",
+				"type" : "integer",
+				"default" : "30",
+				"minimum" : "1",
+				"order" : "22",
+				"displayName" : "Connect Timeout",
+				"group" : "Advanced"
+			},
+			"spool" : {
+				"description" : "Store the messages that can not be sent whilst the connection to GCP is down in a spool file and send them when the connection returns",
+				"type" : "boolean",
+				"default" : "false",
+				"order" : "23",
+				"displayName" : "Spool Messages",
+				"group" : "Advanced"
+			},
+			"spool_size" : {
+				"description" : "The size of the spool file in megabytes",
+				"type" : "integer",
+				"default" : "64",
+				"minimum" : "1",
+				"order" : "24",
+				"displayName" : "Spool Size",
+				"validity" : "spool == \"true\"",
+				"group" : "Advanced"
+			},
+			"spool_policy" : {
+				"description" : "What to do when the spool is full, drop the oldest messages or refuse new readings, leaving them for Fledge to send later",
+				"type" : "enumeration",
+				"options" : [ "Drop oldest", "Refuse new" ],
+				"default" : "Drop oldest",
+				"order" : "25",
+				"displayName" : "Spool Full Policy",
+				"validity" : "spool == \"true\"",
+				"group" : "Advanced"
+			},
+			"shards" : {
+				"description" : "A list of devices to divide the readings between, each with a device_id and key. The readings of each asset are always sent by the same device. If the list is empty the Device ID and Key Name are used",
+				"type" : "JSON",
+				"default" : "[]",
+				"order" : "26",
+				"displayName" : "Shards",
+				"group" : "Advanced"
+			},
+			"gateway" : {
+				"description" : "Send the readings of each asset as a device bound to the gateway device, on the telemetry topic of that device",
+				"type" : "boolean",
+				"default" : "false",
+				"order" : "27",
+				"displayName" : "Gateway Mode",
+				"group" : "Advanced"
+			},
+			"broker_host" : {
+				"description" : "The host name of the MQTT broker",
+				"type" : "string",
+				"default" : "mqtt.googleapis.com",
+				"order" : "28",
+				"displayName" : "Broker Host",
+				"group" : "Advanced"
+			},
+			"broker_port" : {
+				"description" : "The port of the MQTT broker, 8883 or 443 for IoT Core",
+				"type" : "integer",
+				"default" : "8883",
+				"order" : "29",
+				"displayName" : "Broker Port",
+				"group" : "Advanced"
+			},
+			"tls" : {
+				"description" : "Connect to the broker using TLS",
+				"type" : "boolean",
+				"default" : "true",
+				"order" : "30",
+				"displayName" : "Use TLS",
+				"group" : "Advanced"
+			},
+			"root_certificate" : {
+				"description" : "The name of the root certificate in the certificate store used to verify the broker",
+				"type" : "string",
+				"default" : "roots",
+				"order" : "31",
+				"displayName" : "Root Certificate",
+				"validity" : "tls == \"true\"",
+				"group" : "Advanced"
+			},
+			"statistics_interval" : {
+				"description" : "The interval in seconds at which the timing statistics of sending are reported, 0 to disable them",
+				"type" : "integer",
+				"default" : "60",
+				"order" : "32",
+				"displayName" : "Statistics Interval",
+				"group" : "Advanced"
+			},
+			"statistics_state" : {
+				"description" : "Publish the timing statistics as the state of the device",
+				"type" : "boolean",
+				"default" : "false",
+				"order" : "33",
+				"displayName" : "Statistics As State",
+				"validity" : "statistics_interval != \"0\"",
+				"group" : "Advanced"
+			},
+			"timestamp_format" : {
+				"description" : "The format of the reading timestamps, a date and time string or the number of microseconds since the epoch",
+				"type" : "enumeration",
+				"options" : [ "Date", "Epoch microseconds" ],
+				"default" : "Date",
+				"order" : "34",
+				"displayName" : "Timestamp Format",
+				"group" : "Advanced"
+			},
+			"serialization_threads" : {
+				"description" : "The number of threads used to serialize large blocks of readings, 1 to serialize on the calling thread",
+				"type" : "integer",
+				"default" : "1",
+				"order" : "35",
+				"displayName" : "Serialization Threads",
+				"group" : "Advanced"
+			},
+			"parallel_threshold" : {
+				"description" : "The number of readings a block must have to be serialized on several threads",
+				"type" : "integer",
+				"default" : "5000",
+				"order" : "36",
+				"displayName" : "Parallel Threshold",
+				"validity" : "serialization_threads != \"1\"",
+				"group" : "Advanced"
+			},
+			"batching" : {
+				"description" : "Batch readings across calls to send, with a message size tuned to the measured throughput",
+				"type" : "boolean",
+				"default" : "false",
+				"order" : "37",
+				"displayName" : "Batching",
+				"group" : "Advanced"
+			},
+			"batch_linger" : {
+				"description" : "The longest time in milliseconds a reading may wait in the batch",
+				"type" : "integer",
+				"default" : "1000",
+				"order" : "38",
+				"displayName" : "Batch Linger",
+				"validity" : "batching == \"true\"",
+				"group" : "Advanced"
+			},
+			"rate_limit_messages" : {
+				"description" : "The maximum number of messages published per second, 0 for no limit",
+				"type" : "float",
+				"default" : "0",
+				"order" : "39",
+				"displayName" : "Message Rate Limit",
+				"group" : "Advanced"
+			},
+			"rate_limit_bytes" : {
+				"description" : "The maximum number of bytes published per second, 0 for no limit",
+				"type" : "integer",
+				"default" : "0",
+				"order" : "40",
+				"displayName" : "Byte Rate Limit",
+				"group" : "Advanced"
 			}
 		});
 
@@ -118,14 +410,16 @@ PLUGIN_INFORMATION *plugin_info()
 /**
  * Initialise the plugin with configuration.
  *
- * This function is called to get the plugin handle.
+ * This function is called to get the plugin handle. The connection to
+ * the broker is made in the background, so the call returns at once
+ * even if the broker is not reachable.
  */
 PLUGIN_HANDLE plugin_init(ConfigCategory* configData)
 {
 
 	GCP *gcp = new GCP();
 	gcp->configure(configData);
-	gcp->connect();
+	gcp->start();
 
 	return (PLUGIN_HANDLE)gcp;
 }
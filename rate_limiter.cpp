@@ -0,0 +1,241 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <rate_limiter.h>
+#include <thread>
+
+using namespace std;
+
+static const double kMinScale = 1.0 / 16;	// Lowest fraction of the quota after errors
+static const double kRecovery = 0.05;		// Fraction of the quota recovered per second
+static const chrono::seconds kHoldOff(10);	// Time after an error before the rates recover
+
+/**
+ * Add the tokens for an interval to the bucket
+ *
+ * @param seconds	The length of the interval
+ * @param scale		The fraction of the rate currently allowed
+ */
+void RateLimiter::Bucket::refill(double seconds, double scale)
+{
+	double capacity = m_rate * scale < 1.0 ? 1.0 : m_rate * scale;
+
+	m_tokens += seconds * m_rate * scale;
+	if (m_tokens > capacity)
+	{
+		m_tokens = capacity;
+	}
+}
+
+/**
+ * Return the time in seconds until the bucket holds the tokens for a
+ * message, or a full second of tokens if the message needs more
+ *
+ * @param cost		The tokens the message takes
+ * @param scale		The fraction of the rate currently allowed
+ * @return		The time to wait in seconds
+ */
+double RateLimiter::Bucket::delay(double cost, double scale) const
+{
+	double capacity = m_rate * scale < 1.0 ? 1.0 : m_rate * scale;
+	double need = cost < capacity ? cost : capacity;
+
+	if (m_tokens >= need)
+	{
+		return 0.0;
+	}
+	return (need - m_tokens) / (m_rate * scale);
+}
+
+/**
+ * Constructor for the rate limiter
+ */
+RateLimiter::RateLimiter() : m_messageRate(0), m_byteRate(0), m_scale(1.0),
+	m_temporary(false), m_limited(None), m_windowMessages(0),
+	m_windowBytes(0), m_observedMessages(0), m_observedBytes(0), m_errors(0),
+	m_throttled(0), m_waitTime(0)
+{
+	m_log = Logger::getLogger();
+	m_lastUpdate = m_windowStart = Clock::now();
+}
+
+/**
+ * Set the quotas to keep within
+ *
+ * @param messages	The messages per second, 0 for no limit
+ * @param bytes		The bytes per second, 0 for no limit
+ */
+void RateLimiter::configure(double messages, double bytes)
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_messageRate = messages;
+	m_byteRate = bytes;
+	m_messages.setRate(messages);
+	m_bytes.setRate(bytes);
+	m_scale = 1.0;
+	m_temporary = false;
+	m_lastUpdate = m_windowStart = Clock::now();
+	m_windowMessages = m_windowBytes = 0;
+	if (messages > 0 || bytes > 0)
+	{
+		m_log->info("Publishing at most %.0f messages and %.0f bytes per second, 0 is unlimited",
+				messages, bytes);
+	}
+}
+
+/**
+ * Add the tokens for the time since the last update to the buckets,
+ * recover the rates if no error has been reported recently and measure
+ * the rate of publication. Called with the mutex held.
+ *
+ * @param now	The current time
+ */
+void RateLimiter::update(Clock::time_point now)
+{
+	double seconds = chrono::duration<double>(now - m_lastUpdate).count();
+	m_lastUpdate = now;
+
+	if (m_scale < 1.0 && now - m_lastError >= kHoldOff)
+	{
+		m_scale += kRecovery * seconds;
+		if (m_scale >= 1.0)
+		{
+			m_scale = 1.0;
+			if (m_temporary)
+			{
+				m_messages.setRate(m_messageRate);
+				m_bytes.setRate(m_byteRate);
+				m_temporary = false;
+			}
+			m_log->info("Publishing rate has recovered after errors reported by the broker");
+		}
+	}
+	m_messages.refill(seconds, m_scale);
+	m_bytes.refill(seconds, m_scale);
+
+	double window = chrono::duration<double>(now - m_windowStart).count();
+	if (window >= 1.0)
+	{
+		m_observedMessages = m_windowMessages / window;
+		m_observedBytes = m_windowBytes / window;
+		m_windowMessages = m_windowBytes = 0;
+		m_windowStart = now;
+	}
+}
+
+/**
+ * Wait until a message may be published and take its tokens
+ *
+ * @param bytes	The size of the message
+ * @return	The time spent waiting
+ */
+RateLimiter::Clock::duration RateLimiter::acquire(size_t bytes)
+{
+Clock::time_point	start = Clock::now();
+
+	unique_lock<mutex> lck(m_mutex);
+	while (true)
+	{
+		update(Clock::now());
+		double wait = 0.0;
+		bool byMessages = false;
+		if (m_messages.limited())
+		{
+			wait = m_messages.delay(1, m_scale);
+			byMessages = wait > 0.0;
+		}
+		if (m_bytes.limited() && m_bytes.delay(bytes, m_scale) > wait)
+		{
+			wait = m_bytes.delay(bytes, m_scale);
+			byMessages = false;
+		}
+		if (wait <= 0.0)
+		{
+			break;
+		}
+		if (byMessages)
+		{
+			m_limited = Messages;
+		}
+		else if (m_limited == None)
+		{
+			m_limited = Bytes;
+		}
+		lck.unlock();
+		this_thread::sleep_for(chrono::duration<double>(wait));
+		lck.lock();
+	}
+	m_messages.take(1);
+	m_bytes.take(bytes);
+	m_windowMessages++;
+	m_windowBytes += bytes;
+
+	Clock::duration waited = Clock::now() - start;
+	if (m_messages.limited() || m_bytes.limited())
+	{
+		double seconds = chrono::duration<double>(waited).count();
+		if (seconds > 0.0001)
+		{
+			m_throttled++;
+			m_waitTime += seconds;
+		}
+	}
+	return waited;
+}
+
+/**
+ * Reduce the rate of publication after the broker has reported an error
+ */
+void RateLimiter::backoff()
+{
+	lock_guard<mutex> guard(m_mutex);
+	Clock::time_point now = Clock::now();
+	update(now);
+	m_errors++;
+	m_lastError = now;
+	if (!m_messages.limited() && !m_bytes.limited())
+	{
+		// No quota is configured, use the rate achieved so far
+		m_messages.setRate(m_observedMessages > 1.0 ? m_observedMessages : 1.0);
+		m_bytes.setRate(m_observedBytes);
+		m_temporary = true;
+	}
+	m_scale = m_scale / 2 < kMinScale ? kMinScale : m_scale / 2;
+	m_log->warn("The broker reported an error, publishing at %.0f%% of %.1f messages and %.0f bytes per second",
+			m_scale * 100.0, m_messages.m_rate, m_bytes.m_rate);
+}
+
+/**
+ * Return the quota that has delayed messages since the last call. If the
+ * message quota has delayed any message, larger messages would make
+ * better use of the quotas.
+ *
+ * @return	The quota that has delayed messages, Messages if both have
+ */
+RateLimiter::Limit RateLimiter::limited()
+{
+	lock_guard<mutex> guard(m_mutex);
+	Limit limited = m_limited;
+	m_limited = None;
+	return limited;
+}
+
+/**
+ * Log the statistics of the rate limiter
+ */
+void RateLimiter::logStatistics()
+{
+	lock_guard<mutex> guard(m_mutex);
+	if (!m_messages.limited() && !m_bytes.limited() && !m_errors)
+	{
+		return;
+	}
+	m_log->info("GCP rate limit delayed %lu messages for %.1fs, %lu errors reported by the broker, publishing at %.0f%% of the quota",
+			m_throttled, m_waitTime, m_errors, m_scale * 100.0);
+}
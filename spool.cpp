@@ -0,0 +1,461 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <spool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+using namespace std;
+
+static const uint32_t kMagic = 0x53504347;	// GCPS
+static const uint32_t kVersion = 1;
+static const uint32_t kRecordMagic = 0x52504347;	// GCPR
+static const uint16_t kWrap = 0x0001;		// The rest of the ring is unused
+static const size_t kHeaderSize = 4096;
+static const size_t kAlign = 8;
+
+/**
+ * Round a size up to the alignment of the records
+ */
+static inline size_t align(size_t size)
+{
+	return (size + kAlign - 1) & ~(kAlign - 1);
+}
+
+/**
+ * Constructor for the spool
+ */
+Spool::Spool() : m_policy(DropOldest), m_fd(-1), m_base(NULL), m_mapped(0),
+	m_data(NULL), m_size(0), m_head(0), m_tail(0), m_records(0), m_dropped(0),
+	m_droppedLogged(0), m_dirty(false), m_appended(0), m_refused(0),
+	m_drainedMessages(0), m_drainedBytes(0), m_drainTime(0.0)
+{
+	m_log = Logger::getLogger();
+}
+
+/**
+ * Destructor for the spool
+ */
+Spool::~Spool()
+{
+	close();
+}
+
+/**
+ * Open the spool file, creating it if it does not exist. The messages
+ * left in an existing spool are kept. If an existing spool holds
+ * messages it keeps its size until it has been emptied.
+ *
+ * @param path		The path of the spool file
+ * @param size		The size in bytes of the ring of messages
+ * @param policy	What to do when the spool is full
+ * @return		True if the spool was opened
+ */
+bool Spool::open(const string& path, size_t size, Policy policy)
+{
+struct stat st;
+Header header;
+
+	close();
+	m_path = path;
+	m_policy = policy;
+	size = align(size);
+	if ((m_fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0600)) < 0)
+	{
+		m_log->error("Unable to open the spool file %s, %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	bool valid = false;
+	if (fstat(m_fd, &st) == 0 && (size_t)st.st_size > kHeaderSize
+			&& pread(m_fd, &header, sizeof(header), 0) == sizeof(header)
+			&& header.m_magic == kMagic && header.m_version == kVersion
+			&& (uint64_t)st.st_size == kHeaderSize + header.m_size
+			&& header.m_head <= header.m_size && header.m_tail <= header.m_size)
+	{
+		if (header.m_records && header.m_size != size)
+		{
+			m_log->warn("The spool %s holds messages, its size of %lu bytes will be kept until it is empty",
+					path.c_str(), (unsigned long)header.m_size);
+			size = header.m_size;
+		}
+		valid = header.m_size == size;
+	}
+	if (!valid)
+	{
+		int rc = 0;
+		if (ftruncate(m_fd, 0) != 0
+			|| (rc = posix_fallocate(m_fd, 0, kHeaderSize + size)) != 0)
+		{
+			m_log->error("Unable to allocate %lu bytes for the spool file %s, %s",
+					(unsigned long)(kHeaderSize + size), path.c_str(),
+					strerror(rc ? rc : errno));
+			close();
+			return false;
+		}
+	}
+	m_mapped = kHeaderSize + size;
+	void *base = mmap(NULL, m_mapped, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+	if (base == MAP_FAILED)
+	{
+		m_log->error("Unable to map the spool file %s, %s", path.c_str(), strerror(errno));
+		close();
+		return false;
+	}
+	m_base = (char *)base;
+	m_data = m_base + kHeaderSize;
+	m_size = size;
+	if (valid)
+	{
+		m_head = header.m_head;
+		m_tail = header.m_tail;
+		m_records = header.m_records;
+		m_dropped = m_droppedLogged = header.m_dropped;
+		if (m_records)
+		{
+			m_log->info("The spool %s holds %lu messages to be sent",
+					path.c_str(), (unsigned long)m_records);
+		}
+	}
+	else
+	{
+		m_dropped = m_droppedLogged = 0;
+		reset();
+		commit();
+	}
+	return true;
+}
+
+/**
+ * Close the spool, committing any outstanding changes
+ */
+void Spool::close()
+{
+	if (m_base)
+	{
+		commit();
+		munmap(m_base, m_mapped);
+		m_base = NULL;
+		m_data = NULL;
+	}
+	if (m_fd >= 0)
+	{
+		::close(m_fd);
+		m_fd = -1;
+	}
+}
+
+/**
+ * Append a message to the spool. If the spool is full the oldest
+ * messages are dropped to make space or the message is refused,
+ * depending on the policy of the spool. Dropped messages are committed
+ * before their space is reused.
+ *
+ * @param topic		The topic of the message
+ * @param payload	The message payload
+ * @param length	The length of the payload
+ * @return		True if the message was added to the spool
+ */
+bool Spool::append(const string& topic, const char *payload, size_t length)
+{
+uint64_t	offset;
+bool		dropped = false;
+
+	size_t need = align(sizeof(Record) + topic.length() + length);
+	if (topic.length() > 0xffff || length > 0xffffffff || need > m_size)
+	{
+		m_log->error("A message of %lu bytes can not be held in the spool of %lu bytes",
+				(unsigned long)length, (unsigned long)m_size);
+		m_refused++;
+		return false;
+	}
+	while (!reserve(need, &offset))
+	{
+		if (m_policy == Refuse || m_records == 0)
+		{
+			m_refused++;
+			return false;
+		}
+		consume(1);
+		m_dropped++;
+		dropped = true;
+	}
+	if (dropped)
+	{
+		// The header must no longer refer to the dropped messages
+		// before their space is reused, or a crash would leave it
+		// pointing at the new record
+		commit();
+	}
+	if (offset == 0 && m_tail != 0 && m_size - m_tail >= sizeof(Record))
+	{
+		// Mark the rest of the ring as unused
+		Record *wrap = record(m_tail);
+		wrap->m_magic = kRecordMagic;
+		wrap->m_flags = kWrap;
+		wrap->m_length = 0;
+		wrap->m_topicLength = 0;
+		wrap->m_crc = 0;
+	}
+	Record *rec = record(offset);
+	char *body = (char *)(rec + 1);
+	memcpy(body, topic.data(), topic.length());
+	memcpy(body + topic.length(), payload, length);
+	rec->m_magic = kRecordMagic;
+	rec->m_length = length;
+	rec->m_topicLength = topic.length();
+	rec->m_flags = 0;
+	rec->m_crc = crc32(0L, (const Bytef *)body, topic.length() + length);
+	m_tail = offset + need;
+	m_records++;
+	m_appended++;
+	m_dirty = true;
+	return true;
+}
+
+/**
+ * Return a cursor positioned at the oldest message in the spool
+ */
+Spool::Cursor Spool::begin() const
+{
+	Cursor cursor;
+
+	cursor.m_offset = m_head;
+	cursor.m_index = 0;
+	return cursor;
+}
+
+/**
+ * Read the message at a cursor and move the cursor on to the next
+ * message. The message is not removed from the spool. The payload
+ * remains valid until the spool is next modified. If the record is
+ * damaged the contents of the spool are discarded.
+ *
+ * @param cursor	The position to read from
+ * @param topic		Set to the topic of the message
+ * @param payload	Set to the message payload
+ * @param length	Set to the length of the payload
+ * @return		False if there are no more messages
+ */
+bool Spool::read(Cursor& cursor, string& topic, const char **payload, size_t *length)
+{
+	if (cursor.m_index >= m_records)
+	{
+		return false;
+	}
+	uint64_t offset = recordOffset(cursor.m_offset);
+	Record *rec = record(offset);
+	const char *body = (const char *)(rec + 1);
+	size_t size = align(sizeof(Record) + rec->m_topicLength + rec->m_length);
+	if (rec->m_magic != kRecordMagic || (rec->m_flags & kWrap) || offset + size > m_size
+		|| rec->m_crc != crc32(0L, (const Bytef *)body, rec->m_topicLength + rec->m_length))
+	{
+		m_log->error("The spool %s is damaged, %lu messages have been discarded",
+				m_path.c_str(), (unsigned long)m_records);
+		reset();
+		commit();
+		return false;
+	}
+	topic.assign(body, rec->m_topicLength);
+	*payload = body + rec->m_topicLength;
+	*length = rec->m_length;
+	cursor.m_offset = offset + size;
+	cursor.m_index++;
+	return true;
+}
+
+/**
+ * Remove the oldest messages from the spool
+ *
+ * @param count		The number of messages to remove
+ */
+void Spool::consume(uint64_t count)
+{
+	while (count-- && m_records)
+	{
+		uint64_t offset = recordOffset(m_head);
+		Record *rec = record(offset);
+		size_t size = align(sizeof(Record) + rec->m_topicLength + rec->m_length);
+		if (rec->m_magic != kRecordMagic || offset + size > m_size)
+		{
+			reset();
+			break;
+		}
+		m_head = offset + size;
+		m_records--;
+	}
+	if (m_records == 0)
+	{
+		m_head = m_tail = 0;
+	}
+	m_dirty = true;
+}
+
+/**
+ * Make the changes to the spool durable. The records are written to disk
+ * before the header that refers to them.
+ */
+void Spool::commit()
+{
+	if (!m_base || !m_dirty)
+	{
+		return;
+	}
+	msync(m_data, m_size, MS_SYNC);
+	Header *header = (Header *)m_base;
+	header->m_magic = kMagic;
+	header->m_version = kVersion;
+	header->m_size = m_size;
+	header->m_head = m_head;
+	header->m_tail = m_tail;
+	header->m_records = m_records;
+	header->m_dropped = m_dropped;
+	msync(m_base, kHeaderSize, MS_SYNC);
+	m_dirty = false;
+}
+
+/**
+ * Record the rate at which messages have been drained from the spool
+ *
+ * @param messages	The number of messages sent
+ * @param bytes		The number of bytes sent
+ * @param seconds	The time taken to send them
+ */
+void Spool::drained(unsigned long messages, unsigned long bytes, double seconds)
+{
+	m_drainedMessages += messages;
+	m_drainedBytes += bytes;
+	m_drainTime += seconds;
+}
+
+/**
+ * Log the spool statistics since they were last logged
+ */
+void Spool::logStatistics()
+{
+	if (!m_base)
+	{
+		return;
+	}
+	m_log->info("Spool holds %lu messages in %lu bytes, %.1f%% full, %lu added, %lu dropped, %lu refused",
+			(unsigned long)m_records, (unsigned long)depth(),
+			m_size ? 100.0 * depth() / m_size : 0.0, m_appended,
+			(unsigned long)(m_dropped - m_droppedLogged), m_refused);
+	if (m_drainedMessages)
+	{
+		m_log->info("Spool drained %lu messages, %lu bytes in %.3fs, %.1f messages per second",
+				m_drainedMessages, m_drainedBytes, m_drainTime,
+				m_drainTime > 0.0 ? m_drainedMessages / m_drainTime : 0.0);
+	}
+	if (m_dropped != m_droppedLogged)
+	{
+		m_log->warn("%lu messages have been dropped from the full spool",
+				(unsigned long)(m_dropped - m_droppedLogged));
+	}
+	m_droppedLogged = m_dropped;
+	m_appended = 0;
+	m_refused = 0;
+	m_drainedMessages = 0;
+	m_drainedBytes = 0;
+	m_drainTime = 0.0;
+}
+
+/**
+ * Find space for a record at the end of the ring, wrapping round to the
+ * start of the ring if there is no space before the end. Nothing is
+ * written to the ring, the caller marks the end of the ring as unused
+ * when the record wraps.
+ *
+ * @param need		The size of the record
+ * @param offset	Set to the offset at which to write the record
+ * @return		False if there is no space for the record
+ */
+bool Spool::reserve(size_t need, uint64_t *offset)
+{
+	if (m_records == 0)
+	{
+		m_head = m_tail = 0;
+	}
+	else if (m_head == m_tail)
+	{
+		return false;
+	}
+	if (m_tail >= m_head)
+	{
+		if (m_size - m_tail >= need)
+		{
+			*offset = m_tail;
+			return true;
+		}
+		if (need > m_head)
+		{
+			return false;
+		}
+		*offset = 0;
+		return true;
+	}
+	if (m_head - m_tail >= need)
+	{
+		*offset = m_tail;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Return the offset of the record at a position in the ring, which is the
+ * start of the ring if the position is the unused space at the end.
+ *
+ * @param offset	The position in the ring
+ * @return		The offset of the record
+ */
+uint64_t Spool::recordOffset(uint64_t offset) const
+{
+	if (m_size - offset < sizeof(Record))
+	{
+		return 0;
+	}
+	Record *rec = record(offset);
+	if (rec->m_magic == kRecordMagic && (rec->m_flags & kWrap))
+	{
+		return 0;
+	}
+	return offset;
+}
+
+/**
+ * Discard the contents of the spool
+ */
+void Spool::reset()
+{
+	m_head = 0;
+	m_tail = 0;
+	m_records = 0;
+	m_dirty = true;
+}
+
+/**
+ * Return the number of bytes of the ring in use
+ */
+uint64_t Spool::depth() const
+{
+	if (m_records == 0)
+	{
+		return 0;
+	}
+	if (m_tail > m_head)
+	{
+		return m_tail - m_head;
+	}
+	return m_size - m_head + m_tail;
+}
@@ -0,0 +1,228 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <sync_transport.h>
+
+using namespace std;
+
+/*
+ * Callback functions
+ *
+ * C Functions that are called by the MQTT library for various events
+ */
+
+/**
+ * Callback function that is called when a message for one of the topic we subscribe to arrives.
+ *
+ * @param context	The SyncTransport object instance
+ * @param topicName	The name of the topic the message arrived on
+ * @param topicLen	The length of the topic name
+ * @param message	The MQTT message content
+ */
+static int messageArrived(void *context, char *topicName, int topicLen, MQTTClient_message *message)
+{
+SyncTransport *transport = (SyncTransport *)context;
+
+	transport->msgArrived(topicName, message);
+	return 1;
+}
+
+/**
+ * Callback function that is called when the MQTT connection is lost
+ *
+ * @param context	The SyncTransport object instance
+ * @param cause		The cause of the lost connection
+ */
+static void connectionLost(void *context, char *cause)
+{
+SyncTransport *transport = (SyncTransport *)context;
+
+	transport->lostConnection(cause);
+}
+
+/**
+ * Callback function that is called when an MQTT message is delivered.
+ *
+ * @param context	The SyncTransport object instance
+ * @param dt		The delivery token of the packet that was delivered
+ */
+static void deliveryComplete(void *context, MQTTClient_deliveryToken dt)
+{
+SyncTransport *transport = (SyncTransport *)context;
+
+	transport->delivered(dt);
+}
+
+/**
+ * Constructor for the synchronous transport
+ *
+ * @param listener	The listener to report events to
+ */
+SyncTransport::SyncTransport(TransportListener *listener) : MQTTTransport(listener),
+	m_created(false), m_lastToken(0)
+{
+	m_log = Logger::getLogger();
+}
+
+/**
+ * Destructor for the synchronous transport
+ */
+SyncTransport::~SyncTransport()
+{
+	if (m_created)
+	{
+		MQTTClient_disconnect(m_client, 10000);
+		MQTTClient_destroy(&m_client);
+	}
+}
+
+/**
+ * Make a single attempt to connect to the broker. The MQTT client is
+ * created on the first call and reused by later calls.
+ *
+ * @param options	The connection options
+ * @return		The MQTTClient connect return code
+ */
+int SyncTransport::connect(const TransportOptions& options)
+{
+MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
+MQTTClient_SSLOptions sslopts = MQTTClient_SSLOptions_initializer;
+
+	if (!m_created)
+	{
+		int rc = MQTTClient_create(&m_client, options.m_address.c_str(),
+				options.m_clientID.c_str(), MQTTCLIENT_PERSISTENCE_NONE, NULL);
+		if (rc != MQTTCLIENT_SUCCESS)
+		{
+			return rc;
+		}
+		MQTTClient_setCallbacks(m_client, this, connectionLost, messageArrived, deliveryComplete);
+		m_created = true;
+	}
+	conn_opts.keepAliveInterval = options.m_keepAlive;
+	conn_opts.connectTimeout = options.m_connectTimeout;
+	conn_opts.cleansession = 1;
+	conn_opts.username = options.m_username;
+	conn_opts.password = options.m_password;
+	if (options.m_trustStore || options.m_caPath)
+	{
+		sslopts.trustStore = options.m_trustStore;
+		sslopts.CApath = options.m_caPath;
+		sslopts.privateKey = options.m_privateKey;
+		conn_opts.ssl = &sslopts;
+	}
+	return MQTTClient_connect(m_client, &conn_opts);
+}
+
+/**
+ * Disconnect from the broker. The client is kept for the next connection.
+ */
+void SyncTransport::disconnect()
+{
+	if (m_created)
+	{
+		MQTTClient_disconnect(m_client, 10000);
+	}
+}
+
+/**
+ * Subscribe to a topic
+ *
+ * @param topic	The topic to subscribe to
+ * @param qos	The quality of service of the subscription
+ * @return	The MQTTClient return code
+ */
+int SyncTransport::subscribe(const string& topic, int qos)
+{
+	if (!m_created)
+	{
+		return MQTTCLIENT_DISCONNECTED;
+	}
+	return MQTTClient_subscribe(m_client, topic.c_str(), qos);
+}
+
+/**
+ * Publish a message to a topic
+ *
+ * @param topic		The topic to publish to
+ * @param payload	The message payload
+ * @param length	The length of the payload
+ * @param qos		The quality of service of the message
+ * @param token		Returns the delivery token of the message
+ * @return		The MQTTClient return code
+ */
+int SyncTransport::publish(const string& topic, const char *payload, int length, int qos, int *token)
+{
+MQTTClient_message pubmsg = MQTTClient_message_initializer;
+MQTTClient_deliveryToken dt = 0;
+
+	if (!m_created)
+	{
+		return MQTTCLIENT_DISCONNECTED;
+	}
+	pubmsg.payload = (void *)payload;
+	pubmsg.payloadlen = length;
+	pubmsg.qos = qos;
+	pubmsg.retained = 0;
+	int rc = MQTTClient_publishMessage(m_client, topic.c_str(), &pubmsg, &dt);
+	if (rc == MQTTCLIENT_SUCCESS)
+	{
+		m_lastToken = dt;
+	}
+	*token = dt;
+	return rc;
+}
+
+/**
+ * Wait for the last message published to complete
+ *
+ * @param timeout	The maximum time to wait in milliseconds
+ * @return		The MQTTClient return code
+ */
+int SyncTransport::waitForCompletion(unsigned long timeout)
+{
+	if (!m_created)
+	{
+		return MQTTCLIENT_DISCONNECTED;
+	}
+	return MQTTClient_waitForCompletion(m_client, m_lastToken, timeout);
+}
+
+/**
+ * Pass a message that has arrived to the listener and free it
+ *
+ * @param topic	The topic the message arrived on
+ * @param msg	The message
+ */
+void SyncTransport::msgArrived(char *topic, MQTTClient_message *msg)
+{
+	m_listener->msgArrived(topic, (const char *)msg->payload, msg->payloadlen);
+	MQTTClient_freeMessage(&msg);
+	MQTTClient_free(topic);
+}
+
+/**
+ * Report the loss of the connection to the listener
+ *
+ * @param reason	The reason for the disconnection
+ */
+void SyncTransport::lostConnection(const char *reason)
+{
+	m_listener->lostConnection(reason);
+}
+
+/**
+ * Report the delivery of a message to the listener
+ *
+ * @param dt	Delivery token
+ */
+void SyncTransport::delivered(MQTTClient_deliveryToken dt)
+{
+	m_listener->delivered(dt);
+}
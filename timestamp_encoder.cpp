@@ -0,0 +1,86 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <timestamp_encoder.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+using namespace std;
+
+/**
+ * Constructor for the timestamp encoder
+ */
+TimestampEncoder::TimestampEncoder() : m_format(Date), m_second(0), m_cached(false),
+	m_length(0), m_digits(0)
+{
+	m_buffer[0] = 0;
+}
+
+/**
+ * Return the date and time string of the user timestamp of a reading. The
+ * string is only valid until the next call.
+ *
+ * @param reading	The reading
+ * @param length	Set to the length of the string
+ * @return		The date and time string
+ */
+const char *TimestampEncoder::date(Reading *reading, size_t *length)
+{
+struct timeval	tv;
+
+	reading->getUserTimestamp(&tv);
+	if (m_cached && tv.tv_sec == m_second)
+	{
+		unsigned long usec = tv.tv_usec;
+		char *p = m_buffer + m_digits + 6;
+		for (int i = 0; i < 6; i++)
+		{
+			*--p = '0' + usec % 10;
+			usec /= 10;
+		}
+	}
+	else
+	{
+		refill(reading, tv);
+	}
+	*length = m_length;
+	return m_buffer;
+}
+
+/**
+ * Create the date and time string of a reading and find the microsecond
+ * digits within it, so that they can be replaced for the other readings
+ * within the same second.
+ *
+ * @param reading	The reading
+ * @param tv		The user timestamp of the reading
+ */
+void TimestampEncoder::refill(Reading *reading, const struct timeval& tv)
+{
+char	micros[16];
+
+	string ts = reading->getAssetDateUserTime(Reading::FMT_DEFAULT, true);
+	m_cached = false;
+	m_length = ts.length() < sizeof(m_buffer) ? ts.length() : sizeof(m_buffer) - 1;
+	memcpy(m_buffer, ts.data(), m_length);
+	m_buffer[m_length] = 0;
+	if (m_length < ts.length() || tv.tv_usec < 0 || tv.tv_usec > 999999)
+	{
+		return;
+	}
+	snprintf(micros, sizeof(micros), ".%06lu", (unsigned long)tv.tv_usec);
+	size_t pos = ts.rfind(micros);
+	if (pos != string::npos)
+	{
+		m_digits = pos + 1;
+		m_second = tv.tv_sec;
+		m_cached = true;
+	}
+}
@@ -0,0 +1,367 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <token_manager.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <chrono>
+
+using namespace std;
+
+static const time_t kTokenLifetime = 3600;	// IoT Core maximum is 24 hours
+static const time_t kRotationTime = 3300;	// Rotate well ahead of expiry
+static const time_t kSignAhead = 60;		// Sign the next token this far ahead of rotation
+static const time_t kKeyCheckInterval = 60;	// How often to look for a new key file
+
+/**
+ * Return the monotonic time in milliseconds
+ */
+static double monotonicTime()
+{
+struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * Constructor for the token manager
+ */
+TokenManager::TokenManager() : m_algorithm(JWT_ALG_ES256), m_keyLoaded(false),
+	m_current(NULL), m_issued(0), m_stale(false), m_next(NULL), m_nextIssued(0),
+	m_thread(NULL), m_running(false), m_refreshes(0), m_keyLoads(0), m_signs(0),
+	m_signTime(0.0), m_signTimeMax(0.0)
+{
+	m_log = Logger::getLogger();
+	memset(&m_keyTime, 0, sizeof(m_keyTime));
+}
+
+/**
+ * Destructor for the token manager
+ */
+TokenManager::~TokenManager()
+{
+	stop();
+	free(m_current);
+	free(m_next);
+}
+
+/**
+ * Configure the token manager. Any existing tokens are discarded and
+ * the key will be read again when the next token is required.
+ *
+ * @param audience	The audience of the token, the GCP project ID
+ * @param keyPath	The path of the private key file
+ * @param algorithm	The signing algorithm
+ */
+void TokenManager::configure(const string& audience, const string& keyPath,
+		jwt_alg_t algorithm)
+{
+	stop();
+	{
+		lock_guard<mutex> guard(m_mutex);
+		m_audience = audience;
+		m_keyPath = keyPath;
+		m_algorithm = algorithm;
+		m_keyLoaded = false;
+		m_key.clear();
+		free(m_current);
+		m_current = NULL;
+		free(m_next);
+		m_next = NULL;
+		m_stale = false;
+	}
+	start();
+}
+
+/**
+ * Return a token to connect with. The current token is returned unless
+ * it is due for rotation, in which case the token signed ahead of time
+ * by the background thread is used, provided it is not itself due for
+ * rotation, or failing that a new token is signed. The token remains
+ * valid until the next call.
+ *
+ * @return	The token or NULL if no token could be created
+ */
+const char *TokenManager::token()
+{
+	lock_guard<mutex> guard(m_mutex);
+	time_t now = time(0);
+
+	if (m_keyLoaded && keyChanged())
+	{
+		loadKey();
+	}
+	if (m_current && !m_stale && now < m_issued + kRotationTime)
+	{
+		return m_current;
+	}
+	if (m_next && now >= m_nextIssued + kRotationTime)
+	{
+		// Signed too long ago to be of use, the thread may have stalled
+		free(m_next);
+		m_next = NULL;
+	}
+	if (m_next)
+	{
+		free(m_current);
+		m_current = m_next;
+		m_issued = m_nextIssued;
+		m_next = NULL;
+	}
+	else
+	{
+		if (!m_keyLoaded && !loadKey())
+		{
+			return m_current;
+		}
+		double start = monotonicTime();
+		char *token = sign(m_key, now);
+		double elapsed = monotonicTime() - start;
+		m_signs++;
+		m_signTime += elapsed;
+		if (elapsed > m_signTimeMax)
+			m_signTimeMax = elapsed;
+		if (!token)
+		{
+			return m_current;
+		}
+		free(m_current);
+		m_current = token;
+		m_issued = now;
+	}
+	m_stale = false;
+	m_refreshes++;
+	m_cv.notify_all();
+	return m_current;
+}
+
+/**
+ * Return true if the token the connection was made with should be
+ * replaced, either because it will soon expire or because the key
+ * has changed.
+ *
+ * @return	True if the caller should reconnect with a new token
+ */
+bool TokenManager::rotationDue()
+{
+	lock_guard<mutex> guard(m_mutex);
+	return m_current && (m_stale || time(0) >= m_issued + kRotationTime);
+}
+
+/**
+ * Log the token statistics
+ */
+void TokenManager::logStatistics()
+{
+	lock_guard<mutex> guard(m_mutex);
+	if (!m_current)
+	{
+		return;
+	}
+	m_log->info("JWT token age %lds, %lu tokens issued, %lu key loads, %lu signed in average %.1fms, maximum %.1fms",
+			(long)(time(0) - m_issued), m_refreshes, m_keyLoads, m_signs,
+			m_signs ? m_signTime / m_signs : 0.0, m_signTimeMax);
+}
+
+/**
+ * Check if the key file has been modified since it was read. The
+ * caller must hold the mutex.
+ *
+ * @return	True if the key file has changed
+ */
+bool TokenManager::keyChanged()
+{
+struct stat st;
+
+	if (stat(m_keyPath.c_str(), &st) != 0)
+	{
+		return false;
+	}
+	return st.st_mtim.tv_sec != m_keyTime.tv_sec || st.st_mtim.tv_nsec != m_keyTime.tv_nsec;
+}
+
+/**
+ * Read the private key file. The caller must hold the mutex. If a token
+ * is in use it is marked as stale and any token signed with the previous
+ * key is discarded.
+ *
+ * @return	True if the key was read
+ */
+bool TokenManager::loadKey()
+{
+struct stat st;
+
+	FILE *fp = fopen(m_keyPath.c_str(), "r");
+	if (fp == NULL)
+	{
+		m_log->error("Could not open private key file: %s", m_keyPath.c_str());
+		return false;
+	}
+	if (fstat(fileno(fp), &st) != 0)
+	{
+		m_log->error("Failed to read key %s, %s", m_keyPath.c_str(), strerror(errno));
+		fclose(fp);
+		return false;
+	}
+	string key(st.st_size, '\0');
+	if (fread(&key[0], 1, key.length(), fp) != key.length())
+	{
+		m_log->error("Failed to read key %s", m_keyPath.c_str());
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+
+	if (m_keyLoaded)
+	{
+		m_log->info("Private key %s has changed, the JWT token will be replaced",
+				m_keyPath.c_str());
+	}
+	m_key = key;
+	m_keyTime = st.st_mtim;
+	m_keyLoaded = true;
+	m_keyLoads++;
+	m_stale = m_current != NULL;
+	free(m_next);
+	m_next = NULL;
+	m_cv.notify_all();
+	return true;
+}
+
+/**
+ * Sign a token. This does not require the mutex to be held.
+ *
+ * @param key		The private key to sign with
+ * @param issued	The issue time of the token
+ * @return		The encoded token, which the caller must free, or NULL
+ */
+char *TokenManager::sign(const string& key, time_t issued)
+{
+char iat[sizeof(time_t) * 3 + 2];
+char exp[sizeof(time_t) * 3 + 2];
+jwt_t *jwt = NULL;
+char *out = NULL;
+int ret;
+
+	snprintf(iat, sizeof(iat), "%lu", (unsigned long)issued);
+	snprintf(exp, sizeof(exp), "%lu", (unsigned long)(issued + kTokenLifetime));
+	if ((ret = jwt_new(&jwt)) != 0)
+	{
+		m_log->error("Error creating JWT token: %d", ret);
+		return NULL;
+	}
+	if ((ret = jwt_add_grant(jwt, "iat", iat)) != 0)
+	{
+		m_log->error("Error setting issue time: %d", ret);
+	}
+	else if ((ret = jwt_add_grant(jwt, "exp", exp)) != 0)
+	{
+		m_log->error("Error setting expiration: %d", ret);
+	}
+	else if ((ret = jwt_add_grant(jwt, "aud", m_audience.c_str())) != 0)
+	{
+		m_log->error("Error adding audience: %d", ret);
+	}
+	else if ((ret = jwt_set_alg(jwt, m_algorithm, (const unsigned char *)key.data(),
+				key.length())) != 0)
+	{
+		m_log->error("Error during set alg: %d", ret);
+	}
+	else if ((out = jwt_encode_str(jwt)) == NULL)
+	{
+		m_log->error("Error during JWT token creation: %d", errno);
+	}
+	jwt_free(jwt);
+	return out;
+}
+
+/**
+ * Start the background thread that signs tokens ahead of time
+ */
+void TokenManager::start()
+{
+	m_running = true;
+	m_thread = new thread(&TokenManager::refreshThread, this);
+}
+
+/**
+ * Stop the background thread
+ */
+void TokenManager::stop()
+{
+	if (m_thread)
+	{
+		{
+			lock_guard<mutex> guard(m_mutex);
+			m_running = false;
+			m_cv.notify_all();
+		}
+		m_thread->join();
+		delete m_thread;
+		m_thread = NULL;
+	}
+}
+
+/**
+ * The background thread. Once a token is in use the thread periodically
+ * checks the key file for changes and signs the next token shortly
+ * before the current token is due for rotation, or as soon as the key
+ * has changed. The mutex is not held whilst signing.
+ */
+void TokenManager::refreshThread()
+{
+	unique_lock<mutex> lck(m_mutex);
+	while (m_running)
+	{
+		time_t now = time(0);
+		bool failed = false;
+		if (m_keyLoaded && keyChanged())
+		{
+			loadKey();
+		}
+		if (m_current && !m_next && m_keyLoaded
+				&& (m_stale || now >= m_issued + kRotationTime - kSignAhead))
+		{
+			string key = m_key;
+			unsigned long keyLoads = m_keyLoads;
+			lck.unlock();
+			double start = monotonicTime();
+			char *token = sign(key, now);
+			double elapsed = monotonicTime() - start;
+			lck.lock();
+			m_signs++;
+			m_signTime += elapsed;
+			if (elapsed > m_signTimeMax)
+				m_signTimeMax = elapsed;
+			if (token && keyLoads == m_keyLoads && !m_next)
+			{
+				m_next = token;
+				m_nextIssued = now;
+				continue;
+			}
+			free(token);
+			if (keyLoads != m_keyLoads)
+			{
+				// The key changed whilst signing, sign again
+				continue;
+			}
+			failed = (token == NULL);
+		}
+		time_t wake = now + kKeyCheckInterval;
+		if (!failed && m_current && !m_next && m_issued + kRotationTime - kSignAhead < wake)
+		{
+			wake = m_issued + kRotationTime - kSignAhead;
+		}
+		m_cv.wait_until(lck, chrono::system_clock::from_time_t(wake));
+	}
+}
@@ -0,0 +1,129 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <trust_store.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <set>
+
+using namespace std;
+
+/**
+ * Constructor for the trust store
+ */
+TrustStore::TrustStore()
+{
+	m_log = Logger::getLogger();
+}
+
+/**
+ * Build the directory of certificates from a bundle of PEM certificates.
+ * Each certificate is written to a file named by the hash of its subject
+ * and a sequence number, as c_rehash would name it.
+ *
+ * @param bundle	The path of the certificate bundle
+ * @param directory	The directory to build
+ * @return		True if the directory was built
+ */
+bool TrustStore::build(const string& bundle, const string& directory)
+{
+FILE		*fp;
+X509		*cert;
+unsigned int	count = 0;
+bool		failed = false;
+set<string>	names;
+
+	m_directory.clear();
+	if ((fp = fopen(bundle.c_str(), "r")) == NULL)
+	{
+		m_log->error("Unable to open the root certificates %s, %s", bundle.c_str(),
+				strerror(errno));
+		return false;
+	}
+	if ((mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST) || !clear(directory))
+	{
+		m_log->warn("Unable to create the certificate directory %s, %s", directory.c_str(),
+				strerror(errno));
+		fclose(fp);
+		return false;
+	}
+	while (!failed && (cert = PEM_read_X509(fp, NULL, NULL, NULL)) != NULL)
+	{
+		char name[32];
+		unsigned long hash = X509_subject_name_hash(cert);
+		int index = 0;
+		do {
+			snprintf(name, sizeof(name), "%08lx.%d", hash, index++);
+		} while (names.find(name) != names.end());
+		names.insert(name);
+
+		string path = directory + "/" + name;
+		FILE *out = fopen(path.c_str(), "w");
+		if (!out || !PEM_write_X509(out, cert))
+		{
+			m_log->warn("Unable to write the certificate %s", path.c_str());
+			failed = true;
+		}
+		if (out)
+			fclose(out);
+		X509_free(cert);
+		count++;
+	}
+	// Reading past the last certificate leaves an error on the queue
+	ERR_clear_error();
+	fclose(fp);
+	if (failed || count == 0)
+	{
+		m_log->warn("The root certificates %s will be loaded on every connection", bundle.c_str());
+		return false;
+	}
+	m_directory = directory;
+	m_log->info("Prepared %u root certificates from %s in %s", count, bundle.c_str(),
+			directory.c_str());
+	return true;
+}
+
+/**
+ * Remove the certificates of a previous build of the directory
+ *
+ * @param directory	The directory to empty
+ * @return		True if the directory is empty
+ */
+bool TrustStore::clear(const string& directory)
+{
+DIR		*dir;
+struct dirent	*entry;
+bool		ok = true;
+
+	if ((dir = opendir(directory.c_str())) == NULL)
+	{
+		return false;
+	}
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+		{
+			continue;
+		}
+		string path = directory + "/" + entry->d_name;
+		if (unlink(path.c_str()) != 0)
+		{
+			ok = false;
+		}
+	}
+	closedir(dir);
+	return ok;
+}
@@ -0,0 +1,243 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <value_formatter.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * The two digit decimal strings of 0 to 99
+ */
+static const char digitPairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static const uint64_t kFixedScale = 10000000000ULL;	// 10 decimal places
+
+/**
+ * Write the decimal digits of an unsigned value, two at a time from a
+ * table of digit pairs
+ *
+ * @param buf	The buffer to write to
+ * @param value	The value
+ * @return	The number of characters written
+ */
+size_t ValueFormatter::digits(char *buf, uint64_t value)
+{
+char	tmp[20];
+char	*p = tmp + sizeof(tmp);
+
+	while (value >= 100)
+	{
+		unsigned int pair = (value % 100) * 2;
+		value /= 100;
+		*--p = digitPairs[pair + 1];
+		*--p = digitPairs[pair];
+	}
+	if (value >= 10)
+	{
+		*--p = digitPairs[value * 2 + 1];
+		*--p = digitPairs[value * 2];
+	}
+	else
+	{
+		*--p = '0' + value;
+	}
+	size_t len = tmp + sizeof(tmp) - p;
+	memcpy(buf, p, len);
+	return len;
+}
+
+/**
+ * Format an integer value
+ *
+ * @param buf	The buffer to write to, at least kMaxNumber characters
+ * @param value	The value
+ * @return	The number of characters written
+ */
+size_t ValueFormatter::integer(char *buf, long value)
+{
+	if (value < 0)
+	{
+		*buf = '-';
+		return digits(buf + 1, 0 - (uint64_t)value) + 1;
+	}
+	return digits(buf, value);
+}
+
+/**
+ * Format a floating point value as printf("%.10f") would, with the
+ * trailing zeros removed but at least one decimal digit left, as
+ * DatapointValue does.
+ *
+ * The value is rounded to ten decimal places exactly, from its binary
+ * representation, with ties rounded to even, as printf does in the
+ * default rounding mode. Values that are not finite or are too large to
+ * be rounded in 128 bit integer arithmetic are not formatted.
+ *
+ * @param buf	The buffer to write to, at least kMaxNumber characters
+ * @param value	The value
+ * @return	The number of characters written, or -1 if the value must
+ *		be formatted by printf
+ */
+int ValueFormatter::fixed(char *buf, double value)
+{
+#ifdef __SIZEOF_INT128__
+uint64_t	bits;
+uint64_t	integral = 0, fraction = 0;
+char		*p = buf;
+
+	memcpy(&bits, &value, sizeof(bits));
+	int exponent = (bits >> 52) & 0x7ff;
+	uint64_t mantissa = bits & ((1ULL << 52) - 1);
+	if (exponent == 0x7ff)
+	{
+		return -1;	// Infinity or NaN
+	}
+	if (exponent)
+	{
+		mantissa |= 1ULL << 52;
+	}
+	else
+	{
+		exponent = 1;	// Subnormal
+	}
+	exponent -= 1075;
+
+	if (mantissa == 0)
+	{
+		// Zero
+	}
+	else if (exponent >= 0)
+	{
+		if (exponent > 10)
+		{
+			return -1;
+		}
+		integral = mantissa << exponent;
+	}
+	else if (exponent >= -100)
+	{
+		// Scale by 10^10 and round to an integer, ties to even
+		unsigned int shift = -exponent;
+		unsigned __int128 scaled = (unsigned __int128)mantissa * kFixedScale;
+		unsigned __int128 quotient = scaled >> shift;
+		unsigned __int128 remainder = scaled - (quotient << shift);
+		unsigned __int128 half = (unsigned __int128)1 << (shift - 1);
+		if (remainder > half || (remainder == half && (quotient & 1)))
+		{
+			quotient++;
+		}
+		if (quotient >> 64)
+		{
+			integral = (uint64_t)(quotient / kFixedScale);
+			fraction = (uint64_t)(quotient % kFixedScale);
+		}
+		else
+		{
+			integral = (uint64_t)quotient / kFixedScale;
+			fraction = (uint64_t)quotient % kFixedScale;
+		}
+	}
+	// Smaller values round to zero
+
+	if (bits >> 63)
+	{
+		*p++ = '-';
+	}
+	p += digits(p, integral);
+	*p++ = '.';
+	if (fraction == 0)
+	{
+		*p++ = '0';
+		return p - buf;
+	}
+	int places = 10;
+	while (fraction % 10 == 0)
+	{
+		fraction /= 10;
+		places--;
+	}
+	for (int i = places - 1; i >= 0; i--)
+	{
+		p[i] = '0' + fraction % 10;
+		fraction /= 10;
+	}
+	return p + places - buf;
+#else
+	return -1;
+#endif
+}
+
+/**
+ * Format a floating point value as an output stream does by default, as
+ * DatapointValue does for the values of an array
+ *
+ * @param buf	The buffer to write to, at least kMaxNumber characters
+ * @param value	The value
+ * @return	The number of characters written
+ */
+int ValueFormatter::general(char *buf, double value)
+{
+	return snprintf(buf, kMaxNumber, "%g", value);
+}
+
+/**
+ * Find the first character of a string that must be escaped in JSON, a
+ * quote, a backslash or a control character. Sixteen characters are
+ * examined at a time where SSE2 is available.
+ *
+ * @param str		The string
+ * @param length	The length of the string
+ * @return		The index of the character, or length if there is none
+ */
+size_t ValueFormatter::escapeIndex(const char *str, size_t length)
+{
+size_t	i = 0;
+
+#ifdef __SSE2__
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i control = _mm_set1_epi8(0x1f);
+	for (; i + 16 <= length; i += 16)
+	{
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(str + i));
+		__m128i match = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+					_mm_cmpeq_epi8(chunk, backslash)),
+				// Unsigned chunk <= 0x1f
+				_mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+		int mask = _mm_movemask_epi8(match);
+		if (mask)
+		{
+			return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+	for (; i < length; i++)
+	{
+		unsigned char ch = (unsigned char)str[i];
+		if (ch == '"' || ch == '\\' || ch < 0x20)
+		{
+			return i;
+		}
+	}
+	return length;
+}
@@ -0,0 +1,99 @@
+/*
+ * Fledge Google Cloud Platform IoT-Core north plugin.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <worker_pool.h>
+
+using namespace std;
+
+/**
+ * Constructor for the worker pool
+ *
+ * @param threads	The number of threads in the pool
+ */
+WorkerPool::WorkerPool(unsigned int threads) : m_tasks(NULL), m_next(0),
+	m_remaining(0), m_running(true)
+{
+	for (unsigned int i = 0; i < threads; i++)
+	{
+		m_threads.push_back(thread(&WorkerPool::worker, this));
+	}
+}
+
+/**
+ * Destructor for the worker pool
+ */
+WorkerPool::~WorkerPool()
+{
+	{
+		lock_guard<mutex> guard(m_mutex);
+		m_running = false;
+		m_work.notify_all();
+	}
+	for (auto it = m_threads.begin(); it != m_threads.end(); it++)
+	{
+		it->join();
+	}
+}
+
+/**
+ * Run a set of tasks on the pool and wait for them all to complete
+ *
+ * @param tasks	The tasks to run
+ */
+void WorkerPool::run(const vector<function<void()> >& tasks)
+{
+	unique_lock<mutex> lck(m_mutex);
+	m_tasks = &tasks;
+	m_next = 0;
+	m_remaining = tasks.size();
+	m_work.notify_all();
+	while (runNext(lck))
+		;
+	m_done.wait(lck, [this]{ return m_remaining == 0; });
+	m_tasks = NULL;
+}
+
+/**
+ * Run the next task of the current set, if there is one. The mutex is
+ * released whilst the task runs.
+ *
+ * @param lck	The lock on the mutex
+ * @return	True if a task was run
+ */
+bool WorkerPool::runNext(unique_lock<mutex>& lck)
+{
+	if (!m_tasks || m_next >= m_tasks->size())
+	{
+		return false;
+	}
+	const function<void()>& task = (*m_tasks)[m_next++];
+	lck.unlock();
+	task();
+	lck.lock();
+	if (--m_remaining == 0)
+	{
+		m_done.notify_all();
+	}
+	return true;
+}
+
+/**
+ * The worker thread, which runs tasks until the pool is destroyed
+ */
+void WorkerPool::worker()
+{
+	unique_lock<mutex> lck(m_mutex);
+	while (m_running)
+	{
+		if (!runNext(lck))
+		{
+			m_work.wait(lck);
+		}
+	}
+}